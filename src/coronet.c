@@ -19,7 +19,12 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <time.h>
 #include <fcntl.h>
@@ -31,8 +36,19 @@
 #include <signal.h>
 #include <dirent.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
 #include "coronet.h"
 #include "coronet_lists.h"
+#include "coronet_timer.h"
+#include "coronet_trace.h"
+#if defined(CONET_USDT)
+#include <sys/sdt.h>
+#endif
 
 /*
  * Epoll support is needed, so you need a Linux kernel 2.6.x or newer,
@@ -48,33 +64,233 @@
  */
 #define CONET_MAX_FDS (1024 * 100)
 #define CONET_MAX_EVENTS 128
-#define CONET_TMOSLOTS (1 << 8)
-#define CONET_TMOMASK (CONET_TMOSLOTS - 1)
-#define CONET_TMOSTEP 1000
+#define CONET_TMOSTEP 10
+#define CONET_TMOBUDGET 4096
+#define CONET_RECLAIM_TMO 1000
+
+
+#define CONET_CTXHSIZE (1 << 12)
+#define CONET_CTXHASH(co) ((((unsigned long) (co)) >> 4) & (CONET_CTXHSIZE - 1))
+
+#define CONET_CF_WAITING (1 << 0)
+#define CONET_CF_IDLE (1 << 1)
+#define CONET_CF_HIBER (1 << 2)
+#define CONET_CF_ACCEPT (1 << 3)
+#define CONET_CF_ZC (1 << 4)
+#define CONET_CF_NOZC (1 << 5)
+#define CONET_CF_RDRAINED (1 << 6)
+#define CONET_CF_SKTYPE (1 << 7)
+#define CONET_CF_TCP (1 << 8)
+#define CONET_CF_URGENT (1 << 9)
+
+#define CONET_MAX_IDLE_WORKERS 64
+#define CONET_DRAIN_ROUNDS 8
+#define CONET_STK_VSIZE (256 * 1024)
+#define CONET_STK_KEEP (16 * 1024)
+#define CONET_STK_MAXFREE 256
+#define CONET_MAX_NODES 1024
+#define CONET_MPOL_PREFERRED 1
+#define CONET_MAX_STEERCPUS 1024
+#define CONET_ZC_THRESH (64 * 1024)
+#define CONET_BUF_MAXSIZE (CONET_BUFSIZE * 32)
+#define CONET_CTAB_INIT 1024
+#define CONET_CSLOT_NONE (~0U)
+#define CONET_CACHELINE 64
+#define CONET_PFDIST 4
+
+#if !defined(SO_INCOMING_CPU)
+#define SO_INCOMING_CPU 49
+#endif
+#if !defined(SO_ATTACH_REUSEPORT_CBPF)
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#if !defined(SO_ZEROCOPY)
+#define SO_ZEROCOPY 60
+#endif
+#if !defined(MSG_ZEROCOPY)
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#if !defined(SO_EE_ORIGIN_ZEROCOPY)
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#if !defined(SO_EE_CODE_ZEROCOPY_COPIED)
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#if !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL 46
+#endif
+#if !defined(TCP_NOTSENT_LOWAT)
+#define TCP_NOTSENT_LOWAT 25
+#endif
 
+/*
+ * Options which accepted sockets do not inherit from their listener, and
+ * which need to be set on every one of them.
+ */
+#define CONET_SO_NOINHERIT CONET_SO_QUICKACK
+#define CONET_SO_TCPMASK (CONET_SO_NODELAY | CONET_SO_NOTSENT_LOWAT | \
+			  CONET_SO_QUICKACK)
 
-#define CONET_TMONEXT(c, a) (((c) + (a)) & CONET_TMOMASK)
+#define CONET_SHAPED(c) ((c)->shp != NULL || gshaping)
 
+/*
+ * Trace points are only compiled in with --enable-trace, and record into
+ * the loop trace ring only when conet_trace_start() has been called. With
+ * --enable-usdt they are also exported as coronet:NAME USDT probes, with
+ * fd and arg as arguments.
+ */
+#if defined(CONET_TRACE)
+#if defined(CONET_USDT)
+#define CONET_USDT_PROBE(n, fd, a) DTRACE_PROBE2(coronet, n, fd, a)
+#else
+#define CONET_USDT_PROBE(n, fd, a) do { } while (0)
+#endif
+#define CONET_TRACE_POINT(n, t, fd, a, co) do { \
+	CONET_USDT_PROBE(n, fd, a); \
+	if (conet_trace_ring != NULL) \
+		conet_trace_emit(t, fd, (long long) (a), co); \
+} while (0)
+#else
+#define CONET_TRACE_POINT(n, t, fd, a, co) do { } while (0)
+#endif
+
+/*
+ * Each thread runs its own independent loop, so all the loop state is
+ * thread local.
+ */
+#define CONET_TLOCAL __thread
+
+#if defined(__GNUC__)
+#define CONET_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define CONET_PREFETCH(p) do { } while (0)
+#endif
 
 
-static int conet_buf_refil(struct sk_conn *conn);
-static int conet_yield(struct sk_conn *conn);
-static int conet_read_ll(struct sk_conn *conn, char *buf, int nbyte);
-static int conet_write_ll(struct sk_conn *conn, char const *buf, int nbyte);
-static mstime_t conet_mstime(void);
-static int conet_run_timers(mstime_t tcurr);
 
+struct conet_waiter {
+	struct ll_head lnk;
+	struct conet_tmo tmo;
+	struct conet_ctx *ctx;
+	int error;
+};
 
+/*
+ * Connection table slot. The generation is bumped every time the slot is
+ * released, so that handles (and epoll events) referring to a previous
+ * user of the slot can be recognized as stale. Free slots are chained
+ * through next.
+ */
+struct conet_cslot {
+	struct sk_conn *conn;
+	unsigned int gen;
+	unsigned int next;
+};
 
+struct conet_worker {
+	struct ll_head lnk;
+	coroutine_t co;
+	struct sk_conn *conn;
+};
 
-static int epfd = -1;
-static int max_events, ready_events, next_event;
-static struct epoll_event *evstore;
-static struct ll_head fsklist, usklist;
-static int tmobase;
-static mstime_t tmotmbase, tmotmlast;
-static struct ll_head tmolst[CONET_TMOSLOTS];
-static struct ll_head tmoovlst;
+/*
+ * Growable stack descriptor. It lives at the top of the stack mapping,
+ * which is only reserved, and gets populated on demand as the coroutine
+ * goes deeper. The lowest page is a guard one.
+ */
+struct conet_stack {
+	struct ll_head lnk;
+	char *base;
+	long size, used;
+	void (*func)(void *);
+	void *data;
+};
+
+
+
+static int conet_buf_get(struct sk_conn *conn);
+static int conet_apply_sockopts(int sfd, struct conet_sockopts const *so,
+				unsigned int mask);
+static int conet_zc_reap(struct sk_conn *conn);
+static void conet_buf_put(struct sk_conn *conn);
+static void conet_buf_adapt(struct sk_conn *conn, int n);
+static int conet_buf_refil(struct sk_conn *conn);
+static void conet_tmo_add(struct conet_tmo *tmo);
+static void conet_tmo_del(struct conet_tmo *tmo);
+static void conet_tmo_cancel(struct conet_tmo *tmo);
+static int conet_yield(struct sk_conn *conn);
+static int conet_sock_tcp(struct sk_conn *conn);
+static int conet_sock_atmark(struct sk_conn *conn);
+static int conet_sock_read(struct sk_conn *conn, char *buf, int n, int ra);
+static int conet_read_ll(struct sk_conn *conn, char *buf, int nbyte, int ra);
+static int conet_write_ll(struct sk_conn *conn, char const *buf, int nbyte);
+static mstime_t conet_mstime(void);
+static void conet_tmo_fire(struct conet_tmo *tmo, void *data);
+static void conet_timer_fire(struct conet_timer *tmr, mstime_t tcurr);
+static void conet_reclaim_timer(struct conet_timer *tmr, void *data);
+static void conet_co_run(coroutine_t co, int fd);
+static void conet_dsp_prefetch(struct epoll_event const *cevent, int left);
+static mstime_t conet_exptmo(int timeo);
+static int conet_wait(struct ll_head *wlist, mstime_t exptmo);
+static void conet_wake(struct conet_waiter *w, int error);
+static int conet_wake_one(struct ll_head *wlist, int error);
+static int conet_wake_all(struct ll_head *wlist, int error);
+static int conet_run_ready(void);
+static struct conet_ctx *conet_ctx_find(coroutine_t co);
+static int conet_ctx_check(struct conet_ctx *ctx);
+static mstime_t conet_ctx_exptmo(struct conet_ctx *ctx, mstime_t exptmo);
+static int conet_park(mstime_t exptmo);
+static void conet_tbkt_init(struct conet_tbkt *tb, unsigned long rate,
+			    unsigned long burst);
+static long conet_tbkt_avail(struct conet_tbkt *tb, mstime_t tcurr,
+			     long *wms);
+static int conet_shape(struct sk_conn *conn, int what, int n);
+static void conet_shape_consume(struct sk_conn *conn, int what, int n);
+static int conet_wake_conn(struct sk_conn *conn, int error);
+static void conet_mem_charge(long n);
+static int conet_mem_over(void);
+static void conet_mem_reclaim(void);
+static void *conet_worker_run(void *data);
+static int conet_hiber_wake(struct sk_conn *conn, int error);
+static void conet_drain_cancel(void);
+static long conet_stk_resident(struct conet_stack *stk);
+static struct conet_stack *conet_stk_get(void);
+static void conet_stk_run(void *data);
+static int conet_ctab_alloc(struct sk_conn *conn);
+static void conet_ctab_free(struct sk_conn *conn);
+
+
+
+
+static CONET_TLOCAL int epfd = -1;
+static CONET_TLOCAL int max_events, ready_events, next_event;
+static CONET_TLOCAL struct epoll_event *evstore;
+static CONET_TLOCAL struct ll_head fsklist, usklist;
+static CONET_TLOCAL struct conet_tmrwheel tmrw;
+static CONET_TLOCAL struct conet_timer rectmr;
+static CONET_TLOCAL struct ll_head rdylst;
+static CONET_TLOCAL struct ll_head parklst;
+static CONET_TLOCAL long nctxs;
+static CONET_TLOCAL struct ll_head ctxhash[CONET_CTXHSIZE];
+static CONET_TLOCAL int gshaping;
+static CONET_TLOCAL struct conet_shaper gshp;
+static CONET_TLOCAL struct conet_memcfg memcfg;
+static CONET_TLOCAL struct conet_memstats memst;
+static CONET_TLOCAL int wstksize, wmaxidle, nfworkers;
+static CONET_TLOCAL struct ll_head fwlist;
+static CONET_TLOCAL int gdraining;
+static CONET_TLOCAL struct conet_drainstats drst;
+static CONET_TLOCAL long stkvsize, stkkeep, stkpgsize;
+static CONET_TLOCAL int stkmaxfree;
+static CONET_TLOCAL struct ll_head stkfree;
+static CONET_TLOCAL struct conet_stackstats stkst;
+static CONET_TLOCAL struct conet_sockopts dsopts;
+static CONET_TLOCAL int zcthresh;
+static CONET_TLOCAL struct conet_zcstats zcst;
+static CONET_TLOCAL struct conet_iostats iost;
+static CONET_TLOCAL struct conet_cslot *ctab;
+static CONET_TLOCAL unsigned int ctsize, ctfree;
+static CONET_TLOCAL int pfdist;
 
 
 
@@ -96,40 +312,176 @@ int conet_init(void) {
 	ready_events = next_event = 0;
 	conet_llinit(&usklist);
 	conet_llinit(&fsklist);
-	tmobase = 0;
-	tmotmbase = tmotmlast = conet_mstime();
-	conet_llinit(&tmoovlst);
-	for (i = 0; i < CONET_TMOSLOTS; i++)
-		conet_llinit(&tmolst[i]);
+	conet_llinit(&rdylst);
+	conet_llinit(&parklst);
+	for (i = 0; i < CONET_CTXHSIZE; i++)
+		conet_llinit(&ctxhash[i]);
+	nctxs = 0;
+	gshaping = 0;
+	memset(&gshp, 0, sizeof(gshp));
+	memset(&memcfg, 0, sizeof(memcfg));
+	memset(&memst, 0, sizeof(memst));
+	wstksize = CONET_WORKER_STKSIZE;
+	wmaxidle = CONET_MAX_IDLE_WORKERS;
+	nfworkers = 0;
+	conet_llinit(&fwlist);
+	stkpgsize = sysconf(_SC_PAGESIZE);
+	stkvsize = CONET_STK_VSIZE;
+	stkkeep = CONET_STK_KEEP;
+	stkmaxfree = CONET_STK_MAXFREE;
+	conet_llinit(&stkfree);
+	memset(&stkst, 0, sizeof(stkst));
+	memset(&dsopts, 0, sizeof(dsopts));
+	zcthresh = CONET_ZC_THRESH;
+	memset(&zcst, 0, sizeof(zcst));
+	memset(&iost, 0, sizeof(iost));
+	ctab = NULL;
+	ctsize = 0;
+	ctfree = CONET_CSLOT_NONE;
+	pfdist = CONET_PFDIST;
+	conet_tmr_init(&tmrw, conet_mstime(), CONET_TMOSTEP);
+	conet_timer_init(&rectmr, conet_reclaim_timer, NULL);
+	conet_timer_add(&rectmr, CONET_RECLAIM_TMO, CONET_RECLAIM_TMO);
 
 	return 0;
 }
 
+/*
+ * Creates the loop of the calling thread, like conet_init() does, pinning
+ * the thread to cfg->cpu first. With CONET_LOOP_NUMA, the thread also
+ * prefers memory from the node of that CPU. Connections, buffers and stacks
+ * are all allocated (and first touched) by the loop thread, so they end up
+ * node local. The memory policy is best effort, since it might not be
+ * allowed (or needed) on the host.
+ */
+int conet_init_loop(struct conet_loopcfg const *cfg) {
+	unsigned int cpu, node;
+	unsigned long nmask[CONET_MAX_NODES / (8 * sizeof(long))];
+	cpu_set_t cset;
+
+	if (cfg != NULL && cfg->cpu >= 0) {
+		CPU_ZERO(&cset);
+		CPU_SET(cfg->cpu, &cset);
+		if (sched_setaffinity(0, sizeof(cset), &cset) != 0) {
+			perror("sched_setaffinity");
+			return -1;
+		}
+		if ((cfg->flags & CONET_LOOP_NUMA) &&
+		    syscall(SYS_getcpu, &cpu, &node, NULL) == 0 &&
+		    node < CONET_MAX_NODES) {
+			memset(nmask, 0, sizeof(nmask));
+			nmask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+			syscall(SYS_set_mempolicy, CONET_MPOL_PREFERRED, nmask,
+				CONET_MAX_NODES + 1);
+		}
+	}
+
+	return conet_init();
+}
+
 void conet_cleanup(void) {
 	struct ll_head *pos;
 	struct sk_conn *conn;
+	struct conet_worker *w;
+	struct conet_stack *stk;
 
+	conet_trace_stop();
 	while ((pos = conet_llfirst(&fsklist)) != NULL) {
 		conn = CONET_LLENT(pos, struct sk_conn, lnk);
 		conet_lldel(pos);
+		conet_buf_put(conn);
 		free(conn);
 	}
 	while ((pos = conet_llfirst(&usklist)) != NULL) {
 		conn = CONET_LLENT(pos, struct sk_conn, lnk);
 		conet_lldel(pos);
+		if (conn->xp != NULL && conn->xp->close != NULL)
+			(*conn->xp->close)(conn);
 		close(conn->sfd);
+		conet_buf_put(conn);
+		free(conn->shp);
 		free(conn);
 	}
+	while ((pos = conet_llfirst(&fwlist)) != NULL) {
+		w = CONET_LLENT(pos, struct conet_worker, lnk);
+		conet_lldel(pos);
+		co_delete(w->co);
+		free(w);
+	}
+	while ((pos = conet_llfirst(&stkfree)) != NULL) {
+		stk = CONET_LLENT(pos, struct conet_stack, lnk);
+		conet_lldel(pos);
+		munmap(stk->base, stk->size);
+	}
+	free(ctab);
+	ctab = NULL;
+	ctsize = 0;
+	ctfree = CONET_CSLOT_NONE;
 	close(epfd);
 	free(evstore);
 }
 
+static int conet_buf_get(struct sk_conn *conn) {
+
+	if ((conn->buf = (char *) malloc(CONET_BUFSIZE)) == NULL)
+		return -1;
+	conn->bsize = CONET_BUFSIZE;
+	conet_mem_charge(CONET_BUFSIZE);
+	memst.bufs++;
+
+	return 0;
+}
+
+static void conet_buf_put(struct sk_conn *conn) {
+
+	if (conn->buf != NULL) {
+		free(conn->buf);
+		conn->buf = NULL;
+		conet_mem_charge(-conn->bsize);
+		conn->bsize = 0;
+		memst.bufs--;
+	}
+}
+
+/*
+ * Adapts the buffer size to the input flow, after n bytes have been read
+ * into an empty buffer. A read filling the whole buffer likely left more
+ * data queued, so the buffer doubles (up to CONET_BUF_MAXSIZE, and within
+ * the memory budget), while a read fitting the default size shrinks it
+ * back, so that idle connections do not keep large buffers around.
+ */
+static void conet_buf_adapt(struct sk_conn *conn, int n) {
+	int nsize;
+	char *nbuf;
+
+	if (n == conn->bsize && conn->bsize < CONET_BUF_MAXSIZE &&
+	    !conet_mem_over())
+		nsize = 2 * conn->bsize;
+	else if (n <= CONET_BUFSIZE && conn->bsize > CONET_BUFSIZE)
+		nsize = CONET_BUFSIZE;
+	else
+		return;
+	if ((nbuf = (char *) realloc(conn->buf, nsize)) == NULL)
+		return;
+	conet_mem_charge(nsize - conn->bsize);
+	conn->buf = nbuf;
+	conn->bsize = nsize;
+	iost.resizes++;
+}
+
+/*
+ * The connection buffer is passed as NULL, so that conet_read_ll() can
+ * release it while the connection is parked, and fetch it again once
+ * data is available, reading up to the whole buffer size.
+ */
 static int conet_buf_refil(struct sk_conn *conn) {
 	int n;
 
 	conn->ridx = conn->bcnt = 0;
-	if ((n = conet_read_ll(conn, conn->buf, CONET_BUFSIZE)) > 0)
+	if ((n = conet_read_ll(conn, NULL, 0, 0)) > 0) {
 		conn->bcnt = n;
+		conet_buf_adapt(conn, n);
+	}
 
 	return n;
 }
@@ -143,7 +495,7 @@ int conet_readsome(struct sk_conn *conn, void *buf, int n) {
 		memcpy(buf, conn->buf + conn->ridx, cnt);
 		conn->ridx += cnt;
 	} else {
-		cnt = conet_read_ll(conn, buf, n);
+		cnt = conet_read_ll(conn, buf, n, 1);
 	}
 
 	return cnt;
@@ -177,15 +529,24 @@ char *conet_readln(struct sk_conn *conn, int *lnsize) {
 		else
 			cnt = conn->bcnt - conn->ridx;
 		nlsize = lsize + cnt;
+		if (memcfg.maxline > 0 && nlsize > memcfg.maxline) {
+			conet_mem_charge(-lsize);
+			free(ln);
+			errno = EMSGSIZE;
+			return NULL;
+		}
 		if ((nln = (char *) realloc(ln, nlsize + 1)) == NULL) {
 			perror("realloc");
+			conet_mem_charge(-lsize);
 			free(ln);
 			return NULL;
 		}
+		conet_mem_charge(cnt);
 		conet_readsome(conn, nln + lsize, cnt);
 		ln = nln;
 		lsize = nlsize;
 	}
+	conet_mem_charge(-lsize);
 	if (ln != NULL) {
 		ln[lsize] = '\0';
 		*lnsize = lsize;
@@ -194,6 +555,40 @@ char *conet_readln(struct sk_conn *conn, int *lnsize) {
 	return ln;
 }
 
+/*
+ * Moves the buffered input at the head of the connection buffer, and reads
+ * more data after it, so that parsers can work in place over data spanning
+ * multiple reads. With idle set, and no input buffered, the connection is
+ * treated as waiting for a new request, like conet_readln() does.
+ */
+int conet_fill(struct sk_conn *conn, int idle) {
+	int n;
+
+	if (conn->ridx == conn->bcnt) {
+		if (idle)
+			return conet_buf_refil(conn);
+		conn->ridx = conn->bcnt = 0;
+	} else if (conn->ridx > 0) {
+		memmove(conn->buf, conn->buf + conn->ridx, conn->bcnt - conn->ridx);
+		conn->bcnt -= conn->ridx;
+		conn->ridx = 0;
+	}
+	if (conn->buf == NULL && conet_buf_get(conn) < 0)
+		return -1;
+	if (conn->bcnt == conn->bsize) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if ((n = conet_read_ll(conn, conn->buf + conn->bcnt,
+			       conn->bsize - conn->bcnt, 0)) > 0) {
+		if (conn->bcnt == 0)
+			conet_buf_adapt(conn, n);
+		conn->bcnt += n;
+	}
+
+	return n;
+}
+
 int conet_write(struct sk_conn *conn, void const *buf, int n) {
 	int cnt, acnt;
 
@@ -209,6 +604,205 @@ int conet_write(struct sk_conn *conn, void const *buf, int n) {
 	return cnt;
 }
 
+/*
+ * Writes all the iov buffers, with as few system calls as possible. The
+ * iov array is updated while writing. Transports and shaped connections
+ * fall back to one conet_write() per buffer.
+ */
+int conet_writev(struct sk_conn *conn, struct iovec *iov, int cnt) {
+	int i, tot;
+	ssize_t n;
+
+	if (conn->xp != NULL || CONET_SHAPED(conn)) {
+		for (i = 0, tot = 0; i < cnt; i++) {
+			if (conet_write(conn, iov[i].iov_base, (int) iov[i].iov_len) < 0)
+				return -1;
+			tot += (int) iov[i].iov_len;
+		}
+		return tot;
+	}
+	for (tot = 0; cnt > 0;) {
+		if ((n = writev(conn->sfd, iov, cnt > IOV_MAX ? IOV_MAX: cnt)) >= 0) {
+			CONET_TRACE_POINT(write, CONET_TR_WRITE, conn->sfd, n, conn->co);
+			tot += (int) n;
+			for (; cnt > 0 && (size_t) n >= iov->iov_len; iov++, cnt--)
+				n -= iov->iov_len;
+			if (cnt > 0) {
+				iov->iov_base = (char *) iov->iov_base + n;
+				iov->iov_len -= n;
+			}
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!(conn->events & EPOLLOUT)) {
+			conn->events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (conet_yield(conn) < 0)
+			return -1;
+	}
+
+	return tot;
+}
+
+/*
+ * Collects the zero copy completions queued on the socket error queue.
+ * Every MSG_ZEROCOPY send gets a sequence number, and notifications carry
+ * ranges of them. A completion flagged as copied means the kernel could
+ * not avoid the copy (loopback, or devices without scatter-gather), so
+ * the connection falls back to plain writes, which are cheaper then.
+ */
+static int conet_zc_reap(struct sk_conn *conn) {
+	char cbuf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+			     sizeof(struct sockaddr_in6))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *ee;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		if (recvmsg(conn->sfd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0: -1;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == IPPROTO_IP &&
+			      cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == IPPROTO_IPV6 &&
+			      cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			conn->zcdone += ee->ee_data - ee->ee_info + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				if (!(conn->flags & CONET_CF_NOZC))
+					zcst.fallbacks++;
+				conn->flags |= CONET_CF_NOZC;
+				zcst.copied++;
+			}
+		}
+	}
+}
+
+/*
+ * Writes buf with MSG_ZEROCOPY if n is at least the zero copy threshold,
+ * or with conet_write() otherwise. The pages of buf are referenced by the
+ * kernel until the peer acknowledges the data, so buf must not be changed
+ * until conet_zc_flush() returns. Transports and shaped connections
+ * always copy.
+ */
+int conet_write_zc(struct sk_conn *conn, void const *buf, int n) {
+	int cnt, one = 1;
+	ssize_t sn;
+
+	if (zcthresh < 0 || n < zcthresh || conn->xp != NULL ||
+	    CONET_SHAPED(conn) || (conn->flags & CONET_CF_NOZC))
+		return conet_write(conn, buf, n);
+	if (!(conn->flags & CONET_CF_ZC)) {
+		if (setsockopt(conn->sfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+			conn->flags |= CONET_CF_NOZC;
+			zcst.fallbacks++;
+			return conet_write(conn, buf, n);
+		}
+		conn->flags |= CONET_CF_ZC;
+	}
+
+	/*
+	 * Completions are signaled with EPOLLERR, which epoll always reports,
+	 * so there is no need to modify the interest set for them.
+	 */
+	conn->events |= EPOLLERR | EPOLLHUP;
+	for (cnt = 0; cnt < n;) {
+		if ((sn = send(conn->sfd, (char const *) buf + cnt, n - cnt,
+			       MSG_ZEROCOPY)) >= 0) {
+			CONET_TRACE_POINT(write, CONET_TR_WRITE, conn->sfd, sn, conn->co);
+			cnt += (int) sn;
+			conn->zcsent++;
+			zcst.sends++;
+			zcst.bytes += sn;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == ENOBUFS) {
+			/*
+			 * Out of memory to track the notifications. Wait for some
+			 * to complete, or copy the rest if none is pending.
+			 */
+			if (conn->zcsent == conn->zcdone)
+				break;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		else if (!(conn->events & EPOLLOUT)) {
+			conn->events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (conet_yield(conn) < 0 ||
+		    ((conn->revents & EPOLLERR) && conet_zc_reap(conn) < 0))
+			return -1;
+	}
+	if (cnt < n && conet_write(conn, (char const *) buf + cnt, n - cnt) < 0)
+		return -1;
+
+	return n;
+}
+
+/*
+ * Waits until the kernel released all the buffers sent with conet_write_zc()
+ * on conn, after which they can be reused.
+ */
+int conet_zc_flush(struct sk_conn *conn) {
+
+	while (conn->zcdone != conn->zcsent) {
+		if (conet_zc_reap(conn) < 0)
+			return -1;
+		if (conn->zcdone == conn->zcsent)
+			break;
+		if (conet_yield(conn) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sets the minimum size of the conet_write_zc() buffers which are sent with
+ * zero copy. A negative threshold disables zero copy.
+ */
+void conet_set_zcthresh(int thresh) {
+
+	zcthresh = thresh;
+}
+
+/*
+ * Sets how many events ahead the dispatcher prefetches the connections it
+ * is about to run. Zero disables prefetching.
+ */
+void conet_set_prefetch(int dist) {
+
+	pfdist = dist > 0 ? dist: 0;
+}
+
+void conet_get_zcstats(struct conet_zcstats *st) {
+
+	*st = zcst;
+}
+
+void conet_get_iostats(struct conet_iostats *st) {
+
+	*st = iost;
+}
+
 int conet_printf(struct sk_conn *conn, char const *fmt, ...) {
 	int cnt;
 	char *wstr = NULL;
@@ -233,38 +827,143 @@ struct sk_conn *conet_new_conn(int sfd, coroutine_t co) {
 	if ((pos = conet_llfirst(&fsklist)) != NULL) {
 		conet_lldel(pos);
 		conn = CONET_LLENT(pos, struct sk_conn, lnk);
+		memst.fconns--;
 	} else {
-		if ((conn = (struct sk_conn *) malloc(sizeof(struct sk_conn))) == NULL)
+		if (posix_memalign((void **) &conn, CONET_CACHELINE,
+				   sizeof(struct sk_conn)) != 0)
 			return NULL;
+		conn->buf = NULL;
+		conn->bsize = 0;
+		conet_mem_charge(sizeof(struct sk_conn));
 	}
 	conn->co = co;
 	conn->sfd = sfd;
 	conn->error = 0;
+	conn->flags = 0;
 	conn->events = 0;
 	conn->revents = 0;
 	conn->timeo = -1;
+	conn->shp = NULL;
+	conn->sopts = NULL;
+	conn->xp = NULL;
+	conn->xpdata = NULL;
+	conn->hfn = NULL;
+	conn->hdata = NULL;
 	conn->ridx = conn->bcnt = 0;
-	conet_llinit(&conn->tlnk);
+	conn->zcsent = conn->zcdone = 0;
+	conet_llinit(&conn->tmo.lnk);
+	conn->tmo.tick = 0;
+	conn->tmo.co = co;
+	conn->tmo.error = &conn->error;
+	if (conet_ctab_alloc(conn) < 0) {
+		conet_buf_put(conn);
+		conet_mem_charge(-(long) sizeof(struct sk_conn));
+		free(conn);
+		return NULL;
+	}
 	ev.events = 0;
-	ev.data.ptr = conn;
+	ev.data.u64 = conet_conn_handle(conn);
 	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
 		fprintf(stderr, "epoll set insertion error (%s): fd=%d\n",
 			strerror(errno), sfd);
+		conet_ctab_free(conn);
+		conet_buf_put(conn);
+		conet_mem_charge(-(long) sizeof(struct sk_conn));
 		free(conn);
 		return NULL;
 	}
 	conet_lladdt(&conn->lnk, &usklist);
+	conet_mem_charge(memcfg.conn_extra);
+	memst.conns++;
 
 	return conn;
 }
 
 void conet_close_conn(struct sk_conn *conn) {
 
+	if (conn->xp != NULL && conn->xp->close != NULL)
+		(*conn->xp->close)(conn);
+	conn->xp = NULL;
+	conn->xpdata = NULL;
 	close(conn->sfd);
 	conn->sfd = -1;
-	conet_lldel(&conn->tlnk);
+	free(conn->shp);
+	conn->shp = NULL;
+	conet_tmo_del(&conn->tmo);
+	conet_lldel(&conn->tmo.lnk);
+	conet_ctab_free(conn);
 	conet_lldel(&conn->lnk);
 	conet_lladdh(&conn->lnk, &fsklist);
+	if (conn->flags & CONET_CF_HIBER)
+		memst.hconns--;
+	else
+		conet_mem_charge(-memcfg.conn_extra);
+	memst.conns--;
+	memst.fconns++;
+}
+
+/*
+ * Slot allocation for the connection table. Released slots are reused in
+ * LIFO order, so the hot part of the table stays compact, and the table
+ * doubles when full. Connections are not stored inline, since applications
+ * hold on to their pointers, while the table moves when it grows.
+ */
+static int conet_ctab_alloc(struct sk_conn *conn) {
+	unsigned int i, nsize;
+	struct conet_cslot *ntab;
+
+	if (ctfree == CONET_CSLOT_NONE) {
+		nsize = ctsize != 0 ? 2 * ctsize: CONET_CTAB_INIT;
+		if (nsize <= ctsize ||
+		    (ntab = (struct conet_cslot *)
+		     realloc(ctab, nsize * sizeof(struct conet_cslot))) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (i = nsize; i > ctsize; i--) {
+			ntab[i - 1].conn = NULL;
+			ntab[i - 1].gen = 1;
+			ntab[i - 1].next = ctfree;
+			ctfree = i - 1;
+		}
+		ctab = ntab;
+		ctsize = nsize;
+	}
+	conn->cslot = ctfree;
+	ctfree = ctab[ctfree].next;
+	ctab[conn->cslot].conn = conn;
+
+	return 0;
+}
+
+static void conet_ctab_free(struct sk_conn *conn) {
+	struct conet_cslot *cs = ctab + conn->cslot;
+
+	cs->conn = NULL;
+	if (++cs->gen == 0)
+		cs->gen = 1;
+	cs->next = ctfree;
+	ctfree = conn->cslot;
+}
+
+/*
+ * Returns the handle of conn, which packs its table slot and the slot
+ * generation. Handles are never zero, and once the connection is closed
+ * conet_conn_get() will no longer resolve them, even if the connection
+ * structure (or its slot) got reused.
+ */
+conet_handle_t conet_conn_handle(struct sk_conn *conn) {
+
+	return ((conet_handle_t) ctab[conn->cslot].gen << 32) | conn->cslot;
+}
+
+struct sk_conn *conet_conn_get(conet_handle_t h) {
+	unsigned int slot = (unsigned int) h;
+
+	if (slot >= ctsize || ctab[slot].gen != (unsigned int) (h >> 32))
+		return NULL;
+
+	return ctab[slot].conn;
 }
 
 /*
@@ -280,22 +979,65 @@ int conet_set_timeo(struct sk_conn *conn, int timeo) {
 	return 0;
 }
 
-static int conet_yield(struct sk_conn *conn) {
-	int tidx;
+static void conet_tmo_add(struct conet_tmo *tmo) {
 
-	if (conn->timeo > 0) {
-		conn->exptmo = conet_mstime() + conn->timeo;
-		if (conn->exptmo - tmotmbase >= CONET_TMOSLOTS * CONET_TMOSTEP)
-			conet_lladdt(&conn->tlnk, &tmoovlst);
-		else {
-			tidx = (conn->exptmo - tmotmbase) / CONET_TMOSTEP;
-			tidx = CONET_TMONEXT(tmobase, tidx);
-			conet_lladdt(&conn->tlnk, &tmolst[tidx]);
+	conet_tmr_add(&tmrw, tmo);
+}
+
+static void conet_tmo_del(struct conet_tmo *tmo) {
+
+	conet_tmr_del(&tmrw, tmo);
+}
+
+/*
+ * Only the connections can use this, since their timeout entry outlives
+ * the wait, while the waiters one lives on the stack.
+ */
+static void conet_tmo_cancel(struct conet_tmo *tmo) {
+
+	conet_tmr_cancel(tmo);
+}
+
+static int conet_yield(struct sk_conn *conn) {
+	mstime_t exptmo;
+	struct conet_ctx *ctx;
+
+	exptmo = conn->timeo > 0 ? conet_mstime() + conn->timeo: 0;
+	if ((ctx = conet_ctx_find(co_current())) != NULL) {
+		if ((conn->error = conet_ctx_check(ctx)) < 0) {
+			errno = -conn->error;
+			return conn->error;
 		}
+		exptmo = conet_ctx_exptmo(ctx, exptmo);
+		ctx->bconn = conn;
+	}
+	if (exptmo) {
+		conn->tmo.exptmo = exptmo;
+		conet_tmo_add(&conn->tmo);
 	}
+
+	/*
+	 * Keep the connections list in least recently active order, so that
+	 * idle connections shedding can pick the oldest ones first.
+	 */
+	conet_lldel(&conn->lnk);
+	conet_lladdt(&conn->lnk, &usklist);
+	conn->flags |= CONET_CF_WAITING;
+	CONET_TRACE_POINT(yield, CONET_TR_YIELD, conn->sfd, conn->events,
+			  conn->co);
 	co_resume();
-	if (!conet_llempty(&conn->tlnk))
-		conet_lldel_init(&conn->tlnk);
+	conn->flags &= ~CONET_CF_WAITING;
+
+	/*
+	 * Most waits end with I/O rather than a timeout, and are followed by
+	 * another one with a later expire time. Leaving the entry on the wheel
+	 * lets the next conet_yield() re-arm it without touching any list.
+	 */
+	conet_tmo_cancel(&conn->tmo);
+	if (ctx != NULL)
+		ctx->bconn = NULL;
+	if (conn->error < 0)
+		errno = -conn->error;
 
 	return conn->error;
 }
@@ -303,8 +1045,16 @@ static int conet_yield(struct sk_conn *conn) {
 int conet_mod_conn(struct sk_conn *conn, unsigned int events) {
 	struct epoll_event ev;
 
+	/*
+	 * Without EPOLLIN in the interest set, new input would go unreported,
+	 * so a drained socket must be read again.
+	 */
+	if (!(events & EPOLLIN))
+		conn->flags &= ~CONET_CF_RDRAINED;
+	else
+		events |= EPOLLPRI;
 	ev.events = events | EPOLLET;
-	ev.data.ptr = conn;
+	ev.data.u64 = conet_conn_handle(conn);
 	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->sfd, &ev) < 0) {
 		fprintf(stderr, "epoll set modify error (%s): fd=%d\n",
 			strerror(errno), conn->sfd);
@@ -314,26 +1064,208 @@ int conet_mod_conn(struct sk_conn *conn, unsigned int events) {
 	return 0;
 }
 
+/*
+ * Removes the connection socket from the loop epoll set. Closing a socket
+ * drops its epoll registration only once no other descriptor refers to
+ * the same open file, so a socket which has been duplicated, or passed to
+ * another process, would keep generating events on this loop after the
+ * connection is closed. After this, the connection can only be closed.
+ */
+int conet_detach_conn(struct sk_conn *conn) {
+
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, conn->sfd, NULL) < 0) {
+		fprintf(stderr, "epoll set removal error (%s): fd=%d\n",
+			strerror(errno), conn->sfd);
+		return -1;
+	}
+
+	return 0;
+}
+
 int conet_socket(int domain, int type, int protocol) {
-	int sfd, flags = 1;
+	int sfd;
+	unsigned int mask;
 	struct linger ling = { 0, 0 };
 
-	if ((sfd = socket(domain, type, protocol)) == -1) {
+	if ((sfd = socket(domain, type | SOCK_NONBLOCK, protocol)) == -1) {
 		perror("socket");
 		return -1;
 	}
 	setsockopt(sfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
-	if (ioctl(sfd, FIONBIO, &flags) &&
-	    ((flags = fcntl(sfd, F_GETFL, 0)) < 0 ||
-	     fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
-		perror("setting O_NONBLOCK");
-		close(sfd);
-		return -1;
+	if ((mask = dsopts.mask) != 0) {
+		if ((type & 0xf) != SOCK_STREAM)
+			mask &= ~(CONET_SO_TCPMASK | CONET_SO_KEEPALIVE);
+		conet_apply_sockopts(sfd, &dsopts, mask);
 	}
 
 	return sfd;
 }
 
+static int conet_apply_sockopts(int sfd, struct conet_sockopts const *so,
+				unsigned int mask) {
+	int error = 0;
+
+	if ((mask & CONET_SO_NODELAY) &&
+	    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &so->nodelay, sizeof(int)))
+		error = -1;
+	if ((mask & CONET_SO_SNDBUF) &&
+	    setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &so->sndbuf, sizeof(int)))
+		error = -1;
+	if ((mask & CONET_SO_RCVBUF) &&
+	    setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &so->rcvbuf, sizeof(int)))
+		error = -1;
+	if ((mask & CONET_SO_NOTSENT_LOWAT) &&
+	    setsockopt(sfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &so->notsent_lowat,
+		       sizeof(int)))
+		error = -1;
+	if ((mask & CONET_SO_QUICKACK) &&
+	    setsockopt(sfd, IPPROTO_TCP, TCP_QUICKACK, &so->quickack, sizeof(int)))
+		error = -1;
+	if ((mask & CONET_SO_BUSY_POLL) &&
+	    setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &so->busy_poll, sizeof(int)))
+		error = -1;
+	if (mask & CONET_SO_KEEPALIVE) {
+		if (setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, &so->keepalive,
+			       sizeof(int)))
+			error = -1;
+		if (so->kaidle &&
+		    setsockopt(sfd, IPPROTO_TCP, TCP_KEEPIDLE, &so->kaidle, sizeof(int)))
+			error = -1;
+		if (so->kaintvl &&
+		    setsockopt(sfd, IPPROTO_TCP, TCP_KEEPINTVL, &so->kaintvl,
+			       sizeof(int)))
+			error = -1;
+		if (so->kacnt &&
+		    setsockopt(sfd, IPPROTO_TCP, TCP_KEEPCNT, &so->kacnt, sizeof(int)))
+			error = -1;
+	}
+
+	return error;
+}
+
+/*
+ * Sets the options profile of conn, or the default one applied by
+ * conet_socket() if conn is NULL. The profile is referenced, not copied.
+ * A listener profile is applied to the listener itself, whose options are
+ * inherited by the accepted sockets, so that only the non inheritable ones
+ * need to be set by conet_accept(). Returns -1 if any option failed.
+ */
+int conet_set_sockopts(struct sk_conn *conn, struct conet_sockopts const *so) {
+	struct linger ling = { 0, 0 };
+
+	if (conn == NULL) {
+		if (so != NULL)
+			dsopts = *so;
+		else
+			memset(&dsopts, 0, sizeof(dsopts));
+		return 0;
+	}
+	if ((conn->sopts = so) == NULL)
+		return 0;
+	setsockopt(conn->sfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+
+	return conet_apply_sockopts(conn->sfd, so, so->mask);
+}
+
+/*
+ * Reads back the current value of the options selected by so->mask, and
+ * clears from the mask the ones which could not be read.
+ */
+int conet_get_sockopts(int sfd, struct conet_sockopts *so) {
+	unsigned int i, mask = so->mask;
+	socklen_t len;
+	static struct {
+		unsigned int bit;
+		int level, opt;
+		size_t off;
+	} const sotab[] = {
+		{ CONET_SO_NODELAY, IPPROTO_TCP, TCP_NODELAY,
+		  offsetof(struct conet_sockopts, nodelay) },
+		{ CONET_SO_SNDBUF, SOL_SOCKET, SO_SNDBUF,
+		  offsetof(struct conet_sockopts, sndbuf) },
+		{ CONET_SO_RCVBUF, SOL_SOCKET, SO_RCVBUF,
+		  offsetof(struct conet_sockopts, rcvbuf) },
+		{ CONET_SO_NOTSENT_LOWAT, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+		  offsetof(struct conet_sockopts, notsent_lowat) },
+		{ CONET_SO_QUICKACK, IPPROTO_TCP, TCP_QUICKACK,
+		  offsetof(struct conet_sockopts, quickack) },
+		{ CONET_SO_BUSY_POLL, SOL_SOCKET, SO_BUSY_POLL,
+		  offsetof(struct conet_sockopts, busy_poll) },
+		{ CONET_SO_KEEPALIVE, SOL_SOCKET, SO_KEEPALIVE,
+		  offsetof(struct conet_sockopts, keepalive) },
+		{ CONET_SO_KEEPALIVE, IPPROTO_TCP, TCP_KEEPIDLE,
+		  offsetof(struct conet_sockopts, kaidle) },
+		{ CONET_SO_KEEPALIVE, IPPROTO_TCP, TCP_KEEPINTVL,
+		  offsetof(struct conet_sockopts, kaintvl) },
+		{ CONET_SO_KEEPALIVE, IPPROTO_TCP, TCP_KEEPCNT,
+		  offsetof(struct conet_sockopts, kacnt) },
+	};
+
+	for (i = 0; i < sizeof(sotab) / sizeof(sotab[0]); i++) {
+		if (!(mask & sotab[i].bit))
+			continue;
+		len = sizeof(int);
+		if (getsockopt(sfd, sotab[i].level, sotab[i].opt,
+			       (char *) so + sotab[i].off, &len))
+			so->mask &= ~sotab[i].bit;
+	}
+
+	return 0;
+}
+
+/*
+ * Attaches to the SO_REUSEPORT group of sfd a program selecting, for every
+ * new connection, the listener of the loop running on the CPU which got
+ * the connection packets. The n listeners of the group must have been
+ * bound in order, with the i-th one served by a loop pinned to cpus[i].
+ * CPUs not in the list (or all of them, with a NULL cpus) are spread by
+ * CPU number modulo n.
+ */
+int conet_reuseport_steer(int sfd, int const *cpus, int n) {
+	int i, ncode = 0, error;
+	struct sock_filter *code;
+	struct sock_fprog prog;
+
+	if (n <= 0 || (cpus != NULL && n > CONET_MAX_STEERCPUS)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((code = (struct sock_filter *)
+	     malloc((2 * (cpus != NULL ? n: 0) + 3) *
+		    sizeof(struct sock_filter))) == NULL)
+		return -1;
+	code[ncode++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (i = 0; cpus != NULL && i < n; i++) {
+		code[ncode++] = (struct sock_filter)
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+		code[ncode++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	code[ncode++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+	code[ncode++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+	prog.len = ncode;
+	prog.filter = code;
+	error = setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+			   sizeof(prog));
+	free(code);
+
+	return error;
+}
+
+/*
+ * Returns the CPU which processed the last packets received by conn, or
+ * -1 in case of error.
+ */
+int conet_conn_cpu(struct sk_conn *conn) {
+	int cpu;
+	socklen_t len = sizeof(cpu);
+
+	if (getsockopt(conn->sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+		return -1;
+
+	return cpu;
+}
+
 int conet_connect(struct sk_conn *conn, const struct sockaddr *serv_addr,
 		  socklen_t addrlen) {
 
@@ -353,51 +1285,208 @@ int conet_connect(struct sk_conn *conn, const struct sockaddr *serv_addr,
 	return 0;
 }
 
-static int conet_read_ll(struct sk_conn *conn, char *buf, int nbyte) {
-	int n;
+/*
+ * Only on TCP sockets a short read means an empty receive queue, since
+ * AF_UNIX stream reads also stop at ancillary data boundaries (passed fds
+ * or credentials), with more data still queued.
+ */
+static int conet_sock_tcp(struct sk_conn *conn) {
+	int type, domain, proto;
+	socklen_t len;
+
+	if (!(conn->flags & CONET_CF_SKTYPE)) {
+		conn->flags |= CONET_CF_SKTYPE;
+		len = sizeof(type);
+		if (getsockopt(conn->sfd, SOL_SOCKET, SO_TYPE, &type, &len) != 0 ||
+		    type != SOCK_STREAM)
+			return 0;
+		len = sizeof(domain);
+		if (getsockopt(conn->sfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0 ||
+		    (domain != AF_INET && domain != AF_INET6))
+			return 0;
+		len = sizeof(proto);
+		if (getsockopt(conn->sfd, SOL_SOCKET, SO_PROTOCOL, &proto, &len) == 0 &&
+		    proto == IPPROTO_TCP)
+			conn->flags |= CONET_CF_TCP;
+	}
 
-	while ((n = read(conn->sfd, buf, nbyte)) < 0) {
-		if (errno == EINTR)
-			continue;
-		if (errno != EAGAIN && errno != EWOULDBLOCK)
-			return -1;
-		if (!(conn->events & EPOLLIN)) {
-			conn->events = EPOLLIN | EPOLLERR | EPOLLHUP;
-			if (conet_mod_conn(conn, conn->events) < 0)
+	return (conn->flags & CONET_CF_TCP) != 0;
+}
+
+/*
+ * TCP reads stop at the urgent mark too. Urgent data is reported with
+ * EPOLLPRI, so the (otherwise useless) SIOCATMARK check is only done on
+ * connections which have seen it.
+ */
+static int conet_sock_atmark(struct sk_conn *conn) {
+	int atmark;
+
+	if (!(conn->flags & CONET_CF_URGENT))
+		return 0;
+
+	return ioctl(conn->sfd, SIOCATMARK, &atmark) != 0 || atmark;
+}
+
+/*
+ * Reads from the socket of a connection with no transport. On a TCP
+ * socket, a read shorter than requested drained the receive queue, and
+ * since edge triggered epoll reports any new input as a new event, the
+ * next read can go straight to wait for it, saving the EAGAIN system call.
+ * With ra, and the connection buffer empty, data beyond n is read ahead
+ * into the connection buffer with the same system call.
+ */
+static int conet_sock_read(struct sk_conn *conn, char *buf, int n, int ra) {
+	int cnt, tot = n;
+	struct iovec iov[2];
+
+	if (conn->flags & CONET_CF_RDRAINED) {
+		iost.rdskips++;
+		errno = EAGAIN;
+		return -1;
+	}
+	iost.rdcalls++;
+	if (ra && conn->buf != NULL && !CONET_SHAPED(conn)) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = n;
+		iov[1].iov_base = conn->buf;
+		iov[1].iov_len = conn->bsize;
+		tot += conn->bsize;
+		cnt = (int) readv(conn->sfd, iov, 2);
+	} else
+		cnt = (int) read(conn->sfd, buf, n);
+	if (cnt < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			iost.rdagain++;
+		return -1;
+	}
+	iost.rdbytes += cnt;
+	CONET_TRACE_POINT(read, CONET_TR_READ, conn->sfd, cnt, conn->co);
+	if (cnt > 0 && cnt < tot && conet_sock_tcp(conn) &&
+	    !conet_sock_atmark(conn))
+		conn->flags |= CONET_CF_RDRAINED;
+	if (cnt > n) {
+		conn->ridx = 0;
+		conn->bcnt = cnt - n;
+		iost.rabytes += cnt - n;
+		cnt = n;
+	}
+
+	return cnt;
+}
+
+static int conet_read_ll(struct sk_conn *conn, char *buf, int nbyte, int ra) {
+	int n, cnt, error;
+	unsigned int events;
+	char *rbuf;
+
+	for (;;) {
+		if ((rbuf = buf) == NULL) {
+			if (conn->buf == NULL && conet_buf_get(conn) < 0)
 				return -1;
+			rbuf = conn->buf;
+			nbyte = conn->bsize;
 		}
-		if (conet_yield(conn) < 0)
+		cnt = nbyte;
+		if (CONET_SHAPED(conn) &&
+		    (cnt = conet_shape(conn, CONET_RATE_RX, nbyte)) < 0)
+			return -1;
+		if (conn->xp == NULL) {
+			if ((n = conet_sock_read(conn, rbuf, cnt, ra)) >= 0)
+				break;
+			events = EPOLLIN;
+		} else if ((n = (*conn->xp->read)(conn, rbuf, cnt, &events)) >= 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!(conn->events & events)) {
+			conn->events = events | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (buf == NULL) {
+			/*
+			 * While draining, a connection going idle is closed, rather
+			 * than waiting for its next request.
+			 */
+			if (gdraining) {
+				drst.idle++;
+				errno = ESHUTDOWN;
+				return -1;
+			}
+			conn->flags |= CONET_CF_IDLE;
+			if ((memcfg.policy & CONET_SHED_SHRINK) && conet_mem_over()) {
+				conet_buf_put(conn);
+				memst.shrunk++;
+			}
+		}
+		error = conet_yield(conn);
+		conn->flags &= ~CONET_CF_IDLE;
+		if (error < 0)
 			return -1;
 	}
+	if (n > 0 && CONET_SHAPED(conn))
+		conet_shape_consume(conn, CONET_RATE_RX, n);
 
 	return n;
 }
 
 static int conet_write_ll(struct sk_conn *conn, char const *buf, int nbyte) {
-	int n;
+	int n, cnt;
+	unsigned int events;
 
-	while ((n = write(conn->sfd, buf, nbyte)) < 0) {
+	for (;;) {
+		cnt = nbyte;
+		if (CONET_SHAPED(conn) &&
+		    (cnt = conet_shape(conn, CONET_RATE_TX, nbyte)) < 0)
+			return -1;
+		if (conn->xp == NULL) {
+			if ((n = write(conn->sfd, buf, cnt)) >= 0)
+				break;
+			events = EPOLLOUT;
+		} else if ((n = (*conn->xp->write)(conn, buf, cnt, &events)) >= 0)
+			break;
 		if (errno == EINTR)
 			continue;
 		if (errno != EAGAIN && errno != EWOULDBLOCK)
 			return -1;
-		if (!(conn->events & EPOLLOUT)) {
-			conn->events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+		if (!(conn->events & events)) {
+			conn->events = events | EPOLLERR | EPOLLHUP;
 			if (conet_mod_conn(conn, conn->events) < 0)
 				return -1;
 		}
 		if (conet_yield(conn) < 0)
 			return -1;
 	}
+	CONET_TRACE_POINT(write, CONET_TR_WRITE, conn->sfd, n, conn->co);
+	if (n > 0 && CONET_SHAPED(conn))
+		conet_shape_consume(conn, CONET_RATE_TX, n);
 
 	return n;
 }
 
 int conet_accept(struct sk_conn *conn, struct sockaddr *addr, int *addrlen) {
-	int cfd, flags = 1;
+	int cfd, error;
 	struct linger ling = { 0, 0 };
+	struct conet_sockopts const *so;
 
-	while ((cfd = accept(conn->sfd, addr, (socklen_t *) addrlen)) < 0) {
+	for (;;) {
+		if (gdraining) {
+			errno = ESHUTDOWN;
+			return -1;
+		}
+		if ((cfd = accept4(conn->sfd, addr, (socklen_t *) addrlen,
+				   SOCK_NONBLOCK)) >= 0) {
+			if (!(memcfg.policy & CONET_SHED_REJECT) || !conet_mem_over())
+				break;
+			conet_mem_reclaim();
+			if (!conet_mem_over())
+				break;
+			close(cfd);
+			memst.rejected++;
+			continue;
+		}
 		if (errno == EINTR)
 			continue;
 		if (errno != EAGAIN && errno != EWOULDBLOCK)
@@ -407,17 +1496,23 @@ int conet_accept(struct sk_conn *conn, struct sockaddr *addr, int *addrlen) {
 			if (conet_mod_conn(conn, conn->events) < 0)
 				return -1;
 		}
-		if (conet_yield(conn) < 0)
+		conn->flags |= CONET_CF_ACCEPT;
+		error = conet_yield(conn);
+		conn->flags &= ~CONET_CF_ACCEPT;
+		if (error < 0)
 			return -1;
 	}
-	setsockopt(cfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
-	if (ioctl(cfd, FIONBIO, &flags) &&
-	    ((flags = fcntl(cfd, F_GETFL, 0)) < 0 ||
-	     fcntl(cfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
-		perror("setting O_NONBLOCK");
-		close(cfd);
-		return -1;
+
+	/*
+	 * A listener with a profile has the lingering and all the inheritable
+	 * options already set, so only the others cost a system call here.
+	 */
+	if ((so = conn->sopts) == NULL) {
+		setsockopt(cfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+		so = &dsopts;
 	}
+	if (so->mask & CONET_SO_NOINHERIT)
+		conet_apply_sockopts(cfd, so, so->mask & CONET_SO_NOINHERIT);
 
 	return cfd;
 }
@@ -437,6 +1532,217 @@ struct sk_conn *conet_create_conn(int domain, int type, int protocol,
 	return conn;
 }
 
+/*
+ * Receives up to vlen datagrams with a single syscall, waiting for the
+ * first one to arrive. Returns the number of received datagrams, with
+ * their sizes stored in the msg_len fields, or -1 in case of error.
+ */
+int conet_recvmmsg(struct sk_conn *conn, struct mmsghdr *msgs,
+		   unsigned int vlen, int flags) {
+	int i, n;
+	long nbytes;
+
+	for (;;) {
+		if (CONET_SHAPED(conn) && conet_shape(conn, CONET_RATE_RX, 1) < 0)
+			return -1;
+		if ((n = recvmmsg(conn->sfd, msgs, vlen, flags, NULL)) > 0)
+			break;
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!(conn->events & EPOLLIN)) {
+			conn->events = EPOLLIN | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (conet_yield(conn) < 0)
+			return -1;
+	}
+	if (CONET_SHAPED(conn)) {
+		for (i = 0, nbytes = 0; i < n; i++)
+			nbytes += msgs[i].msg_len;
+		conet_shape_consume(conn, CONET_RATE_RX, (int) nbytes);
+	}
+
+	return n;
+}
+
+/*
+ * Sends the vlen datagrams, batching as many of them as the socket takes
+ * per syscall, and waiting for the socket to drain when needed. Returns
+ * the number of datagrams sent, which is less than vlen only if an error
+ * hit after some of them went out, or -1 in case of error.
+ */
+int conet_sendmmsg(struct sk_conn *conn, struct mmsghdr *msgs,
+		   unsigned int vlen, int flags) {
+	int i, n;
+	unsigned int sent;
+	long nbytes;
+
+	for (sent = 0; sent < vlen;) {
+		if (CONET_SHAPED(conn) && conet_shape(conn, CONET_RATE_TX, 1) < 0)
+			break;
+		if ((n = sendmmsg(conn->sfd, msgs + sent, vlen - sent, flags)) > 0) {
+			if (CONET_SHAPED(conn)) {
+				for (i = 0, nbytes = 0; i < n; i++)
+					nbytes += msgs[sent + i].msg_len;
+				conet_shape_consume(conn, CONET_RATE_TX, (int) nbytes);
+			}
+			sent += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+		if (!(conn->events & EPOLLOUT)) {
+			conn->events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				break;
+		}
+		if (conet_yield(conn) < 0)
+			break;
+	}
+
+	return sent > 0 ? (int) sent: -1;
+}
+
+/*
+ * Configures UDP segmentation offloads. A non zero gso sets the default
+ * segment size for sends, so that a single large datagram payload gets
+ * split into gso sized datagrams by the kernel (or the NIC). A non zero
+ * gro lets the kernel coalesce received datagrams, whose segment size is
+ * then reported by an UDP_GRO control message.
+ */
+int conet_set_udpseg(struct sk_conn *conn, int gso, int gro) {
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+
+	if (setsockopt(conn->sfd, IPPROTO_UDP, UDP_SEGMENT, &gso, sizeof(gso)) < 0 ||
+	    setsockopt(conn->sfd, IPPROTO_UDP, UDP_GRO, &gro, sizeof(gro)) < 0)
+		return -1;
+
+	return 0;
+#else
+
+	errno = ENOPROTOOPT;
+
+	return -1;
+#endif
+}
+
+/*
+ * Sends up to n bytes of buf over the conn Unix domain socket, together
+ * with the fd file descriptor. At least one byte of data must be sent,
+ * since ancillary data cannot travel alone over stream sockets.
+ */
+int conet_sendfd(struct sk_conn *conn, int fd, void const *buf, int n) {
+	int res;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+
+	if (n <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	iov.iov_base = (void *) buf;
+	iov.iov_len = n;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.data;
+	msg.msg_controllen = sizeof(cbuf.data);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	for (;;) {
+		if ((res = sendmsg(conn->sfd, &msg, MSG_NOSIGNAL)) >= 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!(conn->events & EPOLLOUT)) {
+			conn->events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (conet_yield(conn) < 0)
+			return -1;
+	}
+
+	return res;
+}
+
+/*
+ * Receives up to n bytes in buf from the conn Unix domain socket, storing
+ * in *fd the file descriptor which came with them, or -1 if none did. This
+ * bypasses the conn buffer, so it must not be mixed with buffered reads.
+ */
+int conet_recvfd(struct sk_conn *conn, int *fd, void *buf, int n) {
+	int i, res, nfds, *fds;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(int) * 4)];
+	} cbuf;
+
+	*fd = -1;
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.data;
+	msg.msg_controllen = sizeof(cbuf.data);
+	for (;;) {
+		if ((res = recvmsg(conn->sfd, &msg, MSG_CMSG_CLOEXEC)) >= 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!(conn->events & EPOLLIN)) {
+			conn->events = EPOLLIN | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (conet_yield(conn) < 0)
+			return -1;
+	}
+
+	/*
+	 * Only one descriptor per message is handed to the caller, and any
+	 * extra one a misbehaving peer might have sent is closed.
+	 */
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		fds = (int *) CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			if (*fd == -1)
+				*fd = fds[i];
+			else
+				close(fds[i]);
+		}
+	}
+
+	return res;
+}
+
 static mstime_t conet_mstime(void) {
 	struct timeval tv;
 
@@ -446,66 +1752,81 @@ static mstime_t conet_mstime(void) {
 	return 1000ULL * tv.tv_sec + tv.tv_usec / 1000;
 }
 
-static int conet_run_timers(mstime_t tcurr) {
-	int i, base, tcount, xcount;
-	struct ll_head *pos, *head;
+static void conet_tmo_fire(struct conet_tmo *tmo, void *data) {
+
+	/*
+	 * Hibernated connections have no coroutine, and get their handler
+	 * invoked on a pooled one with the error set. Callback timers have
+	 * neither a coroutine nor an error to report.
+	 */
+	if (tmo->co == NULL) {
+		if (tmo->error == NULL)
+			conet_timer_fire(CONET_LLENT(tmo, struct conet_timer, tmo),
+					 *(mstime_t *) data);
+		else
+			conet_hiber_wake(CONET_LLENT(tmo, struct sk_conn, tmo),
+					 -ETIMEDOUT);
+		return;
+	}
+	*tmo->error = -ETIMEDOUT;
+	errno = ETIMEDOUT;
+	CONET_TRACE_POINT(timer, CONET_TR_TIMER, -1, tmo->exptmo, tmo->co);
+	conet_co_run(tmo->co, -1);
+}
+
+/*
+ * With many active connections the dispatcher is bound by memory latency,
+ * so the upcoming events get prefetched in stages. The table slots are
+ * fetched two distances ahead, the connections one distance ahead (their
+ * slots being cached by then), and the coroutine of the next event, whose
+ * connection is cached as well. Stale events only cost a useless prefetch.
+ */
+static void conet_dsp_prefetch(struct epoll_event const *cevent, int left) {
+	unsigned int slot;
 	struct sk_conn *conn;
 
-	i = base = tmobase;
-	do {
-		tcount = xcount = 0;
-		head = &tmolst[i];
-		for (pos = conet_llfirst(head); pos != NULL;) {
-			conn = CONET_LLENT(pos, struct sk_conn, tlnk);
-			pos = conet_llnext(pos, head);
-			if (conn->exptmo >= tcurr) {
-				xcount++;
-				conet_lldel_init(&conn->tlnk);
-				conn->error = -ETIMEDOUT;
-				errno = ETIMEDOUT;
-				co_call(conn->co);
-			} else
-				tcount++;
-		}
-		if (tcount == 0) {
-			if (tmotmbase + CONET_TMOSTEP > tcurr)
-				break;
-			tmobase = CONET_TMONEXT(i, 1);
-			tmotmbase += CONET_TMOSTEP;
-		} else if (xcount == 0) {
-			break;
-		}
-		i = CONET_TMONEXT(i, 1);
-	} while (i != base);
-	for (pos = conet_llfirst(&tmoovlst); pos != NULL;) {
-		conn = CONET_LLENT(pos, struct sk_conn, tlnk);
-		pos = conet_llnext(pos, &tmoovlst);
-		if (conn->exptmo >= tcurr) {
-			conet_lldel_init(&conn->tlnk);
-			conn->error = -ETIMEDOUT;
-			errno = ETIMEDOUT;
-			co_call(conn->co);
-		} else if (conn->exptmo - tmotmbase < CONET_TMOSLOTS * CONET_TMOSTEP) {
-			i = (conn->exptmo - tmotmbase) / CONET_TMOSTEP;
-			i = CONET_TMONEXT(tmobase, i);
-			conet_lldel(&conn->tlnk);
-			conet_lladdt(&conn->tlnk, &tmolst[i]);
-		}
-	}
+	if (2 * pfdist < left)
+		CONET_PREFETCH(ctab + (unsigned int) cevent[2 * pfdist].data.u64);
+	if (pfdist < left &&
+	    (slot = (unsigned int) cevent[pfdist].data.u64) < ctsize &&
+	    (conn = ctab[slot].conn) != NULL)
+		CONET_PREFETCH(conn);
+	if (left > 1 && (slot = (unsigned int) cevent[1].data.u64) < ctsize &&
+	    (conn = ctab[slot].conn) != NULL && conn->co != NULL)
+		CONET_PREFETCH(conn->co);
+}
 
-	return 0;
+/*
+ * Runs co until it switches back to the loop.
+ */
+static void conet_co_run(coroutine_t co, int fd) {
+
+	CONET_TRACE_POINT(run, CONET_TR_RUN, fd, 0, co);
+	co_call(co);
+	CONET_TRACE_POINT(stop, CONET_TR_STOP, fd, 0, co);
 }
 
 int conet_events_wait(int timeo) {
-	int cnt = 0;
+	int cnt = 0, tnext;
 
 	if (next_event == ready_events)
 		ready_events = next_event = 0;
-	if (timeo > CONET_TMOSTEP || timeo < 0)
-		timeo = CONET_TMOSTEP;
-	if (ready_events < max_events)
+
+	/*
+	 * Sleep no longer than the next wheel tick with work to do, which is
+	 * right away if the last dispatch ran out of timer budget.
+	 */
+	if ((tnext = conet_tmr_next(&tmrw, conet_mstime())) >= 0 &&
+	    (timeo < 0 || tnext < timeo))
+		timeo = tnext;
+	if (!conet_llempty(&rdylst))
+		timeo = 0;
+	if (ready_events < max_events) {
+		CONET_TRACE_POINT(poll, CONET_TR_POLL, -1, timeo, NULL);
 		cnt = epoll_wait(epfd, evstore + ready_events,
 				 max_events - ready_events, timeo);
+		CONET_TRACE_POINT(polled, CONET_TR_POLLED, -1, cnt, NULL);
+	}
 	if (cnt > 0)
 		ready_events += cnt;
 
@@ -520,23 +1841,1153 @@ int conet_events_dispatch(int evdmax) {
 
 	if (evdmax <= 0)
 		evdmax = max_events;
+	CONET_TRACE_POINT(dispatch, CONET_TR_DISPATCH, -1,
+			  ready_events - next_event, NULL);
 	for (i = 0, cevent = evstore + next_event;
 	     i < evdmax && next_event < ready_events;
 	     next_event++, cevent++, i++) {
-		conn = cevent->data.ptr;
-		if (conn->sfd != -1) {
-			conn->error = 0;
+		if (pfdist > 0)
+			conet_dsp_prefetch(cevent, ready_events - next_event);
+		/*
+		 * Events for a connection closed earlier in this batch carry the
+		 * previous slot generation, even if the slot has been reused.
+		 */
+		if ((conn = conet_conn_get(cevent->data.u64)) == NULL)
+			continue;
+		if (cevent->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			conn->flags &= ~CONET_CF_RDRAINED;
+		if (cevent->events & EPOLLPRI)
+			conn->flags |= CONET_CF_URGENT;
+		if (conn->flags & CONET_CF_WAITING) {
 			conn->revents = cevent->events;
-			if (conn->revents & conn->events)
-				co_call(conn->co);
+			if (conn->revents & conn->events) {
+				conn->error = 0;
+				conet_co_run(conn->co, conn->sfd);
+			}
+		} else if (conn->flags & CONET_CF_HIBER) {
+			conn->revents = cevent->events;
+			if ((conn->revents & conn->events) &&
+			    conet_hiber_wake(conn, 0) < 0)
+				conet_close_conn(conn);
 		}
 	}
+	conet_run_ready();
 	tcurr = conet_mstime();
-	if (tcurr > tmotmlast + CONET_TMOSTEP) {
-		conet_run_timers(tcurr);
-		tmotmlast = tcurr;
-	}
+	conet_tmr_run(&tmrw, tcurr, CONET_TMOBUDGET, conet_tmo_fire, &tcurr);
+	CONET_TRACE_POINT(dispatched, CONET_TR_DISPATCHED, -1, i, NULL);
 
 	return i;
 }
 
+
+static mstime_t conet_exptmo(int timeo) {
+
+	return timeo < 0 ? 0: conet_mstime() + timeo;
+}
+
+/*
+ * Waiters live on the stack of the parked coroutine. A wakeup only moves
+ * the waiter expire entry onto the ready list, and the coroutine is
+ * resumed by the next conet_events_dispatch() call, so the waker never
+ * switches context. An expire time of zero means wait forever.
+ */
+static int conet_wait(struct ll_head *wlist, mstime_t exptmo) {
+	struct conet_waiter w;
+	struct conet_ctx *ctx;
+
+	if ((ctx = conet_ctx_find(co_current())) != NULL) {
+		if ((w.error = conet_ctx_check(ctx)) < 0) {
+			errno = -w.error;
+			return -1;
+		}
+		exptmo = conet_ctx_exptmo(ctx, exptmo);
+		ctx->bwait = &w;
+	}
+	if (exptmo && exptmo <= conet_mstime()) {
+		if (ctx != NULL)
+			ctx->bwait = NULL;
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	w.error = 0;
+	w.ctx = ctx;
+	w.tmo.co = co_current();
+	w.tmo.error = &w.error;
+	w.tmo.tick = 0;
+	conet_llinit(&w.tmo.lnk);
+	conet_lladdt(&w.lnk, wlist);
+	if (exptmo) {
+		w.tmo.exptmo = exptmo;
+		conet_tmo_add(&w.tmo);
+	}
+	CONET_TRACE_POINT(yield, CONET_TR_YIELD, -1, 0, w.tmo.co);
+	co_resume();
+	conet_lldel(&w.lnk);
+	conet_tmo_del(&w.tmo);
+	if (ctx != NULL)
+		ctx->bwait = NULL;
+	if (w.error) {
+		errno = -w.error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Woken waiters leave their wait list, so a later wakeup of the same one
+ * (like a cancel right after a post, before the waiter got to run) finds
+ * it off list and is ignored, leaving the first wakeup in place.
+ */
+static void conet_wake(struct conet_waiter *w, int error) {
+
+	if (conet_llempty(&w->lnk))
+		return;
+	conet_lldel_init(&w->lnk);
+	conet_tmo_del(&w->tmo);
+	if (w->ctx != NULL)
+		w->ctx->bwait = NULL;
+	w->error = error;
+	conet_lladdt(&w->tmo.lnk, &rdylst);
+}
+
+static int conet_wake_one(struct ll_head *wlist, int error) {
+	struct ll_head *pos;
+
+	if ((pos = conet_llfirst(wlist)) == NULL)
+		return 0;
+	conet_wake(CONET_LLENT(pos, struct conet_waiter, lnk), error);
+
+	return 1;
+}
+
+static int conet_wake_all(struct ll_head *wlist, int error) {
+	int n;
+
+	for (n = 0; conet_wake_one(wlist, error); n++);
+
+	return n;
+}
+
+static int conet_run_ready(void) {
+	int n;
+	struct ll_head *pos, *last;
+	struct conet_tmo *tmo;
+
+	/*
+	 * Only run the waiters which were ready when we started, since the
+	 * ones we resume may wake up others (which will wait the next round).
+	 */
+	if ((last = conet_lllast(&rdylst)) == NULL)
+		return 0;
+	n = 0;
+	do {
+		pos = conet_llfirst(&rdylst);
+		conet_lldel_init(pos);
+		tmo = CONET_LLENT(pos, struct conet_tmo, lnk);
+		n++;
+		conet_co_run(tmo->co, -1);
+	} while (pos != last);
+
+	return n;
+}
+
+void conet_sem_init(struct conet_sem *sem, long count) {
+
+	sem->count = count;
+	conet_llinit(&sem->wlist);
+}
+
+int conet_sem_wait(struct conet_sem *sem, int timeo) {
+	mstime_t exptmo;
+
+	if (sem->count <= 0) {
+		exptmo = conet_exptmo(timeo);
+		do {
+			if (conet_wait(&sem->wlist, exptmo) < 0) {
+				/*
+				 * Do not swallow a post which raced with our
+				 * failure, but hand it to the next waiter.
+				 */
+				if (sem->count > 0)
+					conet_wake_one(&sem->wlist, 0);
+				return -1;
+			}
+		} while (sem->count <= 0);
+	}
+	sem->count--;
+
+	return 0;
+}
+
+void conet_sem_post(struct conet_sem *sem) {
+
+	sem->count++;
+	conet_wake_one(&sem->wlist, 0);
+}
+
+void conet_event_init(struct conet_event *ev) {
+
+	ev->signaled = 0;
+	conet_llinit(&ev->wlist);
+}
+
+int conet_event_wait(struct conet_event *ev, int timeo) {
+	mstime_t exptmo;
+
+	if (!ev->signaled) {
+		exptmo = conet_exptmo(timeo);
+		do {
+			if (conet_wait(&ev->wlist, exptmo) < 0)
+				return -1;
+		} while (!ev->signaled);
+	}
+
+	return 0;
+}
+
+void conet_event_set(struct conet_event *ev) {
+
+	ev->signaled = 1;
+	conet_wake_all(&ev->wlist, 0);
+}
+
+void conet_event_reset(struct conet_event *ev) {
+
+	ev->signaled = 0;
+}
+
+void conet_wg_init(struct conet_wgroup *wg) {
+
+	wg->count = 0;
+	conet_llinit(&wg->wlist);
+}
+
+void conet_wg_add(struct conet_wgroup *wg, long n) {
+
+	if ((wg->count += n) <= 0) {
+		wg->count = 0;
+		conet_wake_all(&wg->wlist, 0);
+	}
+}
+
+void conet_wg_done(struct conet_wgroup *wg) {
+
+	conet_wg_add(wg, -1);
+}
+
+int conet_wg_wait(struct conet_wgroup *wg, int timeo) {
+	mstime_t exptmo;
+
+	if (wg->count > 0) {
+		exptmo = conet_exptmo(timeo);
+		do {
+			if (conet_wait(&wg->wlist, exptmo) < 0)
+				return -1;
+		} while (wg->count > 0);
+	}
+
+	return 0;
+}
+
+int conet_chan_init(struct conet_chan *ch, int size) {
+
+	if (size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((ch->items = (void **) malloc(size * sizeof(void *))) == NULL)
+		return -1;
+	ch->size = size;
+	ch->cnt = ch->ridx = 0;
+	ch->closed = 0;
+	conet_llinit(&ch->rwlist);
+	conet_llinit(&ch->swlist);
+
+	return 0;
+}
+
+void conet_chan_cleanup(struct conet_chan *ch) {
+
+	free(ch->items);
+	ch->items = NULL;
+}
+
+int conet_chan_send(struct conet_chan *ch, void *data, int timeo) {
+	mstime_t exptmo;
+
+	if (!ch->closed && ch->cnt == ch->size) {
+		exptmo = conet_exptmo(timeo);
+		do {
+			if (conet_wait(&ch->swlist, exptmo) < 0) {
+				if (!ch->closed && ch->cnt < ch->size)
+					conet_wake_one(&ch->swlist, 0);
+				return -1;
+			}
+		} while (!ch->closed && ch->cnt == ch->size);
+	}
+	if (ch->closed) {
+		errno = EPIPE;
+		return -1;
+	}
+	ch->items[(ch->ridx + ch->cnt) % ch->size] = data;
+	ch->cnt++;
+	conet_wake_one(&ch->rwlist, 0);
+
+	return 0;
+}
+
+int conet_chan_recv(struct conet_chan *ch, void **data, int timeo) {
+	mstime_t exptmo;
+
+	if (!ch->closed && ch->cnt == 0) {
+		exptmo = conet_exptmo(timeo);
+		do {
+			if (conet_wait(&ch->rwlist, exptmo) < 0) {
+				if (ch->cnt > 0)
+					conet_wake_one(&ch->rwlist, 0);
+				return -1;
+			}
+		} while (!ch->closed && ch->cnt == 0);
+	}
+	if (ch->cnt == 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	*data = ch->items[ch->ridx];
+	ch->ridx = (ch->ridx + 1) % ch->size;
+	ch->cnt--;
+	conet_wake_one(&ch->swlist, 0);
+
+	return 0;
+}
+
+void conet_chan_close(struct conet_chan *ch) {
+
+	ch->closed = 1;
+	conet_wake_all(&ch->rwlist, 0);
+	conet_wake_all(&ch->swlist, 0);
+}
+
+static struct conet_ctx *conet_ctx_find(coroutine_t co) {
+	struct ll_head *head, *pos;
+	struct conet_ctx *ctx;
+
+	if (nctxs == 0)
+		return NULL;
+	head = &ctxhash[CONET_CTXHASH(co)];
+	for (pos = conet_llfirst(head); pos != NULL; pos = conet_llnext(pos, head)) {
+		ctx = CONET_LLENT(pos, struct conet_ctx, hlnk);
+		if (ctx->co == co)
+			return ctx;
+	}
+
+	return NULL;
+}
+
+static int conet_ctx_check(struct conet_ctx *ctx) {
+
+	if (ctx->cancelled)
+		return -ECANCELED;
+	if (ctx->deadline && ctx->deadline <= conet_mstime())
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+static mstime_t conet_ctx_exptmo(struct conet_ctx *ctx, mstime_t exptmo) {
+
+	return ctx->deadline && (!exptmo || ctx->deadline < exptmo) ?
+		ctx->deadline: exptmo;
+}
+
+/*
+ * A context carries a deadline and a cancellation state for the coroutine
+ * it is attached to, and every coronet blocking call honours it. Children
+ * contexts inherit the parent deadline (if shorter than their own) and get
+ * cancelled together with their parent.
+ */
+void conet_ctx_init(struct conet_ctx *ctx, struct conet_ctx *parent,
+		    int timeo) {
+
+	conet_llinit(&ctx->hlnk);
+	ctx->co = NULL;
+	ctx->deadline = timeo < 0 ? 0: conet_mstime() + timeo;
+	ctx->cancelled = 0;
+	ctx->parent = parent;
+	conet_llinit(&ctx->children);
+	conet_llinit(&ctx->plnk);
+	ctx->bconn = NULL;
+	ctx->bwait = NULL;
+	if (parent != NULL) {
+		ctx->deadline = conet_ctx_exptmo(parent, ctx->deadline);
+		ctx->cancelled = parent->cancelled;
+		conet_lladdt(&ctx->plnk, &parent->children);
+	}
+}
+
+int conet_ctx_attach(struct conet_ctx *ctx, coroutine_t co) {
+
+	if (conet_ctx_find(co) != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	ctx->co = co;
+	conet_lladdt(&ctx->hlnk, &ctxhash[CONET_CTXHASH(co)]);
+	nctxs++;
+
+	return 0;
+}
+
+void conet_ctx_detach(struct conet_ctx *ctx) {
+	struct ll_head *pos;
+	struct conet_ctx *cctx;
+
+	if (!conet_llempty(&ctx->hlnk)) {
+		conet_lldel_init(&ctx->hlnk);
+		nctxs--;
+	}
+	ctx->co = NULL;
+	conet_lldel_init(&ctx->plnk);
+	while ((pos = conet_llfirst(&ctx->children)) != NULL) {
+		cctx = CONET_LLENT(pos, struct conet_ctx, plnk);
+		conet_lldel_init(pos);
+		cctx->parent = NULL;
+	}
+	ctx->parent = NULL;
+}
+
+struct conet_ctx *conet_ctx_get(coroutine_t co) {
+
+	return conet_ctx_find(co);
+}
+
+void conet_ctx_set_deadline(struct conet_ctx *ctx, int timeo) {
+
+	ctx->deadline = timeo < 0 ? 0: conet_mstime() + timeo;
+	if (ctx->parent != NULL)
+		ctx->deadline = conet_ctx_exptmo(ctx->parent, ctx->deadline);
+}
+
+void conet_cancel(struct conet_ctx *ctx) {
+	struct ll_head *pos;
+	struct sk_conn *conn;
+
+	ctx->cancelled = 1;
+	if ((conn = ctx->bconn) != NULL) {
+		ctx->bconn = NULL;
+		conet_wake_conn(conn, -ECANCELED);
+	} else if (ctx->bwait != NULL && !conet_llempty(&ctx->bwait->lnk)) {
+		conet_wake(ctx->bwait, -ECANCELED);
+	}
+	for (pos = conet_llfirst(&ctx->children); pos != NULL;
+	     pos = conet_llnext(pos, &ctx->children))
+		conet_cancel(CONET_LLENT(pos, struct conet_ctx, plnk));
+}
+
+/*
+ * Parks the calling coroutine on the timer wheel until exptmo. Fails if
+ * woken up earlier by a context deadline or cancellation.
+ */
+static int conet_park(mstime_t exptmo) {
+
+	if (conet_wait(&parklst, exptmo) == 0 || errno != ETIMEDOUT)
+		return -1;
+	if (conet_mstime() < exptmo) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Suspends the calling coroutine for timeo milliseconds, with the timer
+ * wheel resolution. Fails if woken up earlier by a context deadline or
+ * cancellation, or by a drain.
+ */
+int conet_sleep(int timeo) {
+
+	if (timeo < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return conet_park(conet_mstime() + timeo);
+}
+
+void conet_timer_init(struct conet_timer *tmr, conet_timer_fn_t fn,
+		      void *data) {
+
+	conet_llinit(&tmr->tmo.lnk);
+	tmr->tmo.exptmo = 0;
+	tmr->tmo.tick = 0;
+	tmr->tmo.co = NULL;
+	tmr->tmo.error = NULL;
+	tmr->fn = fn;
+	tmr->data = data;
+	tmr->period = 0;
+}
+
+/*
+ * Arms tmr to fire in timeo milliseconds, and then every period ones if
+ * period is not zero. An armed timer is re-armed.
+ */
+int conet_timer_add(struct conet_timer *tmr, int timeo, int period) {
+
+	if (timeo < 0 || period < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	conet_tmo_del(&tmr->tmo);
+	tmr->tmo.exptmo = conet_mstime() + timeo;
+	tmr->period = period;
+	conet_tmo_add(&tmr->tmo);
+
+	return 0;
+}
+
+void conet_timer_del(struct conet_timer *tmr) {
+
+	conet_tmo_del(&tmr->tmo);
+	tmr->period = 0;
+}
+
+/*
+ * Periodic timers are re-armed before the callback runs, so that this can
+ * delete or re-arm them. A late tick does not make up the missed periods.
+ */
+static void conet_timer_fire(struct conet_timer *tmr, mstime_t tcurr) {
+
+	if (tmr->period > 0) {
+		tmr->tmo.exptmo += tmr->period;
+		if (tmr->tmo.exptmo <= tcurr)
+			tmr->tmo.exptmo = tcurr + tmr->period;
+		conet_tmo_add(&tmr->tmo);
+	}
+	CONET_TRACE_POINT(timer, CONET_TR_TIMER, -1, tmr->tmo.exptmo, NULL);
+	(*tmr->fn)(tmr, tmr->data);
+}
+
+static void conet_reclaim_timer(struct conet_timer *tmr, void *data) {
+
+	conet_mem_reclaim();
+}
+
+static void conet_tbkt_init(struct conet_tbkt *tb, unsigned long rate,
+			    unsigned long burst) {
+
+	tb->rate = rate;
+	tb->burst = burst != 0 ? burst: rate;
+	tb->tokens = (long) tb->burst;
+	tb->mtokens = 0;
+	tb->tlast = conet_mstime();
+}
+
+/*
+ * Refills the bucket and returns the tokens available. If none are, *wms
+ * is raised to the number of milliseconds until one will be. The refill
+ * fraction smaller than a token is carried over in thousandths of token,
+ * so that no elapsed time is ever accounted twice.
+ */
+static long conet_tbkt_avail(struct conet_tbkt *tb, mstime_t tcurr,
+			     long *wms) {
+	long wtm;
+	unsigned long long acc;
+
+	if (tb->rate == 0)
+		return LONG_MAX;
+	if (tcurr > tb->tlast) {
+		acc = (unsigned long long) tb->rate * (tcurr - tb->tlast) +
+			tb->mtokens;
+		tb->tokens += (long) (acc / 1000);
+		tb->mtokens = (unsigned long) (acc % 1000);
+		tb->tlast = tcurr;
+	}
+	if (tb->tokens >= (long) tb->burst) {
+		tb->tokens = (long) tb->burst;
+		tb->mtokens = 0;
+	}
+	if (tb->tokens <= 0 &&
+	    (wtm = (long) (((1 - tb->tokens) * 1000 - (long) tb->mtokens +
+			    tb->rate - 1) / tb->rate)) > *wms)
+		*wms = wtm;
+
+	return tb->tokens;
+}
+
+static int conet_shape(struct sk_conn *conn, int what, int n) {
+	long avail, cnt, wms;
+	mstime_t tcurr;
+
+	for (;;) {
+		tcurr = conet_mstime();
+		avail = n;
+		wms = 0;
+		if (conn->shp != NULL &&
+		    (cnt = conet_tbkt_avail(&conn->shp->bkts[what], tcurr, &wms)) < avail)
+			avail = cnt;
+		if (gshaping &&
+		    (cnt = conet_tbkt_avail(&gshp.bkts[what], tcurr, &wms)) < avail)
+			avail = cnt;
+		if (avail > 0)
+			return (int) avail;
+		if (conet_park(tcurr + wms) < 0)
+			return -1;
+	}
+}
+
+static void conet_shape_consume(struct sk_conn *conn, int what, int n) {
+
+	if (conn->shp != NULL && conn->shp->bkts[what].rate != 0)
+		conn->shp->bkts[what].tokens -= n;
+	if (gshaping && gshp.bkts[what].rate != 0)
+		gshp.bkts[what].tokens -= n;
+}
+
+/*
+ * Rates are in bytes per second for CONET_RATE_RX and CONET_RATE_TX, and
+ * in requests per second for CONET_RATE_REQ. A NULL connection sets the
+ * loop-wide limit, and a zero rate removes the limit.
+ */
+int conet_set_rate(struct sk_conn *conn, int what, unsigned long rate,
+		   unsigned long burst) {
+	int i;
+
+	if (what < 0 || what >= CONET_RATE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (conn == NULL) {
+		conet_tbkt_init(&gshp.bkts[what], rate, burst);
+		for (i = 0, gshaping = 0; i < CONET_RATE_MAX; i++)
+			if (gshp.bkts[i].rate != 0)
+				gshaping = 1;
+		return 0;
+	}
+	if (conn->shp == NULL) {
+		if (rate == 0)
+			return 0;
+		if ((conn->shp = (struct conet_shaper *)
+		     calloc(1, sizeof(struct conet_shaper))) == NULL)
+			return -1;
+	}
+	conet_tbkt_init(&conn->shp->bkts[what], rate, burst);
+
+	return 0;
+}
+
+int conet_rate_request(struct sk_conn *conn) {
+
+	if (!CONET_SHAPED(conn))
+		return 0;
+	if (conet_shape(conn, CONET_RATE_REQ, 1) < 0)
+		return -1;
+	conet_shape_consume(conn, CONET_RATE_REQ, 1);
+
+	return 0;
+}
+
+/*
+ * Wakes up, through the ready list, a coroutine blocked inside conet_yield()
+ * on the conn connection.
+ */
+static int conet_wake_conn(struct sk_conn *conn, int error) {
+
+	if (!(conn->flags & CONET_CF_WAITING))
+		return 0;
+	conn->flags &= ~CONET_CF_WAITING;
+	conet_tmo_del(&conn->tmo);
+	conn->error = error;
+	conet_lladdt(&conn->tmo.lnk, &rdylst);
+
+	return 1;
+}
+
+static void conet_mem_charge(long n) {
+
+	if ((memst.used += n) > memst.peak)
+		memst.peak = memst.used;
+}
+
+static int conet_mem_over(void) {
+
+	return memcfg.budget > 0 && memst.used > memcfg.budget;
+}
+
+/*
+ * Called on accept and timer ticks, when over budget. Shrinking drops the
+ * cached free connections and the buffers of parked idle ones, while idle
+ * shedding aborts the least recently active idle connections, whose
+ * coroutines will see their read failing with ECONNABORTED.
+ */
+static void conet_mem_reclaim(void) {
+	long used;
+	struct ll_head *pos;
+	struct sk_conn *conn;
+
+	if (!conet_mem_over())
+		return;
+	if (memcfg.policy & CONET_SHED_SHRINK) {
+		while (conet_mem_over() && (pos = conet_llfirst(&fsklist)) != NULL) {
+			conn = CONET_LLENT(pos, struct sk_conn, lnk);
+			conet_lldel(pos);
+			conet_buf_put(conn);
+			conet_mem_charge(-(long) sizeof(struct sk_conn));
+			memst.fconns--;
+			free(conn);
+		}
+		for (pos = conet_llfirst(&usklist); pos != NULL && conet_mem_over();
+		     pos = conet_llnext(pos, &usklist)) {
+			conn = CONET_LLENT(pos, struct sk_conn, lnk);
+			if ((conn->flags & CONET_CF_IDLE) && conn->buf != NULL) {
+				conet_buf_put(conn);
+				memst.shrunk++;
+			}
+		}
+	}
+	if (memcfg.policy & CONET_SHED_IDLE) {
+		used = memst.used;
+		for (pos = conet_llfirst(&usklist); pos != NULL && used > memcfg.budget;
+		     pos = conet_llnext(pos, &usklist)) {
+			conn = CONET_LLENT(pos, struct sk_conn, lnk);
+			if (((conn->flags & CONET_CF_IDLE) &&
+			     conet_wake_conn(conn, -ECONNABORTED)) ||
+			    ((conn->flags & CONET_CF_HIBER) &&
+			     conet_hiber_wake(conn, -ECONNABORTED) == 0)) {
+				shutdown(conn->sfd, SHUT_RDWR);
+				used -= sizeof(struct sk_conn) + memcfg.conn_extra +
+					conn->bsize;
+				memst.aborted++;
+			}
+		}
+	}
+}
+
+int conet_set_memcfg(struct conet_memcfg const *cfg) {
+
+	if (cfg->budget < 0 || cfg->maxline < 0 || cfg->conn_extra < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	conet_mem_charge(memst.conns * (cfg->conn_extra - memcfg.conn_extra));
+	memcfg = *cfg;
+
+	return 0;
+}
+
+void conet_get_memstats(struct conet_memstats *st) {
+
+	*st = memst;
+}
+
+static void *conet_worker_run(void *data) {
+	struct conet_worker *w = (struct conet_worker *) data;
+	struct sk_conn *conn;
+
+	for (;;) {
+		conn = w->conn;
+		w->conn = NULL;
+		(*conn->hfn)(conn, conn->hdata);
+		if (nfworkers >= wmaxidle)
+			break;
+		conet_lladdh(&w->lnk, &fwlist);
+		nfworkers++;
+		co_resume();
+	}
+	free(w);
+
+	return NULL;
+}
+
+/*
+ * Resumes an hibernated connection, by running its handler on a pooled
+ * coroutine. The coroutine is started by the ready list, so this can be
+ * called from any context.
+ */
+static int conet_hiber_wake(struct sk_conn *conn, int error) {
+	struct ll_head *pos;
+	struct conet_worker *w;
+
+	if ((pos = conet_llfirst(&fwlist)) != NULL) {
+		conet_lldel(pos);
+		nfworkers--;
+		w = CONET_LLENT(pos, struct conet_worker, lnk);
+	} else {
+		if ((w = (struct conet_worker *)
+		     malloc(sizeof(struct conet_worker))) == NULL)
+			return -1;
+		if ((w->co = co_create((void *) conet_worker_run, w, NULL,
+				       wstksize)) == NULL) {
+			free(w);
+			return -1;
+		}
+	}
+	w->conn = conn;
+	conn->flags &= ~CONET_CF_HIBER;
+	conet_tmo_del(&conn->tmo);
+	conn->co = conn->tmo.co = w->co;
+	conn->error = error;
+	conet_lladdt(&conn->tmo.lnk, &rdylst);
+	conet_mem_charge(memcfg.conn_extra);
+	memst.hconns--;
+
+	return 0;
+}
+
+int conet_set_workers(int stksize, int maxidle) {
+
+	if (stksize <= 0 || maxidle < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	wstksize = stksize;
+	wmaxidle = maxidle;
+
+	return 0;
+}
+
+/*
+ * Returns the number of populated bytes of a stack, excluding the guard
+ * page and the descriptor one.
+ */
+static long conet_stk_resident(struct conet_stack *stk) {
+	long i, j, cnt, npg = stk->size / stkpgsize - 1, n = 0;
+	unsigned char vec[256];
+
+	for (i = 1; i < npg; i += cnt) {
+		cnt = npg - i < (long) sizeof(vec) ? npg - i: (long) sizeof(vec);
+		if (mincore(stk->base + i * stkpgsize, cnt * stkpgsize, vec) != 0)
+			return 0;
+		for (j = 0; j < cnt; j++)
+			n += vec[j] & 1;
+	}
+
+	return n * stkpgsize;
+}
+
+/*
+ * Fetches a stack from the free pool, or maps a new one. Stacks going back
+ * to the pool are trimmed here, and not when released, since the exiting
+ * coroutine is still running on them at that time.
+ */
+static struct conet_stack *conet_stk_get(void) {
+	long size, trim;
+	char *base;
+	struct ll_head *pos;
+	struct conet_stack *stk;
+
+	while (stkst.pooled > stkmaxfree) {
+		stk = CONET_LLENT(stkfree.prev, struct conet_stack, lnk);
+		conet_lldel(&stk->lnk);
+		munmap(stk->base, stk->size);
+		stkst.pooled--;
+		stkst.mapped--;
+	}
+	if ((pos = conet_llfirst(&stkfree)) != NULL) {
+		stk = CONET_LLENT(pos, struct conet_stack, lnk);
+		conet_lldel(pos);
+		stkst.pooled--;
+		trim = stk->size - stkpgsize - ((stkkeep + stkpgsize - 1) &
+						~(stkpgsize - 1)) - stkpgsize;
+		if (trim > 0 && stk->used > stkkeep) {
+			madvise(stk->base + stkpgsize, trim, MADV_DONTNEED);
+			stkst.trimmed++;
+		}
+
+		return stk;
+	}
+	size = ((stkvsize + stkpgsize - 1) & ~(stkpgsize - 1)) + 2 * stkpgsize;
+	if ((base = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+				  MAP_STACK, -1, 0)) == MAP_FAILED)
+		return NULL;
+	if (mprotect(base, stkpgsize, PROT_NONE) != 0) {
+		munmap(base, size);
+		return NULL;
+	}
+	stk = (struct conet_stack *) (base + size - stkpgsize);
+	stk->base = base;
+	stk->used = 0;
+	stk->size = size;
+	stkst.mapped++;
+
+	return stk;
+}
+
+static void conet_stk_run(void *data) {
+	long used;
+	struct conet_stack *stk = (struct conet_stack *) data;
+
+	co_set_data(co_current(), stk->data);
+	(*stk->func)(stk->data);
+	if ((stk->used = used = conet_stk_resident(stk)) > stkst.hwm)
+		stkst.hwm = used;
+	stkst.used_sum += used;
+	stkst.exited++;
+	stkst.live--;
+
+	/*
+	 * Nothing can fetch the stack before this coroutine is gone, since
+	 * we do not yield anymore.
+	 */
+	conet_lladdh(&stk->lnk, &stkfree);
+	stkst.pooled++;
+}
+
+/*
+ * Creates a coroutine running on a growable stack, which only reserves
+ * address space up to its maximum size, and populates pages as the stack
+ * deepens. Overflows hit a guard page, instead of silently corrupting
+ * memory. Stacks are pooled, and trimmed back when reused.
+ */
+coroutine_t conet_co_create(void (*func)(void *), void *data) {
+	struct conet_stack *stk;
+	coroutine_t co;
+
+	if ((stk = conet_stk_get()) == NULL)
+		return NULL;
+	stk->func = func;
+	stk->data = data;
+	if ((co = co_create(conet_stk_run, stk, stk->base + stkpgsize,
+			    stk->size - 2 * stkpgsize)) == NULL) {
+		conet_lladdh(&stk->lnk, &stkfree);
+		stkst.pooled++;
+		return NULL;
+	}
+	stkst.live++;
+
+	return co;
+}
+
+int conet_set_stacks(long vsize, long keep, int maxfree) {
+	struct ll_head *pos;
+	struct conet_stack *stk;
+
+	if (vsize < 2 * stkpgsize || keep < 0 || maxfree < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * Pooled stacks of the old size are dropped.
+	 */
+	if (vsize != stkvsize) {
+		while ((pos = conet_llfirst(&stkfree)) != NULL) {
+			stk = CONET_LLENT(pos, struct conet_stack, lnk);
+			conet_lldel(pos);
+			munmap(stk->base, stk->size);
+			stkst.mapped--;
+		}
+		stkst.pooled = 0;
+	}
+	stkvsize = vsize;
+	stkkeep = keep;
+	stkmaxfree = maxfree;
+
+	return 0;
+}
+
+void conet_get_stackstats(struct conet_stackstats *st) {
+
+	*st = stkst;
+	st->vsize = stkvsize;
+}
+
+/*
+ * Parks a connection with no buffered input until it becomes readable,
+ * dropping its buffer and letting the caller coroutine exit. The fn
+ * handler is then invoked with data on a pooled coroutine, with conn->error
+ * set to a negative error code if the connection timed out or got aborted
+ * before any input arrived. Returns 1 if the connection has been parked
+ * (and the caller must not touch it anymore), or 0 if input is already
+ * buffered and the caller should keep serving it.
+ */
+int conet_hibernate(struct sk_conn *conn, conet_handler_t fn, void *data) {
+
+	if (gdraining || conn->ridx < conn->bcnt ||
+	    (conn->xp != NULL && conn->xp->pending != NULL &&
+	     (*conn->xp->pending)(conn) > 0))
+		return 0;
+
+	/*
+	 * A modify re-arms the edge, so data which arrived after our last
+	 * read will still trigger an event.
+	 */
+	conn->events = EPOLLIN | EPOLLERR | EPOLLHUP;
+	if (conet_mod_conn(conn, conn->events) < 0)
+		return -1;
+	conet_buf_put(conn);
+	conn->ridx = conn->bcnt = 0;
+	conn->hfn = fn;
+	conn->hdata = data;
+	conn->co = conn->tmo.co = NULL;
+	conn->flags |= CONET_CF_HIBER;
+	if (conn->timeo > 0) {
+		conn->tmo.exptmo = conet_mstime() + conn->timeo;
+		conet_tmo_add(&conn->tmo);
+	}
+	conet_lldel(&conn->lnk);
+	conet_lladdt(&conn->lnk, &usklist);
+	conet_mem_charge(-memcfg.conn_extra);
+	memst.hconns++;
+
+	return 1;
+}
+
+/*
+ * Switches conn I/O over the xp transport (or back to the plain socket
+ * if xp is NULL), with data being the transport private data. A transport
+ * previously set on conn is closed.
+ */
+int conet_set_xprt(struct sk_conn *conn, struct conet_xprt const *xp,
+		   void *data) {
+
+	if (conn->xp != NULL && conn->xp->close != NULL)
+		(*conn->xp->close)(conn);
+	conn->xp = xp;
+	conn->xpdata = data;
+
+	return 0;
+}
+
+/*
+ * Runs the transport handshake, if any, to completion. Transports do an
+ * implicit handshake on the first read or write, so this is only needed
+ * to fail early, or to query the negotiated session before any I/O.
+ */
+int conet_handshake(struct sk_conn *conn) {
+	unsigned int events;
+
+	if (conn->xp == NULL || conn->xp->handshake == NULL)
+		return 0;
+	for (;;) {
+		if ((*conn->xp->handshake)(conn, &events) == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!(conn->events & events)) {
+			conn->events = events | EPOLLERR | EPOLLHUP;
+			if (conet_mod_conn(conn, conn->events) < 0)
+				return -1;
+		}
+		if (conet_yield(conn) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Blocks the mask signals, and returns a non blocking signalfd for them,
+ * to be wrapped by conet_new_conn() and read with conet_sigwait().
+ */
+int conet_signalfd(sigset_t const *mask) {
+
+	if (sigprocmask(SIG_BLOCK, mask, NULL) < 0)
+		return -1;
+
+	return signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/*
+ * Waits for a signal on a conn wrapping a conet_signalfd() descriptor, and
+ * returns its number.
+ */
+int conet_sigwait(struct sk_conn *conn) {
+	struct signalfd_siginfo si;
+
+	if (conet_read(conn, &si, sizeof(si)) != sizeof(si))
+		return -1;
+
+	return (int) si.ssi_signo;
+}
+
+static void conet_drain_cancel(void) {
+	int i;
+	struct ll_head *pos;
+	struct sk_conn *conn;
+
+	for (pos = conet_llfirst(&usklist); pos != NULL;
+	     pos = conet_llnext(pos, &usklist)) {
+		conn = CONET_LLENT(pos, struct sk_conn, lnk);
+		if (conet_wake_conn(conn, -ECANCELED) ||
+		    ((conn->flags & CONET_CF_HIBER) &&
+		     conet_hiber_wake(conn, -ECANCELED) == 0))
+			drst.cancelled++;
+	}
+	/*
+	 * Coroutines parked while bound to a context are woken (and counted)
+	 * here, so cancelling their context below finds them off the park list
+	 * and leaves them alone.
+	 */
+	drst.cancelled += conet_wake_all(&parklst, -ECANCELED);
+	for (i = 0; nctxs > 0 && i < CONET_CTXHSIZE; i++)
+		for (pos = conet_llfirst(&ctxhash[i]); pos != NULL;
+		     pos = conet_llnext(pos, &ctxhash[i]))
+			conet_cancel(CONET_LLENT(pos, struct conet_ctx, hlnk));
+}
+
+/*
+ * Runs the loop until all the connections are gone, for a graceful
+ * shutdown. Accepts are failed with ESHUTDOWN, and so are reads on idle
+ * connections (right away for the ones already idle, or hibernated, or
+ * once the others complete their current request). Connections still open
+ * after timeo milliseconds (never, if timeo is negative) are cancelled,
+ * and so are coroutines parked by shaping or bound to a context. Returns
+ * the number of connections left open, with the drain counts stored in st
+ * if not NULL.
+ */
+int conet_drain(int timeo, struct conet_drainstats *st) {
+	int i, wtmo;
+	mstime_t exptmo, tcurr;
+	struct ll_head *pos;
+	struct sk_conn *conn;
+
+	gdraining = 1;
+	memset(&drst, 0, sizeof(drst));
+	for (pos = conet_llfirst(&usklist); pos != NULL;
+	     pos = conet_llnext(pos, &usklist)) {
+		conn = CONET_LLENT(pos, struct sk_conn, lnk);
+		if (conn->flags & CONET_CF_ACCEPT)
+			conet_wake_conn(conn, -ESHUTDOWN);
+		else if (((conn->flags & CONET_CF_IDLE) &&
+			  conet_wake_conn(conn, -ESHUTDOWN)) ||
+			 ((conn->flags & CONET_CF_HIBER) &&
+			  conet_hiber_wake(conn, -ESHUTDOWN) == 0))
+			drst.idle++;
+		else
+			drst.active++;
+	}
+	exptmo = conet_exptmo(timeo);
+	while (memst.conns > 0) {
+		wtmo = -1;
+		if (exptmo) {
+			if ((tcurr = conet_mstime()) >= exptmo)
+				break;
+			wtmo = (int) (exptmo - tcurr);
+		}
+		conet_events_wait(wtmo);
+		conet_events_dispatch(0);
+	}
+	if (memst.conns > 0) {
+		conet_drain_cancel();
+		for (i = 0; i < CONET_DRAIN_ROUNDS && memst.conns > 0; i++) {
+			conet_events_wait(0);
+			conet_events_dispatch(0);
+		}
+	}
+	drst.left = memst.conns;
+	gdraining = 0;
+	if (st != NULL)
+		*st = drst;
+
+	return (int) drst.left;
+}
+
+int conet_draining(void) {
+
+	return gdraining;
+}
@@ -21,6 +21,7 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <signal.h>
 
 
 /*
@@ -31,8 +32,15 @@
  *
  * Or, many distributions has a package for it (Debian names it "libpcl1-dev").
  *
+ * Alternatively, the library can be configured with --enable-asm-coro to
+ * use its built-in context switch, which exports the same API. Users of
+ * such build must define CONET_ASM_CORO as well.
  */
+#if defined(CONET_ASM_CORO)
+#include "coronet_co.h"
+#else
 #include <pcl.h>
+#endif
 
 
 #ifdef __cplusplus
@@ -43,47 +51,298 @@
 
 
 #define CONET_BUFSIZE (1024 * 2)
+#define CONET_WORKER_STKSIZE (1024 * 8)
+
+#define CONET_RATE_RX 0
+#define CONET_RATE_TX 1
+#define CONET_RATE_REQ 2
+#define CONET_RATE_MAX 3
+
+#define CONET_SHED_REJECT (1 << 0)
+#define CONET_SHED_IDLE (1 << 1)
+#define CONET_SHED_SHRINK (1 << 2)
+
+#define CONET_LOOP_NUMA (1 << 0)
+
+#define CONET_SO_NODELAY (1 << 0)
+#define CONET_SO_SNDBUF (1 << 1)
+#define CONET_SO_RCVBUF (1 << 2)
+#define CONET_SO_NOTSENT_LOWAT (1 << 3)
+#define CONET_SO_QUICKACK (1 << 4)
+#define CONET_SO_BUSY_POLL (1 << 5)
+#define CONET_SO_KEEPALIVE (1 << 6)
 
 typedef unsigned long long mstime_t;
+typedef unsigned long long conet_handle_t;
 
 struct ll_head {
 	struct ll_head *prev, *next;
 };
 
-struct sk_conn {
+struct conet_tmo {
 	struct ll_head lnk;
+	mstime_t exptmo;
+	unsigned long long tick;
+	coroutine_t co;
+	int *error;
+};
+
+struct sk_conn;
+struct mmsghdr;
+struct iovec;
+
+typedef void (*conet_handler_t)(struct sk_conn *, void *);
+
+struct conet_tbkt {
+	unsigned long rate, burst;
+	long tokens;
+	unsigned long mtokens;
+	mstime_t tlast;
+};
+
+struct conet_shaper {
+	struct conet_tbkt bkts[CONET_RATE_MAX];
+};
+
+/*
+ * Transport operations. The read/write/handshake ones return -1 with errno
+ * set to EAGAIN when they would block, storing in *events the EPOLLIN or
+ * EPOLLOUT event the connection needs to wait for. The pending one returns
+ * the number of input bytes the transport has already buffered.
+ */
+struct conet_xprt {
+	int (*read)(struct sk_conn *, void *, int, unsigned int *);
+	int (*write)(struct sk_conn *, void const *, int, unsigned int *);
+	int (*handshake)(struct sk_conn *, unsigned int *);
+	int (*pending)(struct sk_conn *);
+	void (*close)(struct sk_conn *);
+};
+
+/*
+ * The fields the event dispatcher touches come first, and connections are
+ * allocated cache aligned, so that dispatching an event costs a single
+ * cache line of the connection.
+ */
+struct sk_conn {
 	coroutine_t co;
 	int sfd;
 	int error;
+	unsigned int flags;
 	unsigned int events, revents;
+	unsigned int cslot;
+	struct ll_head lnk;
 	int timeo;
-	struct ll_head tlnk;
-	mstime_t exptmo;
-	int ridx, bcnt;
-	char buf[CONET_BUFSIZE];
+	struct conet_tmo tmo;
+	struct conet_shaper *shp;
+	struct conet_sockopts const *sopts;
+	struct conet_xprt const *xp;
+	void *xpdata;
+	conet_handler_t hfn;
+	void *hdata;
+	int ridx, bcnt, bsize;
+	char *buf;
+	unsigned int zcsent, zcdone;
+};
+
+/*
+ * Socket options profile. Only the options selected by mask are applied.
+ * The keepalive idle, interval and count are applied only if non zero.
+ */
+struct conet_sockopts {
+	unsigned int mask;
+	int nodelay, quickack;
+	int sndbuf, rcvbuf;
+	int notsent_lowat;
+	int busy_poll;
+	int keepalive, kaidle, kaintvl, kacnt;
+};
+
+/*
+ * Loop placement. A negative cpu leaves the calling thread unpinned.
+ */
+struct conet_loopcfg {
+	int cpu;
+	unsigned int flags;
+};
+
+struct conet_memcfg {
+	long budget;
+	int maxline;
+	unsigned int policy;
+	long conn_extra;
+};
+
+struct conet_memstats {
+	long used, peak;
+	long conns, fconns, bufs, hconns;
+	long rejected, aborted, shrunk;
+};
+
+struct conet_stackstats {
+	long vsize;
+	long live, pooled, mapped;
+	long exited, trimmed;
+	long hwm;
+	long long used_sum;
+};
+
+struct conet_zcstats {
+	long sends, copied, fallbacks;
+	long long bytes;
+};
+
+struct conet_iostats {
+	long long rdcalls, rdagain, rdskips;
+	long long rdbytes, rabytes;
+	long long resizes;
+};
+
+struct conet_sem {
+	long count;
+	struct ll_head wlist;
+};
+
+struct conet_event {
+	int signaled;
+	struct ll_head wlist;
+};
+
+struct conet_wgroup {
+	long count;
+	struct ll_head wlist;
+};
+
+struct conet_timer;
+
+typedef void (*conet_timer_fn_t)(struct conet_timer *, void *);
+
+/*
+ * Callback timer. It sits on the timer wheel like the connections do, so
+ * arming and cancelling it are O(1), and the callback runs on the loop
+ * (not on a coroutine) when the wheel tick finds it expired.
+ */
+struct conet_timer {
+	struct conet_tmo tmo;
+	conet_timer_fn_t fn;
+	void *data;
+	int period;
+};
+
+struct conet_waiter;
+
+struct conet_ctx {
+	struct ll_head hlnk;
+	coroutine_t co;
+	mstime_t deadline;
+	int cancelled;
+	struct conet_ctx *parent;
+	struct ll_head children, plnk;
+	struct sk_conn *bconn;
+	struct conet_waiter *bwait;
+};
+
+struct conet_drainstats {
+	long idle, active;
+	long cancelled, left;
+};
+
+struct conet_chan {
+	int size, cnt, ridx;
+	int closed;
+	void **items;
+	struct ll_head rwlist, swlist;
 };
 
 
 
 CNAPI int conet_init(void);
+CNAPI int conet_init_loop(struct conet_loopcfg const *cfg);
 CNAPI void conet_cleanup(void);
 CNAPI int conet_readsome(struct sk_conn *conn, void *buf, int n);
 CNAPI int conet_read(struct sk_conn *conn, void *buf, int n);
 CNAPI char *conet_readln(struct sk_conn *conn, int *lnsize);
+CNAPI int conet_fill(struct sk_conn *conn, int idle);
 CNAPI int conet_write(struct sk_conn *conn, void const *buf, int n);
+CNAPI int conet_writev(struct sk_conn *conn, struct iovec *iov, int cnt);
+CNAPI int conet_write_zc(struct sk_conn *conn, void const *buf, int n);
+CNAPI int conet_zc_flush(struct sk_conn *conn);
+CNAPI void conet_set_zcthresh(int thresh);
+CNAPI void conet_set_prefetch(int dist);
+CNAPI void conet_get_zcstats(struct conet_zcstats *st);
+CNAPI void conet_get_iostats(struct conet_iostats *st);
 CNAPI int conet_printf(struct sk_conn *conn, char const *fmt, ...);
 CNAPI struct sk_conn *conet_new_conn(int sfd, coroutine_t co);
 CNAPI void conet_close_conn(struct sk_conn *conn);
+CNAPI conet_handle_t conet_conn_handle(struct sk_conn *conn);
+CNAPI struct sk_conn *conet_conn_get(conet_handle_t h);
 CNAPI int conet_set_timeo(struct sk_conn *conn, int timeo);
 CNAPI int conet_mod_conn(struct sk_conn *conn, unsigned int events);
+CNAPI int conet_detach_conn(struct sk_conn *conn);
 CNAPI int conet_socket(int domain, int type, int protocol);
 CNAPI int conet_connect(struct sk_conn *conn, const struct sockaddr *serv_addr,
 			socklen_t addrlen);
 CNAPI int conet_accept(struct sk_conn *conn, struct sockaddr *addr, int *addrlen);
 CNAPI struct sk_conn *conet_create_conn(int domain, int type, int protocol,
 					coroutine_t co);
+CNAPI int conet_reuseport_steer(int sfd, int const *cpus, int n);
+CNAPI int conet_conn_cpu(struct sk_conn *conn);
+CNAPI int conet_set_sockopts(struct sk_conn *conn,
+			     struct conet_sockopts const *so);
+CNAPI int conet_get_sockopts(int sfd, struct conet_sockopts *so);
+CNAPI int conet_recvmmsg(struct sk_conn *conn, struct mmsghdr *msgs,
+			 unsigned int vlen, int flags);
+CNAPI int conet_sendmmsg(struct sk_conn *conn, struct mmsghdr *msgs,
+			 unsigned int vlen, int flags);
+CNAPI int conet_set_udpseg(struct sk_conn *conn, int gso, int gro);
+CNAPI int conet_sendfd(struct sk_conn *conn, int fd, void const *buf, int n);
+CNAPI int conet_recvfd(struct sk_conn *conn, int *fd, void *buf, int n);
 CNAPI int conet_events_wait(int timeo);
 CNAPI int conet_events_dispatch(int evdmax);
+CNAPI void conet_sem_init(struct conet_sem *sem, long count);
+CNAPI int conet_sem_wait(struct conet_sem *sem, int timeo);
+CNAPI void conet_sem_post(struct conet_sem *sem);
+CNAPI void conet_event_init(struct conet_event *ev);
+CNAPI int conet_event_wait(struct conet_event *ev, int timeo);
+CNAPI void conet_event_set(struct conet_event *ev);
+CNAPI void conet_event_reset(struct conet_event *ev);
+CNAPI void conet_wg_init(struct conet_wgroup *wg);
+CNAPI void conet_wg_add(struct conet_wgroup *wg, long n);
+CNAPI void conet_wg_done(struct conet_wgroup *wg);
+CNAPI int conet_wg_wait(struct conet_wgroup *wg, int timeo);
+CNAPI int conet_sleep(int timeo);
+CNAPI void conet_timer_init(struct conet_timer *tmr, conet_timer_fn_t fn,
+			    void *data);
+CNAPI int conet_timer_add(struct conet_timer *tmr, int timeo, int period);
+CNAPI void conet_timer_del(struct conet_timer *tmr);
+CNAPI int conet_chan_init(struct conet_chan *ch, int size);
+CNAPI void conet_chan_cleanup(struct conet_chan *ch);
+CNAPI int conet_chan_send(struct conet_chan *ch, void *data, int timeo);
+CNAPI int conet_chan_recv(struct conet_chan *ch, void **data, int timeo);
+CNAPI void conet_chan_close(struct conet_chan *ch);
+CNAPI void conet_ctx_init(struct conet_ctx *ctx, struct conet_ctx *parent,
+			  int timeo);
+CNAPI int conet_ctx_attach(struct conet_ctx *ctx, coroutine_t co);
+CNAPI void conet_ctx_detach(struct conet_ctx *ctx);
+CNAPI struct conet_ctx *conet_ctx_get(coroutine_t co);
+CNAPI void conet_ctx_set_deadline(struct conet_ctx *ctx, int timeo);
+CNAPI void conet_cancel(struct conet_ctx *ctx);
+CNAPI int conet_set_rate(struct sk_conn *conn, int what, unsigned long rate,
+			 unsigned long burst);
+CNAPI int conet_rate_request(struct sk_conn *conn);
+CNAPI int conet_set_memcfg(struct conet_memcfg const *cfg);
+CNAPI void conet_get_memstats(struct conet_memstats *st);
+CNAPI int conet_set_workers(int stksize, int maxidle);
+CNAPI coroutine_t conet_co_create(void (*func)(void *), void *data);
+CNAPI int conet_set_stacks(long vsize, long keep, int maxfree);
+CNAPI void conet_get_stackstats(struct conet_stackstats *st);
+CNAPI int conet_hibernate(struct sk_conn *conn, conet_handler_t fn, void *data);
+CNAPI int conet_set_xprt(struct sk_conn *conn, struct conet_xprt const *xp,
+			 void *data);
+CNAPI int conet_handshake(struct sk_conn *conn);
+CNAPI int conet_signalfd(sigset_t const *mask);
+CNAPI int conet_sigwait(struct sk_conn *conn);
+CNAPI int conet_drain(int timeo, struct conet_drainstats *st);
+CNAPI int conet_draining(void);
 
 
 #endif
@@ -0,0 +1,314 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "coronet_co.h"
+
+
+#if defined(CONET_ASM_CORO)
+
+#define CONET_CO_MINSTK 4096
+#define CONET_CO_ALIGN 16
+#define CONET_CO_SIZE ((sizeof(struct conet_co) + CONET_CO_ALIGN - 1) & \
+		       ~(CONET_CO_ALIGN - 1))
+
+
+
+/*
+ * Like in PCL, the coroutine descriptor sits at the bottom of its stack.
+ * Only the stack pointer is kept in it, since the switch pushes the callee
+ * saved registers on the stack being left.
+ */
+struct conet_co {
+	void *sp;
+	struct conet_co *caller, *restarget;
+	void (*func)(void *);
+	void *data;
+	int alloc;
+};
+
+
+
+void conet_co_switch(void **psp, void *sp);
+void conet_co_entry(void);
+static void **conet_co_frame(struct conet_co *co, char *top);
+static struct conet_co *conet_co_curr(void);
+static void conet_co_reap(void);
+static void conet_co_main(struct conet_co *co)
+	__attribute__((used, noinline, noreturn));
+
+
+
+
+static __thread struct conet_co mainco;
+static __thread struct conet_co *curco, *deadco;
+
+
+
+/*
+ * Saves the callee saved registers (and the FP control words) on the
+ * current stack, stores the stack pointer in *psp, and restores the same
+ * set from the sp stack. New coroutines start in conet_co_entry, with
+ * their descriptor in a callee saved register.
+ */
+#if defined(__x86_64__)
+
+__asm__(".text\n"
+	".p2align 4\n"
+	".globl conet_co_switch\n"
+	".hidden conet_co_switch\n"
+	".type conet_co_switch, @function\n"
+	"conet_co_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size conet_co_switch, .-conet_co_switch\n"
+	".p2align 4\n"
+	".globl conet_co_entry\n"
+	".hidden conet_co_entry\n"
+	".type conet_co_entry, @function\n"
+	"conet_co_entry:\n"
+	"	movq %r12, %rdi\n"
+	"	call conet_co_main\n"
+	"	ud2\n"
+	".size conet_co_entry, .-conet_co_entry\n");
+
+static void **conet_co_frame(struct conet_co *co, char *top) {
+	void **frame = (void **) top - 8;
+
+	memset(frame, 0, 8 * sizeof(void *));
+	((unsigned int *) frame)[0] = 0x1f80;
+	((unsigned short *) frame)[2] = 0x037f;
+	frame[4] = co;
+	frame[7] = (void *) conet_co_entry;
+
+	return frame;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(".text\n"
+	".p2align 4\n"
+	".globl conet_co_switch\n"
+	".hidden conet_co_switch\n"
+	".type conet_co_switch, %function\n"
+	"conet_co_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size conet_co_switch, .-conet_co_switch\n"
+	".p2align 4\n"
+	".globl conet_co_entry\n"
+	".hidden conet_co_entry\n"
+	".type conet_co_entry, %function\n"
+	"conet_co_entry:\n"
+	"	mov x0, x19\n"
+	"	bl conet_co_main\n"
+	"	brk #0\n"
+	".size conet_co_entry, .-conet_co_entry\n");
+
+static void **conet_co_frame(struct conet_co *co, char *top) {
+	void **frame = (void **) top - 20;
+
+	memset(frame, 0, 20 * sizeof(void *));
+	frame[0] = co;
+	frame[11] = (void *) conet_co_entry;
+
+	return frame;
+}
+
+#else
+#error "No assembly context switch for this architecture"
+#endif
+
+static struct conet_co *conet_co_curr(void) {
+
+	if (curco == NULL)
+		curco = &mainco;
+
+	return curco;
+}
+
+/*
+ * A coroutine cannot free the stack it is exiting on, so the deletion is
+ * done by the one it switched to, as soon as it gets the CPU.
+ */
+static void conet_co_reap(void) {
+	struct conet_co *co;
+
+	if ((co = deadco) != NULL) {
+		deadco = NULL;
+		co_delete(co);
+	}
+}
+
+static void conet_co_main(struct conet_co *co) {
+
+	conet_co_reap();
+	co->restarget = co->caller;
+	(*co->func)(co->data);
+	co_exit();
+	abort();
+}
+
+int co_thread_init(void) {
+
+	return 0;
+}
+
+void co_thread_cleanup(void) {
+
+}
+
+coroutine_t co_create(void (*func)(void *), void *data, void *stack,
+		      int size) {
+	int alloc = 0;
+	char *top;
+	struct conet_co *co;
+
+	if (size < CONET_CO_MINSTK) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (stack == NULL) {
+		size = (size + CONET_CO_SIZE + CONET_CO_ALIGN - 1) &
+			~(CONET_CO_ALIGN - 1);
+		if ((stack = malloc(size)) == NULL)
+			return NULL;
+		alloc = 1;
+	}
+	co = (struct conet_co *) stack;
+	memset(co, 0, sizeof(*co));
+	co->func = func;
+	co->data = data;
+	co->alloc = alloc;
+	top = (char *) (((unsigned long) stack + size) & ~(CONET_CO_ALIGN - 1));
+	co->sp = conet_co_frame(co, top);
+
+	return co;
+}
+
+void co_delete(coroutine_t coro) {
+	struct conet_co *co = (struct conet_co *) coro;
+
+	if (co == curco) {
+		fprintf(stderr, "[coronet] Cannot delete itself: co=%p\n", co);
+		exit(1);
+	}
+	if (co->alloc)
+		free(co);
+}
+
+void co_call(coroutine_t coro) {
+	struct conet_co *co = (struct conet_co *) coro, *oldco = conet_co_curr();
+
+	co->caller = oldco;
+	curco = co;
+	conet_co_switch(&oldco->sp, co->sp);
+	conet_co_reap();
+}
+
+void co_resume(void) {
+	struct conet_co *co = conet_co_curr();
+
+	co_call(co->restarget);
+	co->restarget = co->caller;
+}
+
+void co_exit_to(coroutine_t coro) {
+	struct conet_co *co = (struct conet_co *) coro, *oldco = conet_co_curr();
+
+	deadco = oldco;
+	curco = co;
+	conet_co_switch(&oldco->sp, co->sp);
+	abort();
+}
+
+void co_exit(void) {
+
+	co_exit_to(conet_co_curr()->restarget);
+}
+
+coroutine_t co_current(void) {
+
+	return conet_co_curr();
+}
+
+void *co_get_data(coroutine_t coro) {
+
+	return ((struct conet_co *) coro)->data;
+}
+
+void *co_set_data(coroutine_t coro, void *data) {
+	struct conet_co *co = (struct conet_co *) coro;
+	void *odata = co->data;
+
+	co->data = data;
+
+	return odata;
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_CORONET_CO_H)
+#define _CORONET_CO_H
+
+
+/*
+ * Built-in coroutine support, exporting the same API of the Portable
+ * Coroutine Library (PCL), so that coroutine_t users do not need to change.
+ */
+
+#ifdef __cplusplus
+#define COAPI extern "C"
+#else
+#define COAPI
+#endif
+
+
+
+typedef void *coroutine_t;
+
+
+
+COAPI int co_thread_init(void);
+COAPI void co_thread_cleanup(void);
+COAPI coroutine_t co_create(void (*func)(void *), void *data, void *stack,
+			    int size);
+COAPI void co_delete(coroutine_t coro);
+COAPI void co_call(coroutine_t coro);
+COAPI void co_resume(void);
+COAPI void co_exit_to(coroutine_t coro);
+COAPI void co_exit(void);
+COAPI coroutine_t co_current(void);
+COAPI void *co_get_data(coroutine_t coro);
+COAPI void *co_set_data(coroutine_t coro, void *data);
+
+
+#endif
@@ -0,0 +1,722 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "coronet.h"
+#include "coronet_http.h"
+
+
+
+/*
+ * Maximum amount of request body which is read and dropped, when the
+ * handler did not consume it, to keep the connection alive.
+ */
+#define CONET_HTTP_DISCARD (1024 * 64)
+#define CONET_HTTP_HEADSIZE 256
+
+#define CONET_HTTP_EOL(p) \
+	((p)[0] == '\n' || ((p)[0] == '\r' && (p)[1] == '\n'))
+
+
+
+static int conet_http_tchar(int c);
+static int conet_http_token(char const *val, char const *tok);
+static int conet_http_clen(char const *val, int vlen, long long *clen);
+static int conet_http_find_end(struct conet_http_req *req, char const *buf,
+			       int n, int start);
+static int conet_http_getln(struct sk_conn *conn, char **pln);
+static long long conet_http_avail(struct conet_http_req *req);
+static void conet_http_consume(struct conet_http_req *req, int n);
+static char const *conet_http_reason(int status);
+static int conet_http_write_head(struct sk_conn *conn,
+				 struct conet_http_req *req, int status,
+				 char const *hdrs, long long clen,
+				 void const *body, int n);
+static int conet_http_path_match(struct conet_http_route const *rt,
+				 struct conet_http_req const *req);
+static int conet_http_method_match(struct conet_http_route const *rt,
+				   struct conet_http_req const *req);
+static struct conet_http_route const *
+conet_http_route(struct conet_http_route const *routes,
+		 struct conet_http_req const *req, int *status);
+static void conet_http_allow(struct conet_http_route const *routes,
+			     struct conet_http_req const *req, char *buf,
+			     int size);
+
+
+
+
+static char const conet_http_cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+
+
+static int conet_http_tchar(int c) {
+
+	return isalnum(c) || (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/*
+ * Tells whether the comma separated list val contains the tok token.
+ */
+static int conet_http_token(char const *val, char const *tok) {
+	int n, tlen = strlen(tok);
+
+	for (;;) {
+		while (*val == ' ' || *val == '\t' || *val == ',')
+			val++;
+		if (*val == '\0')
+			return 0;
+		for (n = 0; val[n] != '\0' && val[n] != ',' && val[n] != ' ' &&
+			     val[n] != '\t'; n++);
+		if (n == tlen && strncasecmp(val, tok, n) == 0)
+			return 1;
+		val += n;
+	}
+}
+
+static int conet_http_clen(char const *val, int vlen, long long *clen) {
+	int i;
+	long long v;
+
+	if (vlen == 0)
+		return -1;
+	for (i = 0, v = 0; i < vlen; i++) {
+		if (!isdigit((unsigned char) val[i]) || v > (LLONG_MAX - 9) / 10)
+			return -1;
+		v = 10 * v + (val[i] - '0');
+	}
+	if (*clen >= 0 && *clen != v)
+		return -1;
+	*clen = v;
+
+	return 0;
+}
+
+/*
+ * Looks for the empty line terminating the request head, resuming from
+ * where the previous call left. Returns the head size, or 0 if more data
+ * is needed.
+ */
+static int conet_http_find_end(struct conet_http_req *req, char const *buf,
+			       int n, int start) {
+	int i;
+	char const *eol;
+
+	for (i = req->scan > start ? req->scan: start; i < n;
+	     i = (int) (eol - buf) + 1) {
+		if ((eol = (char const *) memchr(buf + i, '\n', n - i)) == NULL)
+			break;
+		if (eol + 1 == buf + n || (eol[1] == '\r' && eol + 2 == buf + n)) {
+			req->scan = (int) (eol - buf);
+			return 0;
+		}
+		if (eol[1] == '\n')
+			return (int) (eol - buf) + 2;
+		if (eol[1] == '\r' && eol[2] == '\n')
+			return (int) (eol - buf) + 3;
+	}
+	req->scan = n;
+
+	return 0;
+}
+
+/*
+ * Parses the request head found in the n bytes at buf, in place, without
+ * allocating memory. Incomplete heads can be fed again once more data has
+ * been appended, after having zeroed req->scan before the first call.
+ * Returns the head size, 0 if the head is incomplete, or -1 in case of
+ * error (EBADMSG for malformed requests, EMSGSIZE for too many headers).
+ */
+int conet_http_parse(struct conet_http_req *req, char *buf, int n) {
+	int start, hlen, ka = 0;
+	char *p, *q, *e, *lf;
+	struct conet_http_hdr *h;
+
+	for (start = 0; start < n && (buf[start] == '\r' || buf[start] == '\n');
+	     start++);
+	if ((hlen = conet_http_find_end(req, buf, n, start)) == 0)
+		return 0;
+	p = buf + start;
+	e = buf + hlen;
+
+	for (q = p; conet_http_tchar((unsigned char) *q); q++);
+	if (q == p || *q != ' ')
+		goto bad_request;
+	req->method = p;
+	req->mlen = (int) (q - p);
+	*q = '\0';
+	for (p = q + 1, q = p; (unsigned char) *q > ' ' && *q != 0x7f; q++);
+	if (q == p || *q != ' ')
+		goto bad_request;
+	req->path = p;
+	if ((lf = (char *) memchr(p, '?', q - p)) != NULL) {
+		req->plen = (int) (lf - p);
+		*lf = '\0';
+		req->query = lf + 1;
+		req->qlen = (int) (q - req->query);
+	} else {
+		req->plen = (int) (q - p);
+		req->query = NULL;
+		req->qlen = 0;
+	}
+	*q = '\0';
+	p = q + 1;
+	if (e - p < 9 || memcmp(p, "HTTP/1.", 7) != 0 ||
+	    !isdigit((unsigned char) p[7]))
+		goto bad_request;
+	req->minor = p[7] - '0';
+	p += 8;
+	if (!CONET_HTTP_EOL(p))
+		goto bad_request;
+	p += *p == '\r' ? 2: 1;
+
+	req->flags = 0;
+	if (req->mlen == 4 && memcmp(req->method, "HEAD", 4) == 0)
+		req->flags |= CONET_HTTP_HEAD;
+	req->clen = -1;
+	for (req->nhdrs = 0; !CONET_HTTP_EOL(p); req->nhdrs++) {
+		if (req->nhdrs == CONET_HTTP_MAXHDRS) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		h = &req->hdrs[req->nhdrs];
+		for (q = p; conet_http_tchar((unsigned char) *q); q++);
+		if (q == p || *q != ':')
+			goto bad_request;
+		h->name = p;
+		h->nlen = (int) (q - p);
+		*q = '\0';
+		for (p = q + 1; *p == ' ' || *p == '\t'; p++);
+		lf = (char *) memchr(p, '\n', e - p);
+		for (q = lf; q > p && (q[-1] == '\r' || q[-1] == ' ' ||
+				       q[-1] == '\t'); q--);
+		h->value = p;
+		h->vlen = (int) (q - p);
+		for (; p < q; p++)
+			if (((unsigned char) *p < ' ' && *p != '\t') || *p == 0x7f)
+				goto bad_request;
+		*q = '\0';
+		p = lf + 1;
+
+		if (strcasecmp(h->name, "Content-Length") == 0) {
+			if (conet_http_clen(h->value, h->vlen, &req->clen) < 0)
+				goto bad_request;
+		} else if (strcasecmp(h->name, "Transfer-Encoding") == 0) {
+			/*
+			 * Chunked is the only coding we can decode, and it must be
+			 * the final one anyway.
+			 */
+			if (strcasecmp(h->value, "chunked") != 0)
+				goto bad_request;
+			req->flags |= CONET_HTTP_CHUNKED;
+		} else if (strcasecmp(h->name, "Connection") == 0) {
+			if (conet_http_token(h->value, "close"))
+				req->flags |= CONET_HTTP_CLOSE;
+			ka |= conet_http_token(h->value, "keep-alive");
+		} else if (strcasecmp(h->name, "Expect") == 0) {
+			if (strcasecmp(h->value, "100-continue") == 0 && req->minor > 0)
+				req->flags |= CONET_HTTP_CONTINUE;
+		}
+	}
+	if (req->minor == 0 && !ka)
+		req->flags |= CONET_HTTP_CLOSE;
+	req->rem = 0;
+	if (req->flags & CONET_HTTP_CHUNKED) {
+		/*
+		 * A Content-Length along with chunked encoding is a smuggling
+		 * attempt, or a broken proxy. Honor the encoding, and do not
+		 * trust the stream after this request.
+		 */
+		if (req->clen >= 0)
+			req->flags |= CONET_HTTP_CLOSE;
+		req->clen = -1;
+	} else if (req->clen > 0)
+		req->rem = req->clen;
+	else
+		req->flags = (req->flags | CONET_HTTP_EOB) & ~CONET_HTTP_CONTINUE;
+	req->hlen = hlen;
+
+	return hlen;
+
+	bad_request:
+	errno = EBADMSG;
+	return -1;
+}
+
+char const *conet_http_header(struct conet_http_req const *req,
+			      char const *name, int *vlen) {
+	int i;
+
+	for (i = 0; i < req->nhdrs; i++)
+		if (strcasecmp(req->hdrs[i].name, name) == 0) {
+			if (vlen != NULL)
+				*vlen = req->hdrs[i].vlen;
+			return req->hdrs[i].value;
+		}
+
+	return NULL;
+}
+
+/*
+ * Reads and parses the next request head from conn, in place inside the
+ * connection buffer. Returns 1 if a request has been read, 0 if the peer
+ * closed the connection between requests, or -1 in case of error.
+ */
+int conet_http_read_req(struct sk_conn *conn, struct conet_http_req *req) {
+	int n, idle;
+
+	req->conn = conn;
+	req->scan = 0;
+	for (;;) {
+		if (conn->ridx < conn->bcnt &&
+		    (n = conet_http_parse(req, conn->buf + conn->ridx,
+					  conn->bcnt - conn->ridx)) != 0) {
+			if (n < 0)
+				return -1;
+			conn->ridx += n;
+			return 1;
+		}
+		idle = conn->ridx == conn->bcnt;
+		if ((n = conet_fill(conn, idle)) <= 0) {
+			if (n == 0 && !idle) {
+				errno = EBADMSG;
+				return -1;
+			}
+			return n;
+		}
+	}
+}
+
+static int conet_http_getln(struct sk_conn *conn, char **pln) {
+	int n;
+	char *eol;
+
+	for (;;) {
+		if (conn->ridx < conn->bcnt &&
+		    (eol = (char *) memchr(conn->buf + conn->ridx, '\n',
+					   conn->bcnt - conn->ridx)) != NULL) {
+			*pln = conn->buf + conn->ridx;
+			n = (int) (eol - *pln) + 1;
+			conn->ridx += n;
+			return n;
+		}
+		if ((n = conet_fill(conn, 0)) <= 0) {
+			if (n == 0)
+				errno = EBADMSG;
+			return -1;
+		}
+	}
+}
+
+/*
+ * Returns how many body bytes can be read next, walking over the chunked
+ * framing if needed, 0 at the end of the body, or -1 in case of error.
+ */
+static long long conet_http_avail(struct conet_http_req *req) {
+	int n;
+	long long size;
+	char *ln, *p;
+
+	if (req->flags & CONET_HTTP_EOB)
+		return 0;
+	if (req->flags & CONET_HTTP_CONTINUE) {
+		req->flags &= ~CONET_HTTP_CONTINUE;
+		if (conet_write(req->conn, conet_http_cont,
+				sizeof(conet_http_cont) - 1) < 0)
+			return -1;
+	}
+	if (!(req->flags & CONET_HTTP_CHUNKED) || req->rem > 0)
+		return req->rem;
+	if (req->flags & CONET_HTTP_CHKEND) {
+		if ((n = conet_http_getln(req->conn, &ln)) < 0)
+			return -1;
+		if (!CONET_HTTP_EOL(ln))
+			goto bad_chunk;
+		req->flags &= ~CONET_HTTP_CHKEND;
+	}
+	if (conet_http_getln(req->conn, &ln) < 0)
+		return -1;
+	for (size = 0, p = ln; isxdigit((unsigned char) *p); p++) {
+		if (size >> 58)
+			goto bad_chunk;
+		size = 16 * size + (*p <= '9' ? *p - '0': (*p | 0x20) - 'a' + 10);
+	}
+	if (p == ln || (*p != ';' && *p != ' ' && *p != '\t' && !CONET_HTTP_EOL(p)))
+		goto bad_chunk;
+	if (size == 0) {
+		/*
+		 * Trailer fields are dropped.
+		 */
+		do {
+			if (conet_http_getln(req->conn, &ln) < 0)
+				return -1;
+		} while (!CONET_HTTP_EOL(ln));
+		req->flags |= CONET_HTTP_EOB;
+		return 0;
+	}
+	req->rem = size;
+
+	return size;
+
+	bad_chunk:
+	errno = EBADMSG;
+	return -1;
+}
+
+static void conet_http_consume(struct conet_http_req *req, int n) {
+
+	if ((req->rem -= n) == 0)
+		req->flags |= (req->flags & CONET_HTTP_CHUNKED) ?
+			CONET_HTTP_CHKEND: CONET_HTTP_EOB;
+}
+
+/*
+ * Sets up req to read a body of clen bytes from conn, or a chunked one if
+ * clen is negative, so that the body readers can be used on responses too.
+ */
+void conet_http_init_body(struct conet_http_req *req, struct sk_conn *conn,
+			  long long clen) {
+
+	req->conn = conn;
+	req->clen = clen;
+	req->rem = clen > 0 ? clen: 0;
+	req->flags = clen < 0 ? CONET_HTTP_CHUNKED:
+		(clen == 0 ? CONET_HTTP_EOB: 0);
+}
+
+/*
+ * Reads up to n bytes of the request body (de-chunked) into buf. Returns
+ * the number of bytes read, 0 at the end of the body, or -1 in case of
+ * error (EBADMSG for broken framing or truncated bodies).
+ */
+int conet_http_read(struct conet_http_req *req, void *buf, int n) {
+	int cnt;
+	long long avail;
+
+	if ((avail = conet_http_avail(req)) <= 0)
+		return (int) avail;
+	if (n > avail)
+		n = (int) avail;
+	if ((cnt = conet_readsome(req->conn, buf, n)) <= 0) {
+		if (cnt == 0)
+			errno = EBADMSG;
+		return -1;
+	}
+	conet_http_consume(req, cnt);
+
+	return cnt;
+}
+
+/*
+ * Like conet_http_read(), but returns in *pbuf a pointer to the body data
+ * inside the connection buffer, instead of copying it. The data is valid
+ * until the next read over the connection, so it can be written out (or
+ * echoed back with conet_http_send_body()) without copies.
+ */
+int conet_http_read_zc(struct conet_http_req *req, char **pbuf, int n) {
+	int cnt;
+	long long avail;
+	struct sk_conn *conn = req->conn;
+
+	if ((avail = conet_http_avail(req)) <= 0)
+		return (int) avail;
+	if (conn->ridx == conn->bcnt && (cnt = conet_fill(conn, 0)) <= 0) {
+		if (cnt == 0)
+			errno = EBADMSG;
+		return -1;
+	}
+	if ((cnt = conn->bcnt - conn->ridx) > n)
+		cnt = n;
+	if (cnt > avail)
+		cnt = (int) avail;
+	*pbuf = conn->buf + conn->ridx;
+	conn->ridx += cnt;
+	conet_http_consume(req, cnt);
+
+	return cnt;
+}
+
+static char const *conet_http_reason(int status) {
+
+	switch (status) {
+	case 100: return "Continue";
+	case 200: return "OK";
+	case 201: return "Created";
+	case 204: return "No Content";
+	case 206: return "Partial Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 408: return "Request Timeout";
+	case 411: return "Length Required";
+	case 413: return "Content Too Large";
+	case 431: return "Request Header Fields Too Large";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 503: return "Service Unavailable";
+	}
+
+	return "Unknown";
+}
+
+/*
+ * Writes the response head, followed by the hdrs extra header lines (each
+ * one CRLF terminated) and the n bytes of body, with a single vectored
+ * write. A negative clen selects chunked encoding for HTTP/1.1 clients,
+ * and a body delimited by the connection close for HTTP/1.0 ones.
+ * A client still waiting for a 100-continue gets it ahead of successful
+ * responses, while others tell it that its body is not wanted. Responses
+ * to HEAD requests carry the same head, but no body.
+ */
+static int conet_http_write_head(struct sk_conn *conn,
+				 struct conet_http_req *req, int status,
+				 char const *hdrs, long long clen,
+				 void const *body, int n) {
+	int hsize, cnt = 0;
+	char head[CONET_HTTP_HEADSIZE];
+	struct iovec iov[5];
+
+	if (req->flags & CONET_HTTP_CONTINUE) {
+		if (status >= 200 && status < 300) {
+			req->flags &= ~CONET_HTTP_CONTINUE;
+			iov[cnt].iov_base = (char *) conet_http_cont;
+			iov[cnt++].iov_len = sizeof(conet_http_cont) - 1;
+		} else
+			req->flags |= CONET_HTTP_CLOSE;
+	}
+	if (clen < 0 && req->minor == 0 && !(req->flags & CONET_HTTP_HEAD))
+		req->flags |= CONET_HTTP_CLOSE;
+	hsize = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n", status,
+			 conet_http_reason(status));
+	if (req->flags & CONET_HTTP_CLOSE)
+		hsize += snprintf(head + hsize, sizeof(head) - hsize,
+				  "Connection: close\r\n");
+	else if (req->minor == 0)
+		hsize += snprintf(head + hsize, sizeof(head) - hsize,
+				  "Connection: keep-alive\r\n");
+	if (clen >= 0)
+		hsize += snprintf(head + hsize, sizeof(head) - hsize,
+				  "Content-Length: %lld\r\n", clen);
+	else if (req->minor > 0) {
+		hsize += snprintf(head + hsize, sizeof(head) - hsize,
+				  "Transfer-Encoding: chunked\r\n");
+		if (!(req->flags & CONET_HTTP_HEAD))
+			req->flags |= CONET_HTTP_RSPCHUNKED;
+	}
+	iov[cnt].iov_base = head;
+	iov[cnt++].iov_len = hsize;
+	if (hdrs != NULL) {
+		iov[cnt].iov_base = (char *) hdrs;
+		iov[cnt++].iov_len = strlen(hdrs);
+	}
+	iov[cnt].iov_base = (char *) "\r\n";
+	iov[cnt++].iov_len = 2;
+	if (n > 0 && !(req->flags & CONET_HTTP_HEAD)) {
+		iov[cnt].iov_base = (char *) body;
+		iov[cnt++].iov_len = n;
+	}
+
+	return conet_writev(conn, iov, cnt) < 0 ? -1: 0;
+}
+
+int conet_http_send_head(struct sk_conn *conn, struct conet_http_req *req,
+			 int status, char const *hdrs, long long clen) {
+
+	return conet_http_write_head(conn, req, status, hdrs, clen, NULL, 0);
+}
+
+/*
+ * Sends n bytes of response body, framing them as a chunk if the head
+ * selected chunked encoding. The chunk header, data and trailing CRLF go
+ * out with a single vectored write. Nothing is sent in reply to HEAD.
+ */
+int conet_http_send_body(struct sk_conn *conn, struct conet_http_req *req,
+			 void const *buf, int n) {
+	char szln[24];
+	struct iovec iov[3];
+
+	if (req->flags & CONET_HTTP_HEAD)
+		return n;
+	if (!(req->flags & CONET_HTTP_RSPCHUNKED))
+		return conet_write(conn, buf, n);
+	if (n == 0)
+		return 0;
+	iov[0].iov_base = szln;
+	iov[0].iov_len = snprintf(szln, sizeof(szln), "%x\r\n", n);
+	iov[1].iov_base = (char *) buf;
+	iov[1].iov_len = n;
+	iov[2].iov_base = (char *) "\r\n";
+	iov[2].iov_len = 2;
+
+	return conet_writev(conn, iov, 3) < 0 ? -1: n;
+}
+
+int conet_http_send_end(struct sk_conn *conn, struct conet_http_req *req) {
+	static char const eob[] = "0\r\n\r\n";
+
+	if (!(req->flags & CONET_HTTP_RSPCHUNKED))
+		return 0;
+	req->flags &= ~CONET_HTTP_RSPCHUNKED;
+
+	return conet_write(conn, eob, sizeof(eob) - 1) < 0 ? -1: 0;
+}
+
+int conet_http_respond(struct sk_conn *conn, struct conet_http_req *req,
+		       int status, char const *hdrs, void const *body, int n) {
+
+	return conet_http_write_head(conn, req, status, hdrs, n, body, n);
+}
+
+static int conet_http_path_match(struct conet_http_route const *rt,
+				 struct conet_http_req const *req) {
+	int n = strlen(rt->path);
+
+	if (n > 0 && rt->path[n - 1] == '*')
+		return req->plen >= n - 1 && memcmp(req->path, rt->path, n - 1) == 0;
+
+	return req->plen == n && memcmp(req->path, rt->path, n) == 0;
+}
+
+/*
+ * HEAD requests are served by the GET routes, the response body being
+ * dropped by the send functions.
+ */
+static int conet_http_method_match(struct conet_http_route const *rt,
+				   struct conet_http_req const *req) {
+
+	return rt->method == NULL || strcmp(rt->method, req->method) == 0 ||
+		((req->flags & CONET_HTTP_HEAD) && strcmp(rt->method, "GET") == 0);
+}
+
+static struct conet_http_route const *
+conet_http_route(struct conet_http_route const *routes,
+		 struct conet_http_req const *req, int *status) {
+
+	for (*status = 404; routes->fn != NULL; routes++) {
+		if (!conet_http_path_match(routes, req))
+			continue;
+		if (conet_http_method_match(routes, req))
+			return routes;
+		*status = 405;
+	}
+
+	return NULL;
+}
+
+/*
+ * Builds in buf the Allow header line for a 405 response, listing the
+ * methods of the routes matching the request path. Methods which do not
+ * fit in buf are left out.
+ */
+static void conet_http_allow(struct conet_http_route const *routes,
+			     struct conet_http_req const *req, char *buf,
+			     int size) {
+	int i, n, len;
+	char const *mth[2];
+
+	len = snprintf(buf, size, "Allow: ");
+	for (; routes->fn != NULL; routes++) {
+		if (routes->method == NULL || !conet_http_path_match(routes, req))
+			continue;
+		mth[0] = routes->method;
+		mth[1] = strcmp(routes->method, "GET") == 0 ? "HEAD": NULL;
+		for (i = 0; i < 2 && mth[i] != NULL; i++) {
+			if (conet_http_token(buf + 7, mth[i]))
+				continue;
+			n = strlen(mth[i]);
+			if (len + n + 4 >= size)
+				break;
+			len += snprintf(buf + len, size - len, "%s%s",
+					len > 7 ? ", ": "", mth[i]);
+		}
+	}
+	snprintf(buf + len, size - len, "\r\n");
+}
+
+/*
+ * Serves one request over conn, dispatching it to the first matching entry
+ * of the routes table, and answering 404/405 if none does. HEAD requests
+ * are dispatched to the GET routes. Request bodies left unread by the
+ * handler are dropped, up to CONET_HTTP_DISCARD bytes. Passing
+ * CONET_HTTP_CLOSE in flags closes the connection after the response.
+ * Returns 1 if the connection can serve another request, 0 if it must be
+ * closed, or -1 in case of error.
+ */
+int conet_http_serve(struct sk_conn *conn,
+		     struct conet_http_route const *routes,
+		     unsigned int flags) {
+	int n, status;
+	long tot;
+	char *ptr;
+	char allow[CONET_HTTP_HEADSIZE];
+	struct conet_http_route const *rt;
+	struct conet_http_req req;
+
+	if ((n = conet_http_read_req(conn, &req)) <= 0) {
+		if (n < 0 && (errno == EBADMSG || errno == EMSGSIZE)) {
+			status = errno == EMSGSIZE ? 431: 400;
+			req.minor = 1;
+			req.flags = CONET_HTTP_CLOSE;
+			conet_http_respond(conn, &req, status, NULL, NULL, 0);
+		}
+		return n;
+	}
+	req.flags |= flags & CONET_HTTP_CLOSE;
+	if (conet_draining())
+		req.flags |= CONET_HTTP_CLOSE;
+	if ((rt = conet_http_route(routes, &req, &status)) == NULL) {
+		if (status == 405)
+			conet_http_allow(routes, &req, allow, sizeof(allow));
+		if (conet_http_respond(conn, &req, status,
+				       status == 405 ? allow: NULL, NULL, 0) < 0)
+			return -1;
+	} else if ((*rt->fn)(conn, &req, rt->data) < 0)
+		return -1;
+	if (!(req.flags & CONET_HTTP_EOB)) {
+		/*
+		 * The client has not been told to send the body, and we do not
+		 * want it anymore.
+		 */
+		if (req.flags & CONET_HTTP_CONTINUE)
+			return 0;
+		for (tot = 0; (n = conet_http_read_zc(&req, &ptr, CONET_BUFSIZE)) > 0;)
+			if ((tot += n) > CONET_HTTP_DISCARD)
+				return 0;
+		if (n < 0)
+			return -1;
+	}
+
+	return (req.flags & CONET_HTTP_CLOSE) ? 0: 1;
+}
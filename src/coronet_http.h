@@ -0,0 +1,95 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_CORONET_HTTP_H)
+#define _CORONET_HTTP_H
+
+
+#include "coronet.h"
+
+
+
+#define CONET_HTTP_MAXHDRS 32
+
+#define CONET_HTTP_CLOSE (1 << 0)
+#define CONET_HTTP_CHUNKED (1 << 1)
+#define CONET_HTTP_CONTINUE (1 << 2)
+#define CONET_HTTP_EOB (1 << 3)
+#define CONET_HTTP_CHKEND (1 << 4)
+#define CONET_HTTP_RSPCHUNKED (1 << 5)
+#define CONET_HTTP_HEAD (1 << 6)
+
+struct conet_http_hdr {
+	char const *name, *value;
+	int nlen, vlen;
+};
+
+/*
+ * Parsed request. All the strings point inside the connection buffer, and
+ * are NUL terminated in place, so they remain valid only until the request
+ * body is read, or the next request is parsed.
+ */
+struct conet_http_req {
+	struct sk_conn *conn;
+	char const *method, *path, *query;
+	int mlen, plen, qlen;
+	int minor;
+	unsigned int flags;
+	long long clen, rem;
+	int hlen, scan;
+	int nhdrs;
+	struct conet_http_hdr hdrs[CONET_HTTP_MAXHDRS];
+};
+
+typedef int (*conet_http_handler_t)(struct sk_conn *, struct conet_http_req *,
+				    void *);
+
+/*
+ * Routing table entry. A NULL method matches any, and a path ending with
+ * '*' matches as prefix. Tables are terminated by a NULL handler.
+ */
+struct conet_http_route {
+	char const *method;
+	char const *path;
+	conet_http_handler_t fn;
+	void *data;
+};
+
+
+
+CNAPI int conet_http_parse(struct conet_http_req *req, char *buf, int n);
+CNAPI char const *conet_http_header(struct conet_http_req const *req,
+				    char const *name, int *vlen);
+CNAPI int conet_http_read_req(struct sk_conn *conn, struct conet_http_req *req);
+CNAPI void conet_http_init_body(struct conet_http_req *req, struct sk_conn *conn,
+				long long clen);
+CNAPI int conet_http_read(struct conet_http_req *req, void *buf, int n);
+CNAPI int conet_http_read_zc(struct conet_http_req *req, char **pbuf, int n);
+CNAPI int conet_http_send_head(struct sk_conn *conn, struct conet_http_req *req,
+			       int status, char const *hdrs, long long clen);
+CNAPI int conet_http_send_body(struct sk_conn *conn, struct conet_http_req *req,
+			       void const *buf, int n);
+CNAPI int conet_http_send_end(struct sk_conn *conn, struct conet_http_req *req);
+CNAPI int conet_http_respond(struct sk_conn *conn, struct conet_http_req *req,
+			     int status, char const *hdrs, void const *body,
+			     int n);
+CNAPI int conet_http_serve(struct sk_conn *conn,
+			   struct conet_http_route const *routes,
+			   unsigned int flags);
+
+
+#endif
@@ -0,0 +1,255 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include "coronet.h"
+#include "coronet_lists.h"
+#include "coronet_timer.h"
+
+
+
+static unsigned long long conet_tmr_tick(struct conet_tmrwheel const *w,
+					 mstime_t t);
+static void conet_tmr_insert(struct conet_tmrwheel *w, struct conet_tmo *tmo,
+			     unsigned long long tick);
+static void conet_tmr_due(struct conet_tmrwheel *w, struct ll_head *head);
+static unsigned long long conet_tmr_next_tick(struct conet_tmrwheel *w);
+
+
+
+
+void conet_tmr_init(struct conet_tmrwheel *w, mstime_t tcurr, int step) {
+	int i, j;
+
+	w->origin = tcurr;
+	w->step = step > 0 ? step: 1;
+	w->now = 0;
+	w->count = 0;
+	conet_llinit(&w->due);
+	for (i = 0; i < CONET_TMR_LEVELS; i++)
+		for (j = 0; j < CONET_TMR_LVLSIZE; j++)
+			conet_llinit(&w->slots[i][j]);
+}
+
+/*
+ * Returns the tick t falls in, rounded up, so that nothing ever fires
+ * before its expire time.
+ */
+static unsigned long long conet_tmr_tick(struct conet_tmrwheel const *w,
+					 mstime_t t) {
+
+	return t > w->origin ? (t - w->origin + w->step - 1) / w->step: 0;
+}
+
+/*
+ * Links tmo into the slot of the lowest level whose span covers tick,
+ * which must be past the current one. The tmo tick is set to the one at
+ * which the wheel will look at the slot again. Ticks beyond the top level
+ * span are clamped, and re-slotted once the wheel gets there.
+ */
+static void conet_tmr_insert(struct conet_tmrwheel *w, struct conet_tmo *tmo,
+			     unsigned long long tick) {
+	int lvl, shift;
+	unsigned long long delta = tick - w->now;
+
+	for (lvl = 0, shift = 0; lvl < CONET_TMR_LEVELS - 1 &&
+		     delta >= (1ULL << (shift + CONET_TMR_LVLBITS));
+	     lvl++, shift += CONET_TMR_LVLBITS);
+	if (delta >= (1ULL << (shift + CONET_TMR_LVLBITS)))
+		tick = w->now + (1ULL << (shift + CONET_TMR_LVLBITS)) - 1;
+	tmo->tick = (tick >> shift) << shift;
+	conet_lladdt(&tmo->lnk,
+		     &w->slots[lvl][(tick >> shift) & CONET_TMR_LVLMASK]);
+}
+
+/*
+ * Arms tmo to expire at tmo->exptmo. A tmo still on the wheel (armed, or
+ * lazily cancelled) is only moved if it needs to fire earlier than the
+ * wheel would look at it, so re-arming it with an equal or later expire
+ * time costs no list operation.
+ */
+void conet_tmr_add(struct conet_tmrwheel *w, struct conet_tmo *tmo) {
+	unsigned long long tick = conet_tmr_tick(w, tmo->exptmo);
+
+	if (tick <= w->now)
+		tick = w->now + 1;
+	if (tmo->tick != 0) {
+		if (tick >= tmo->tick)
+			return;
+		conet_lldel(&tmo->lnk);
+		w->count--;
+	}
+	conet_tmr_insert(w, tmo, tick);
+	w->count++;
+}
+
+void conet_tmr_del(struct conet_tmrwheel *w, struct conet_tmo *tmo) {
+
+	if (tmo->tick != 0) {
+		conet_lldel_init(&tmo->lnk);
+		tmo->tick = 0;
+		w->count--;
+	}
+}
+
+/*
+ * Moves the entries of head to the wheel due list.
+ */
+static void conet_tmr_due(struct conet_tmrwheel *w, struct ll_head *head) {
+	struct ll_head *first, *last;
+
+	if ((first = conet_llfirst(head)) == NULL)
+		return;
+	last = head->prev;
+	first->prev = w->due.prev;
+	w->due.prev->next = first;
+	last->next = &w->due;
+	w->due.prev = last;
+	conet_llinit(head);
+}
+
+/*
+ * Returns the first tick past the current one with a non empty slot to
+ * look at, or zero if there is none. The ticks in between have nothing to
+ * do, so the wheel can jump over them. Every level only needs to be looked
+ * at if the lower ones have nothing before its next boundary.
+ */
+static unsigned long long conet_tmr_next_tick(struct conet_tmrwheel *w) {
+	int lvl, shift, k;
+	unsigned long long base, tick, best = 0;
+
+	for (lvl = 0, shift = 0; lvl < CONET_TMR_LEVELS;
+	     lvl++, shift += CONET_TMR_LVLBITS) {
+		base = w->now >> shift;
+		if (best != 0 && best <= (base + 1) << shift)
+			break;
+		for (k = 1; k <= CONET_TMR_LVLSIZE; k++) {
+			if (!conet_llempty(&w->slots[lvl][(base + k) &
+							   CONET_TMR_LVLMASK])) {
+				tick = (base + k) << shift;
+				if (best == 0 || tick < best)
+					best = tick;
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Advances the wheel up to tcurr, and calls fn for the expired entries,
+ * which are unlinked (and can be re-armed) by then. Every tick advanced,
+ * and every entry looked at, counts against budget (none if not
+ * positive). Once it runs out, the wheel keeps its position, and resumes
+ * from there at the next call. Returns the number of fired entries.
+ */
+int conet_tmr_run(struct conet_tmrwheel *w, mstime_t tcurr, int budget,
+		  conet_tmr_fire_t fn, void *data) {
+	int n, lvl, shift, nfired;
+	unsigned long long target, tick, next;
+	struct ll_head *pos, xlst;
+	struct conet_tmo *tmo;
+
+	target = tcurr > w->origin ? (tcurr - w->origin) / w->step: 0;
+	conet_llinit(&xlst);
+	for (n = 0;;) {
+		for (; (budget <= 0 || n < budget) &&
+			     (pos = conet_llfirst(&w->due)) != NULL; n++) {
+			tmo = CONET_LLENT(pos, struct conet_tmo, lnk);
+			conet_lldel(pos);
+			if (tmo->exptmo == 0) {
+				conet_llinit(pos);
+				tmo->tick = 0;
+				w->count--;
+			} else if ((tick = conet_tmr_tick(w, tmo->exptmo)) <= w->now) {
+				tmo->tick = w->now;
+				conet_lladdt(pos, &xlst);
+			} else
+				conet_tmr_insert(w, tmo, tick);
+		}
+		if (!conet_llempty(&w->due) || w->now >= target ||
+		    (budget > 0 && n >= budget))
+			break;
+		if ((next = conet_tmr_next_tick(w)) == 0 || next > target) {
+			w->now = target;
+			break;
+		}
+
+		/*
+		 * The level 0 slot holds the entries expiring at this tick, and
+		 * at the level boundaries the upper level slots get cascaded.
+		 */
+		n++;
+		w->now = next;
+		conet_tmr_due(w, &w->slots[0][w->now & CONET_TMR_LVLMASK]);
+		for (lvl = 1, shift = CONET_TMR_LVLBITS; lvl < CONET_TMR_LEVELS &&
+			     !(w->now & ((1ULL << shift) - 1));
+		     lvl++, shift += CONET_TMR_LVLBITS)
+			conet_tmr_due(w, &w->slots[lvl][(w->now >> shift) &
+							CONET_TMR_LVLMASK]);
+	}
+
+	/*
+	 * What fn runs can add, delete, cancel or re-arm any other entry,
+	 * including the ones still sitting here.
+	 */
+	for (nfired = 0; (pos = conet_llfirst(&xlst)) != NULL;) {
+		tmo = CONET_LLENT(pos, struct conet_tmo, lnk);
+		conet_lldel_init(pos);
+		tmo->tick = 0;
+		w->count--;
+		if (tmo->exptmo == 0)
+			continue;
+		if ((tick = conet_tmr_tick(w, tmo->exptmo)) > w->now) {
+			conet_tmr_insert(w, tmo, tick);
+			w->count++;
+			continue;
+		}
+		nfired++;
+		(*fn)(tmo, data);
+	}
+
+	return nfired;
+}
+
+/*
+ * Returns the milliseconds from tcurr to the next tick the wheel has work
+ * for, or -1 if it is empty.
+ */
+int conet_tmr_next(struct conet_tmrwheel *w, mstime_t tcurr) {
+	unsigned long long tick;
+	mstime_t tnext;
+
+	if (!conet_llempty(&w->due))
+		return 0;
+	if (w->count == 0 || (tick = conet_tmr_next_tick(w)) == 0)
+		return -1;
+	tnext = w->origin + tick * w->step;
+	if (tnext > tcurr && tnext - tcurr > (mstime_t) INT_MAX)
+		return INT_MAX;
+
+	return tnext > tcurr ? (int) (tnext - tcurr): 0;
+}
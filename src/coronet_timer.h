@@ -0,0 +1,70 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_CORONET_TIMER_H)
+#define _CORONET_TIMER_H
+
+
+#include "coronet.h"
+
+
+
+#define CONET_TMR_LVLBITS 6
+#define CONET_TMR_LVLSIZE (1 << CONET_TMR_LVLBITS)
+#define CONET_TMR_LVLMASK (CONET_TMR_LVLSIZE - 1)
+#define CONET_TMR_LEVELS 4
+
+/*
+ * Hierarchical timer wheel, ticking every step milliseconds. Level N slots
+ * span 64^N ticks, and get cascaded into the lower levels as the wheel
+ * reaches them. The wheel does not depend on the event loop, which owns
+ * one, and drives it with conet_tmr_run().
+ */
+struct conet_tmrwheel {
+	mstime_t origin;
+	int step;
+	unsigned long long now;
+	long count;
+	struct ll_head due;
+	struct ll_head slots[CONET_TMR_LEVELS][CONET_TMR_LVLSIZE];
+};
+
+typedef void (*conet_tmr_fire_t)(struct conet_tmo *, void *);
+
+
+
+CNAPI void conet_tmr_init(struct conet_tmrwheel *w, mstime_t tcurr, int step);
+CNAPI void conet_tmr_add(struct conet_tmrwheel *w, struct conet_tmo *tmo);
+CNAPI void conet_tmr_del(struct conet_tmrwheel *w, struct conet_tmo *tmo);
+CNAPI int conet_tmr_run(struct conet_tmrwheel *w, mstime_t tcurr, int budget,
+			conet_tmr_fire_t fn, void *data);
+CNAPI int conet_tmr_next(struct conet_tmrwheel *w, mstime_t tcurr);
+
+
+/*
+ * Lazily cancels tmo, which stays on the wheel (and is dropped when the
+ * wheel gets to it) unless re-armed earlier. The tmo memory must then stay
+ * valid until a conet_tmr_del(), like the connections one does.
+ */
+static inline void conet_tmr_cancel(struct conet_tmo *tmo) {
+
+	tmo->exptmo = 0;
+}
+
+
+#endif
+
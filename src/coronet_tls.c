@@ -0,0 +1,557 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include "coronet.h"
+#include "coronet_tls.h"
+
+
+
+#ifdef HAVE_OPENSSL_SSL_H
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/bio.h>
+
+
+
+/*
+ * Client sessions are cached by peer name, in a direct mapped table, so
+ * that reconnecting to the same peer can skip the full handshake.
+ */
+#define CONET_TLS_SCSIZE (1 << 6)
+#define CONET_TLS_SCMASK (CONET_TLS_SCSIZE - 1)
+
+
+
+struct conet_tls_sess {
+	unsigned long hash;
+	char *peer;
+	SSL_SESSION *sess;
+};
+
+struct conet_tls {
+	SSL_CTX *sctx;
+	unsigned int flags;
+	struct conet_tls_sess scache[CONET_TLS_SCSIZE];
+};
+
+/*
+ * Unless kTLS is requested, the SSL object talks to a BIO pair, and the
+ * ciphertext is moved between the network BIO and the socket by us. This
+ * keeps the socket I/O (and its EAGAIN handling) in coronet hands. With
+ * kTLS the SSL object needs to own the socket, so a socket BIO is used and
+ * nbio is NULL.
+ */
+struct conet_tls_conn {
+	SSL *ssl;
+	BIO *nbio;
+	struct conet_tls *tls;
+	char *peer;
+	int wpend;
+	int fatal;
+};
+
+
+
+static unsigned long conet_tls_hash(char const *str);
+static int conet_tls_new_sess(SSL *ssl, SSL_SESSION *sess);
+static int conet_tls_flush(struct sk_conn *conn, struct conet_tls_conn *tc);
+static int conet_tls_fill(struct sk_conn *conn, struct conet_tls_conn *tc);
+static int conet_tls_want(struct sk_conn *conn, struct conet_tls_conn *tc,
+			  int err, unsigned int *events);
+static int conet_tls_read(struct sk_conn *conn, void *buf, int n,
+			  unsigned int *events);
+static int conet_tls_write(struct sk_conn *conn, void const *buf, int n,
+			   unsigned int *events);
+static int conet_tls_handshake(struct sk_conn *conn, unsigned int *events);
+static int conet_tls_pending(struct sk_conn *conn);
+static void conet_tls_close(struct sk_conn *conn);
+
+
+
+static struct conet_xprt const tls_xprt = {
+	conet_tls_read,
+	conet_tls_write,
+	conet_tls_handshake,
+	conet_tls_pending,
+	conet_tls_close
+};
+
+
+
+
+static unsigned long conet_tls_hash(char const *str) {
+	unsigned long hash = 5381;
+
+	for (; *str; str++)
+		hash = hash * 33 + (unsigned char) *str;
+
+	return hash;
+}
+
+/*
+ * Stores a new client session in the peer cache. With TLS 1.3 sessions
+ * arrive after the handshake, so this is done from the OpenSSL callback
+ * rather than after SSL_do_handshake().
+ */
+static int conet_tls_new_sess(SSL *ssl, SSL_SESSION *sess) {
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) SSL_get_app_data(ssl);
+	struct conet_tls_sess *se;
+	unsigned long hash;
+
+	if (tc == NULL || tc->peer == NULL)
+		return 0;
+	hash = conet_tls_hash(tc->peer);
+	se = &tc->tls->scache[hash & CONET_TLS_SCMASK];
+	if (se->peer == NULL || strcmp(se->peer, tc->peer) != 0) {
+		free(se->peer);
+		if ((se->peer = strdup(tc->peer)) == NULL)
+			return 0;
+	}
+	if (se->sess != NULL)
+		SSL_SESSION_free(se->sess);
+	se->hash = hash;
+	se->sess = sess;
+
+	return 1;
+}
+
+/*
+ * Pushes the ciphertext queued inside the network BIO to the socket.
+ * Returns 0 once everything has been sent, or -1 with errno set (EAGAIN
+ * if the socket buffer is full).
+ */
+static int conet_tls_flush(struct sk_conn *conn, struct conet_tls_conn *tc) {
+	int n;
+	char *ptr;
+
+	if (tc->nbio == NULL)
+		return 0;
+	while ((n = BIO_nread0(tc->nbio, &ptr)) > 0) {
+		if ((n = write(conn->sfd, ptr, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		BIO_nread(tc->nbio, &ptr, n);
+	}
+
+	return 0;
+}
+
+/*
+ * Moves socket input straight into the network BIO buffer. Returns the
+ * number of bytes moved, 0 on EOF, or -1 with errno set.
+ */
+static int conet_tls_fill(struct sk_conn *conn, struct conet_tls_conn *tc) {
+	int n, cnt;
+	char *ptr;
+
+	if ((cnt = BIO_nwrite0(tc->nbio, &ptr)) <= 0)
+		return 1;
+	while ((n = read(conn->sfd, ptr, cnt)) < 0)
+		if (errno != EINTR)
+			return -1;
+	if (n > 0)
+		BIO_nwrite(tc->nbio, &ptr, n);
+
+	return n;
+}
+
+/*
+ * Handles an SSL_get_error() code. Returns 1 if the SSL call should be
+ * retried, 0 on a clean EOF, or -1 with errno set. An EAGAIN errno comes
+ * with the event to wait for stored in *events.
+ */
+static int conet_tls_want(struct sk_conn *conn, struct conet_tls_conn *tc,
+			  int err, unsigned int *events) {
+	int n;
+
+	switch (err) {
+	case SSL_ERROR_WANT_READ:
+		if (tc->nbio != NULL) {
+			*events = EPOLLOUT;
+			if (conet_tls_flush(conn, tc) < 0)
+				return -1;
+			if ((n = conet_tls_fill(conn, tc)) != 0) {
+				*events = EPOLLIN;
+				return n > 0 ? 1: -1;
+			}
+			return 0;
+		}
+		*events = EPOLLIN;
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_WANT_WRITE:
+		*events = EPOLLOUT;
+		if (tc->nbio != NULL)
+			return conet_tls_flush(conn, tc) < 0 ? -1: 1;
+		errno = EAGAIN;
+		return -1;
+
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+
+	case SSL_ERROR_SYSCALL:
+		tc->fatal = 1;
+		if (errno == 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+	tc->fatal = 1;
+	ERR_clear_error();
+	errno = EPROTO;
+
+	return -1;
+}
+
+static int conet_tls_read(struct sk_conn *conn, void *buf, int n,
+			  unsigned int *events) {
+	int res;
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	for (;;) {
+		ERR_clear_error();
+		if ((res = SSL_read(tc->ssl, buf, n)) > 0) {
+			/*
+			 * Reads can generate output (session tickets, key updates),
+			 * which is left queued if the socket is full, and pushed by
+			 * the next write or read.
+			 */
+			conet_tls_flush(conn, tc);
+			return res;
+		}
+		if ((res = conet_tls_want(conn, tc, SSL_get_error(tc->ssl, res),
+					  events)) <= 0)
+			return res;
+	}
+}
+
+/*
+ * A write is not reported as done until its ciphertext left the network
+ * BIO, otherwise a following close, or hibernation, could leave it behind.
+ * The plaintext count of a write which could not be fully pushed is kept
+ * in wpend, and returned once the caller retries after the socket drained.
+ */
+static int conet_tls_write(struct sk_conn *conn, void const *buf, int n,
+			   unsigned int *events) {
+	int res;
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	*events = EPOLLOUT;
+	if (tc->wpend > 0) {
+		if (conet_tls_flush(conn, tc) < 0)
+			return -1;
+		res = tc->wpend;
+		tc->wpend = 0;
+		return res;
+	}
+	for (;;) {
+		ERR_clear_error();
+		if ((res = SSL_write(tc->ssl, buf, n)) > 0) {
+			*events = EPOLLOUT;
+			if (conet_tls_flush(conn, tc) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					tc->wpend = res;
+				return -1;
+			}
+			return res;
+		}
+		if ((res = conet_tls_want(conn, tc, SSL_get_error(tc->ssl, res),
+					  events)) <= 0) {
+			if (res == 0)
+				errno = EPIPE;
+			return -1;
+		}
+	}
+}
+
+static int conet_tls_handshake(struct sk_conn *conn, unsigned int *events) {
+	int res;
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	for (;;) {
+		ERR_clear_error();
+		if ((res = SSL_do_handshake(tc->ssl)) == 1) {
+			*events = EPOLLOUT;
+			return conet_tls_flush(conn, tc);
+		}
+		if ((res = conet_tls_want(conn, tc, SSL_get_error(tc->ssl, res),
+					  events)) <= 0) {
+			if (res == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+	}
+}
+
+static int conet_tls_pending(struct sk_conn *conn) {
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	return SSL_pending(tc->ssl) +
+		(tc->nbio != NULL ? (int) BIO_ctrl_pending(SSL_get_rbio(tc->ssl)): 0);
+}
+
+/*
+ * The close_notify alert is sent on a best effort basis, since we never
+ * wait for the socket here.
+ */
+static void conet_tls_close(struct sk_conn *conn) {
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	ERR_clear_error();
+	if (!tc->fatal && SSL_is_init_finished(tc->ssl) &&
+	    SSL_shutdown(tc->ssl) >= 0)
+		conet_tls_flush(conn, tc);
+	ERR_clear_error();
+	SSL_free(tc->ssl);
+	if (tc->nbio != NULL)
+		BIO_free(tc->nbio);
+	free(tc->peer);
+	free(tc);
+	conn->xpdata = NULL;
+}
+
+/*
+ * Creates a TLS endpoint configuration. Server ones (CONET_TLS_SERVER)
+ * need cert and key PEM files, while for clients they are optional. With
+ * CONET_TLS_VERIFY peers certificates are checked against cafile, or the
+ * system default store if cafile is NULL. CONET_TLS_KTLS asks OpenSSL to
+ * offload the record layer to the kernel after the handshake, when both
+ * the library and the kernel support it.
+ */
+struct conet_tls *conet_tls_create(unsigned int flags, char const *cert,
+				   char const *key, char const *cafile) {
+	struct conet_tls *tls;
+
+	if ((tls = (struct conet_tls *) calloc(1, sizeof(struct conet_tls))) == NULL)
+		return NULL;
+	tls->flags = flags;
+	if ((tls->sctx = SSL_CTX_new(flags & CONET_TLS_SERVER ?
+				     TLS_server_method():
+				     TLS_client_method())) == NULL)
+		goto erxit;
+	SSL_CTX_set_min_proto_version(tls->sctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(tls->sctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+			 SSL_MODE_RELEASE_BUFFERS);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(tls->sctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	if (flags & CONET_TLS_KTLS)
+		SSL_CTX_set_options(tls->sctx, SSL_OP_ENABLE_KTLS);
+#endif
+	if (cert != NULL &&
+	    SSL_CTX_use_certificate_chain_file(tls->sctx, cert) != 1)
+		goto erxit;
+	if (key != NULL &&
+	    (SSL_CTX_use_PrivateKey_file(tls->sctx, key, SSL_FILETYPE_PEM) != 1 ||
+	     SSL_CTX_check_private_key(tls->sctx) != 1))
+		goto erxit;
+	if (flags & CONET_TLS_VERIFY) {
+		if ((cafile != NULL ?
+		     SSL_CTX_load_verify_locations(tls->sctx, cafile, NULL):
+		     SSL_CTX_set_default_verify_paths(tls->sctx)) != 1)
+			goto erxit;
+		SSL_CTX_set_verify(tls->sctx, SSL_VERIFY_PEER |
+				   (flags & CONET_TLS_SERVER ?
+				    SSL_VERIFY_FAIL_IF_NO_PEER_CERT: 0), NULL);
+	}
+	if (flags & CONET_TLS_SERVER) {
+		SSL_CTX_set_session_cache_mode(tls->sctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_set_session_id_context(tls->sctx,
+					       (unsigned char const *) "coronet", 7);
+	} else {
+		SSL_CTX_set_session_cache_mode(tls->sctx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(tls->sctx, conet_tls_new_sess);
+	}
+
+	return tls;
+
+	erxit:
+	ERR_print_errors_fp(stderr);
+	conet_tls_free(tls);
+	errno = EINVAL;
+
+	return NULL;
+}
+
+void conet_tls_free(struct conet_tls *tls) {
+	int i;
+
+	for (i = 0; i < CONET_TLS_SCSIZE; i++) {
+		if (tls->scache[i].sess != NULL)
+			SSL_SESSION_free(tls->scache[i].sess);
+		free(tls->scache[i].peer);
+	}
+	if (tls->sctx != NULL)
+		SSL_CTX_free(tls->sctx);
+	free(tls);
+}
+
+struct ssl_ctx_st *conet_tls_sslctx(struct conet_tls *tls) {
+
+	return tls->sctx;
+}
+
+/*
+ * Switches conn over TLS. For clients, peer is the server name, used for
+ * SNI, certificate host checks and as session cache key. The handshake
+ * happens with the first I/O, or with an explicit conet_handshake().
+ */
+int conet_tls_attach(struct sk_conn *conn, struct conet_tls *tls,
+		     char const *peer) {
+	struct conet_tls_conn *tc;
+	struct conet_tls_sess *se;
+	BIO *ibio;
+	unsigned long hash;
+	unsigned char addr[sizeof(struct in6_addr)];
+
+	if ((tc = (struct conet_tls_conn *)
+	     calloc(1, sizeof(struct conet_tls_conn))) == NULL)
+		return -1;
+	tc->tls = tls;
+	if ((tc->ssl = SSL_new(tls->sctx)) == NULL)
+		goto erxit;
+	if (tls->flags & CONET_TLS_KTLS) {
+		if (SSL_set_fd(tc->ssl, conn->sfd) != 1)
+			goto erxit;
+	} else {
+		if (BIO_new_bio_pair(&ibio, 0, &tc->nbio, 0) != 1)
+			goto erxit;
+		SSL_set_bio(tc->ssl, ibio, ibio);
+	}
+	if (tls->flags & CONET_TLS_SERVER)
+		SSL_set_accept_state(tc->ssl);
+	else {
+		SSL_set_connect_state(tc->ssl);
+		if (peer != NULL) {
+			if ((tc->peer = strdup(peer)) == NULL)
+				goto erxit;
+			if (inet_pton(AF_INET, peer, addr) <= 0 &&
+			    inet_pton(AF_INET6, peer, addr) <= 0)
+				SSL_set_tlsext_host_name(tc->ssl, peer);
+			if (tls->flags & CONET_TLS_VERIFY)
+				SSL_set1_host(tc->ssl, peer);
+			hash = conet_tls_hash(peer);
+			se = &tls->scache[hash & CONET_TLS_SCMASK];
+			if (se->sess != NULL && se->hash == hash &&
+			    strcmp(se->peer, peer) == 0)
+				SSL_set_session(tc->ssl, se->sess);
+		}
+	}
+	SSL_set_app_data(tc->ssl, tc);
+
+	return conet_set_xprt(conn, &tls_xprt, tc);
+
+	erxit:
+	ERR_print_errors_fp(stderr);
+	if (tc->ssl != NULL)
+		SSL_free(tc->ssl);
+	if (tc->nbio != NULL)
+		BIO_free(tc->nbio);
+	free(tc->peer);
+	free(tc);
+	errno = ENOMEM;
+
+	return -1;
+}
+
+/*
+ * Returns 1 if the conn handshake resumed a cached session.
+ */
+int conet_tls_reused(struct sk_conn *conn) {
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	return conn->xp == &tls_xprt && SSL_session_reused(tc->ssl);
+}
+
+/*
+ * Returns the CONET_TLS_KTLS_* mask of the directions the kernel took
+ * over, once the handshake completed.
+ */
+int conet_tls_ktls(struct sk_conn *conn) {
+	int mask = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+	struct conet_tls_conn *tc = (struct conet_tls_conn *) conn->xpdata;
+
+	if (conn->xp != &tls_xprt || tc->nbio != NULL)
+		return 0;
+	if (BIO_get_ktls_send(SSL_get_wbio(tc->ssl)))
+		mask |= CONET_TLS_KTLS_TX;
+	if (BIO_get_ktls_recv(SSL_get_rbio(tc->ssl)))
+		mask |= CONET_TLS_KTLS_RX;
+#endif
+
+	return mask;
+}
+
+#else
+
+struct conet_tls *conet_tls_create(unsigned int flags, char const *cert,
+				   char const *key, char const *cafile) {
+
+	errno = ENOSYS;
+
+	return NULL;
+}
+
+void conet_tls_free(struct conet_tls *tls) {
+
+}
+
+struct ssl_ctx_st *conet_tls_sslctx(struct conet_tls *tls) {
+
+	return NULL;
+}
+
+int conet_tls_attach(struct sk_conn *conn, struct conet_tls *tls,
+		     char const *peer) {
+
+	errno = ENOSYS;
+
+	return -1;
+}
+
+int conet_tls_reused(struct sk_conn *conn) {
+
+	return 0;
+}
+
+int conet_tls_ktls(struct sk_conn *conn) {
+
+	return 0;
+}
+
+#endif
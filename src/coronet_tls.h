@@ -0,0 +1,48 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_CORONET_TLS_H)
+#define _CORONET_TLS_H
+
+
+#include "coronet.h"
+
+
+
+#define CONET_TLS_SERVER (1 << 0)
+#define CONET_TLS_VERIFY (1 << 1)
+#define CONET_TLS_KTLS (1 << 2)
+
+#define CONET_TLS_KTLS_TX (1 << 0)
+#define CONET_TLS_KTLS_RX (1 << 1)
+
+struct conet_tls;
+struct ssl_ctx_st;
+
+
+
+CNAPI struct conet_tls *conet_tls_create(unsigned int flags, char const *cert,
+					 char const *key, char const *cafile);
+CNAPI void conet_tls_free(struct conet_tls *tls);
+CNAPI struct ssl_ctx_st *conet_tls_sslctx(struct conet_tls *tls);
+CNAPI int conet_tls_attach(struct sk_conn *conn, struct conet_tls *tls,
+			   char const *peer);
+CNAPI int conet_tls_reused(struct sk_conn *conn);
+CNAPI int conet_tls_ktls(struct sk_conn *conn);
+
+
+#endif
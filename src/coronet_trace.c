@@ -0,0 +1,203 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "coronet.h"
+#include "coronet_trace.h"
+
+
+
+/*
+ * Per loop trace ring. Only the loop thread writes it, so recording an
+ * event needs no locking nor atomics, and the oldest events are simply
+ * overwritten once the ring wraps.
+ */
+struct conet_trace {
+	unsigned long mask;
+	unsigned long head;
+	struct conet_trace_event evs[1];
+};
+
+
+
+static char const *conet_trace_name(struct conet_trace_event const *ev);
+
+
+
+__thread struct conet_trace *conet_trace_ring;
+
+
+
+/*
+ * Starts tracing on the calling thread loop, with a ring of nevents
+ * records (rounded up to a power of two). Restarting drops the recorded
+ * events.
+ */
+int conet_trace_start(int nevents) {
+	unsigned long size;
+	struct conet_trace *tr;
+
+	if (nevents <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size = 1; size < (unsigned long) nevents; size <<= 1);
+	if ((tr = (struct conet_trace *)
+	     malloc(sizeof(struct conet_trace) +
+		    (size - 1) * sizeof(struct conet_trace_event))) == NULL)
+		return -1;
+	tr->mask = size - 1;
+	tr->head = 0;
+	conet_trace_stop();
+	conet_trace_ring = tr;
+
+	return 0;
+}
+
+void conet_trace_stop(void) {
+
+	free(conet_trace_ring);
+	conet_trace_ring = NULL;
+}
+
+void conet_trace_emit(unsigned int type, int fd, long long arg, void *co) {
+	struct conet_trace *tr = conet_trace_ring;
+	struct conet_trace_event *ev;
+	struct timespec ts;
+
+	if (tr == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev = &tr->evs[tr->head++ & tr->mask];
+	ev->ts = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->type = type;
+	ev->fd = fd;
+	ev->arg = arg;
+	ev->co = co;
+}
+
+/*
+ * Copies up to n of the recorded events into evs, oldest first, and
+ * returns how many have been copied.
+ */
+int conet_trace_read(struct conet_trace_event *evs, int n) {
+	unsigned long i, cnt;
+	struct conet_trace *tr = conet_trace_ring;
+
+	if (tr == NULL)
+		return 0;
+	cnt = tr->head > tr->mask ? tr->mask + 1: tr->head;
+	if (cnt > (unsigned long) n)
+		cnt = (unsigned long) n;
+	for (i = 0; i < cnt; i++)
+		evs[i] = tr->evs[(tr->head - cnt + i) & tr->mask];
+
+	return (int) cnt;
+}
+
+static char const *conet_trace_name(struct conet_trace_event const *ev) {
+
+	switch (ev->type) {
+	case CONET_TR_RUN:
+	case CONET_TR_STOP:
+		return "run";
+	case CONET_TR_YIELD:
+		return ev->arg & EPOLLIN ? "yield-in":
+			(ev->arg & EPOLLOUT ? "yield-out": "yield-wait");
+	case CONET_TR_POLL:
+	case CONET_TR_POLLED:
+		return "epoll_wait";
+	case CONET_TR_DISPATCH:
+	case CONET_TR_DISPATCHED:
+		return "dispatch";
+	case CONET_TR_TIMER:
+		return "timer";
+	case CONET_TR_READ:
+		return "read";
+	case CONET_TR_WRITE:
+		return "write";
+	}
+
+	return "user";
+}
+
+/*
+ * Writes the recorded events to path, in the Chrome trace event JSON
+ * format understood by chrome://tracing and Perfetto. Coroutine runs,
+ * epoll waits and dispatch rounds become duration events, and all the
+ * others instant ones.
+ */
+int conet_trace_dump(char const *path) {
+	unsigned long i, cnt;
+	char const *ph;
+	struct conet_trace *tr = conet_trace_ring;
+	struct conet_trace_event *ev;
+	FILE *file;
+	pid_t pid, tid;
+
+	if (tr == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((file = fopen(path, "w")) == NULL)
+		return -1;
+	pid = getpid();
+	tid = (pid_t) syscall(SYS_gettid);
+	cnt = tr->head > tr->mask ? tr->mask + 1: tr->head;
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < cnt; i++) {
+		ev = &tr->evs[(tr->head - cnt + i) & tr->mask];
+		switch (ev->type) {
+		case CONET_TR_RUN:
+		case CONET_TR_POLL:
+		case CONET_TR_DISPATCH:
+			ph = "B";
+			break;
+		case CONET_TR_STOP:
+		case CONET_TR_POLLED:
+		case CONET_TR_DISPATCHED:
+			ph = "E";
+			break;
+		default:
+			ph = "i";
+		}
+		fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu.%03llu,"
+			"\"pid\":%d,\"tid\":%d,%s\"args\":{\"type\":%u,\"fd\":%d,"
+			"\"arg\":%lld,\"co\":\"%p\"}}", i ? ",\n": "",
+			conet_trace_name(ev), ph, ev->ts / 1000, ev->ts % 1000,
+			(int) pid, (int) tid, *ph == 'i' ? "\"s\":\"t\",": "",
+			ev->type, ev->fd, ev->arg, ev->co);
+	}
+	fprintf(file, "\n]}\n");
+	if (fclose(file) != 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#if !defined(_CORONET_TRACE_H)
+#define _CORONET_TRACE_H
+
+
+#include "coronet.h"
+
+
+
+#define CONET_TR_RUN 1
+#define CONET_TR_STOP 2
+#define CONET_TR_YIELD 3
+#define CONET_TR_POLL 4
+#define CONET_TR_POLLED 5
+#define CONET_TR_DISPATCH 6
+#define CONET_TR_DISPATCHED 7
+#define CONET_TR_TIMER 8
+#define CONET_TR_READ 9
+#define CONET_TR_WRITE 10
+#define CONET_TR_USER 64
+
+/*
+ * Trace record. The ts is in nanoseconds of CLOCK_MONOTONIC, and the
+ * meaning of fd and arg depends on the type.
+ */
+struct conet_trace_event {
+	unsigned long long ts;
+	unsigned int type;
+	int fd;
+	long long arg;
+	void *co;
+};
+
+struct conet_trace;
+
+/*
+ * The trace ring of the calling thread loop, NULL if tracing is off. It is
+ * only exposed to let trace points test it without a call.
+ */
+extern __thread struct conet_trace *conet_trace_ring;
+
+
+
+CNAPI int conet_trace_start(int nevents);
+CNAPI void conet_trace_stop(void);
+CNAPI void conet_trace_emit(unsigned int type, int fd, long long arg, void *co);
+CNAPI int conet_trace_read(struct conet_trace_event *evs, int n);
+CNAPI int conet_trace_dump(char const *path);
+
+
+#endif
@@ -0,0 +1,272 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include "coronet.h"
+
+
+
+#define CNDB_CONNS 10000
+#define CNDB_ROUNDS 2000
+#define CNDB_BATCH 128
+
+#define CNDB_CNT_CYCLES 0
+#define CNDB_CNT_INSNS 1
+#define CNDB_CNT_LLCMISS 2
+#define CNDB_CNT_L1DMISS 3
+#define CNDB_NCNT 4
+
+
+
+struct cndb_conn {
+	int pfd;
+	struct sk_conn *conn;
+};
+
+
+
+
+static unsigned long long cndb_nstime(void);
+static void cndb_usage(char const *prg);
+static int cndb_perf_open(unsigned int type, unsigned long long config,
+			  int kern);
+static void cndb_perf_read(long long *vals);
+static unsigned int cndb_rand(void);
+static void cndb_reader(void *data);
+
+
+
+
+static int num_conns = CNDB_CONNS;
+static long num_rounds = CNDB_ROUNDS;
+static int batch = CNDB_BATCH;
+static int pfdist = -1;
+static int pfds[CNDB_NCNT] = { -1, -1, -1, -1 };
+static unsigned int rndst = 0x9e3779b9;
+static long nreads;
+
+
+
+
+static unsigned long long cndb_nstime(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+static void cndb_usage(char const *prg) {
+
+	fprintf(stderr, "Use: %s [-n NCONNS (%d)] [-r NROUNDS (%ld)] [-b BATCH (%d)]\n"
+		"\t[-P PFDIST] [-k] [-h]\n", prg, num_conns, num_rounds, batch);
+}
+
+static int cndb_perf_open(unsigned int type, unsigned long long config,
+			  int kern) {
+	struct perf_event_attr pea;
+
+	memset(&pea, 0, sizeof(pea));
+	pea.size = sizeof(pea);
+	pea.type = type;
+	pea.config = config;
+	pea.exclude_kernel = !kern;
+	pea.exclude_hv = 1;
+
+	return (int) syscall(SYS_perf_event_open, &pea, 0, -1, -1, 0);
+}
+
+static void cndb_perf_read(long long *vals) {
+	int i;
+
+	for (i = 0; i < CNDB_NCNT; i++)
+		if (pfds[i] == -1 ||
+		    read(pfds[i], &vals[i], sizeof(vals[i])) != sizeof(vals[i]))
+			vals[i] = 0;
+}
+
+static unsigned int cndb_rand(void) {
+
+	rndst ^= rndst << 13;
+	rndst ^= rndst >> 17;
+	rndst ^= rndst << 5;
+
+	return rndst;
+}
+
+static void cndb_reader(void *data) {
+	struct cndb_conn *cc = (struct cndb_conn *) data;
+	char c;
+
+	while (conet_read(cc->conn, &c, 1) == 1)
+		nreads++;
+}
+
+/*
+ * Measures the event dispatcher with many connections, of which a random
+ * batch becomes readable every round, so that the connections touched by
+ * a dispatch are scattered like on a busy server. Only the dispatch is
+ * measured, and the hardware counters (when the kernel allows them) give
+ * the cache misses per event. Run it with -P 0 to compare against the
+ * dispatcher without prefetching.
+ */
+int main(int ac, char **av) {
+	int i, j, n, kern = 0, sv[2];
+	long r, nevents = 0;
+	unsigned long long ts, tdisp = 0;
+	long long cbase[CNDB_NCNT], cend[CNDB_NCNT], ctot[CNDB_NCNT];
+	struct cndb_conn *ccs;
+	struct rlimit rlim;
+	rlim_t nfds;
+	coroutine_t co;
+	static char const * const cnames[CNDB_NCNT] = {
+		"Cycles ..............", "Instructions ........",
+		"LLC Misses ..........", "L1D Misses .........."
+	};
+
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "-n") == 0) {
+			if (++i < ac)
+				num_conns = atoi(av[i]);
+		} else if (strcmp(av[i], "-r") == 0) {
+			if (++i < ac)
+				num_rounds = atol(av[i]);
+		} else if (strcmp(av[i], "-b") == 0) {
+			if (++i < ac)
+				batch = atoi(av[i]);
+		} else if (strcmp(av[i], "-P") == 0) {
+			if (++i < ac)
+				pfdist = atoi(av[i]);
+		} else if (strcmp(av[i], "-k") == 0) {
+			kern = 1;
+		} else {
+			cndb_usage(av[0]);
+			return 1;
+		}
+	}
+	if (num_conns <= 0 || num_rounds <= 0 || batch <= 0 ||
+	    batch > num_conns) {
+		cndb_usage(av[0]);
+		return 1;
+	}
+	nfds = 2 * (rlim_t) num_conns + 64;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < nfds) {
+		rlim.rlim_cur = nfds;
+		if (rlim.rlim_max < nfds)
+			rlim.rlim_max = nfds;
+		if (setrlimit(RLIMIT_NOFILE, &rlim) != 0) {
+			fprintf(stderr, "Unable to raise the file limit for %d connections\n",
+				num_conns);
+			return 2;
+		}
+	}
+	if (conet_init() < 0)
+		return 2;
+	if (pfdist >= 0)
+		conet_set_prefetch(pfdist);
+
+	if ((ccs = (struct cndb_conn *)
+	     malloc(num_conns * sizeof(struct cndb_conn))) == NULL) {
+		perror("malloc");
+		return 2;
+	}
+	for (i = 0; i < num_conns; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 ||
+		    fcntl(sv[0], F_SETFL, O_NONBLOCK) != 0) {
+			perror("socketpair");
+			return 2;
+		}
+		ccs[i].pfd = sv[1];
+		if ((co = conet_co_create(cndb_reader, &ccs[i])) == NULL ||
+		    (ccs[i].conn = conet_new_conn(sv[0], co)) == NULL) {
+			fprintf(stderr, "Unable to create connection %d\n", i);
+			return 2;
+		}
+		co_call(co);
+	}
+
+	pfds[CNDB_CNT_CYCLES] = cndb_perf_open(PERF_TYPE_HARDWARE,
+					       PERF_COUNT_HW_CPU_CYCLES, kern);
+	pfds[CNDB_CNT_INSNS] = cndb_perf_open(PERF_TYPE_HARDWARE,
+					      PERF_COUNT_HW_INSTRUCTIONS, kern);
+	pfds[CNDB_CNT_LLCMISS] = cndb_perf_open(PERF_TYPE_HARDWARE,
+						PERF_COUNT_HW_CACHE_MISSES, kern);
+	pfds[CNDB_CNT_L1DMISS] =
+		cndb_perf_open(PERF_TYPE_HW_CACHE,
+			       PERF_COUNT_HW_CACHE_L1D |
+			       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), kern);
+	memset(ctot, 0, sizeof(ctot));
+
+	for (r = 0; r < num_rounds; r++) {
+		for (i = 0; i < batch; i++)
+			if (write(ccs[cndb_rand() % num_conns].pfd, "x", 1) != 1) {
+				perror("write");
+				return 2;
+			}
+		if ((n = conet_events_wait(0)) < 0)
+			break;
+		cndb_perf_read(cbase);
+		ts = cndb_nstime();
+		n = conet_events_dispatch(-1);
+		tdisp += cndb_nstime() - ts;
+		cndb_perf_read(cend);
+		for (j = 0; j < CNDB_NCNT; j++)
+			ctot[j] += cend[j] - cbase[j];
+		nevents += n;
+	}
+	if (nevents == 0) {
+		fprintf(stderr, "No events dispatched\n");
+		return 2;
+	}
+
+	fprintf(stdout,
+		"Connections .........: %9d\n"
+		"Events ..............: %9ld\n"
+		"Reads ...............: %9ld\n"
+		"Dispatch ............: %9.1f ns/event\n",
+		num_conns, nevents, nreads, (double) tdisp / nevents);
+	for (j = 0; j < CNDB_NCNT; j++) {
+		if (pfds[j] == -1)
+			fprintf(stdout, "%s: %9s\n", cnames[j], "n/a");
+		else
+			fprintf(stdout, "%s: %9.2f /event\n", cnames[j],
+				(double) ctot[j] / nevents);
+	}
+
+	for (j = 0; j < CNDB_NCNT; j++)
+		if (pfds[j] != -1)
+			close(pfds[j]);
+	for (i = 0; i < num_conns; i++)
+		close(ccs[i].pfd);
+	free(ccs);
+	conet_cleanup();
+
+	return 0;
+}
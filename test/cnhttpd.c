@@ -30,43 +30,122 @@
 #include <limits.h>
 #include <signal.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
 #include <netdb.h>
 #include "coronet.h"
+#include "coronet_tls.h"
+#include "coronet_http.h"
+#include "coronet_trace.h"
 
 
 
 
 #define CNHD_EVWAIT_TIMEO 1000
 #define CNHD_STKSIZE (1024 * 8)
+#define CNHD_DRAIN_TIMEO 30000
+#define CNHD_SHUTDOWN_TIMEO 10000
+#define CNHD_HOCHAN_SIZE 256
+#define CNHD_MAXLOOPS 256
+#define CNHD_TRACE_EVENTS (1 << 16)
+
+
+
+/*
+ * With more than one loop, every loop runs on its own thread (the first
+ * one on the main thread), serving its own SO_REUSEPORT listener.
+ */
+struct cnhd_loop {
+	pthread_t thr;
+	int id, cpu;
+	int sfd, ufd;
+	int status, started;
+	unsigned long long conns, reqs, tbytes, misses;
+	struct conet_memstats memst;
+	struct conet_drainstats drst;
+	struct conet_stackstats stkst;
+	struct conet_zcstats zcst;
+	struct conet_iostats iost;
+};
 
 
 
 static int cnhd_set_cork(int fd, int v);
-static int cnhd_send_mem(struct sk_conn *conn, long size, char const *ver,
-			 char const *cclose);
-static int cnhd_send_doc(struct sk_conn *conn, char const *doc, char const *ver,
-			 char const *cclose);
-static int cnhd_send_url(struct sk_conn *conn, char const *doc, char const *ver,
-			 char const *cclose);
+static int cnhd_send_mem(struct sk_conn *conn, struct conet_http_req *req,
+			 void *data);
+static int cnhd_send_chunks(struct sk_conn *conn, struct conet_http_req *req,
+			    void *data);
+static int cnhd_send_echo(struct sk_conn *conn, struct conet_http_req *req,
+			  void *data);
+static int cnhd_send_doc(struct sk_conn *conn, struct conet_http_req *req,
+			 void *data);
+static void cnhd_handle(struct sk_conn *conn, void *data);
 static void *cnhd_service(void *data);
 static void *cnhd_acceptor(void *data);
-static void cnhd_sigint(int sig);
+static int cnhd_pass_conn(struct sk_conn *conn);
+static int cnhd_rst_listen(void);
+static int cnhd_rst_connect(void);
+static void *cnhd_handoff(void *data);
+static void *cnhd_takeover(void *data);
+static int cnhd_start(int sfd);
+static unsigned long long cnhd_mstime(void);
+static void *cnhd_sigwaiter(void *data);
+static unsigned int cnhd_parse_policy(char const *str);
+static int cnhd_parse_sockopts(char *str, struct conet_sockopts *so);
+static void cnhd_print_sockopts(FILE *file, struct conet_sockopts const *so);
 static void cnhd_usage(char const *prg);
+static coroutine_t cnhd_service_co(int fd);
+static int cnhd_parse_cpus(char *str);
+static void cnhd_trace_dump(void);
+static void *cnhd_run(void *data);
 
 
 
 
-static int stopsvr;
+static volatile int stopsvr;
 static char const *rootfs = ".";
 static int svr_port = 80;
 static int lsnbklog = 1024;
 static int stksize = CNHD_STKSIZE;
-static unsigned long long conns, reqs, tbytes;
+static long stkvsize;
+static unsigned long conn_bps, glob_bps;
+static struct conet_memcfg memcfg;
+static struct conet_sockopts sockopts;
+static int hibernate;
+static char const *tls_cert, *tls_key;
+static unsigned int tls_flags = CONET_TLS_SERVER;
+static __thread struct conet_tls *tls;
+static char const *rst_path;
+static char const *trace_path;
+static __thread int svr_sfd = -1;
+static __thread int draining;
+static __thread long live_conns;
+static __thread struct conet_ctx accctx;
+static __thread struct conet_chan hochan;
+static __thread struct conet_ctx auxctx;
+static int shut_tmo = CNHD_SHUTDOWN_TIMEO;
+static __thread unsigned long long conns, reqs, tbytes, misses;
+static int num_loops = 1;
+static int loop_cpus[CNHD_MAXLOOPS];
+static int num_cpus;
+static int numa_local;
+static int sig_fd = -1;
+static __thread struct cnhd_loop *cloop;
+static char mbuf[1024 * 8];
+static char *zbuf;
+static int zcsize;
+static struct conet_http_route const cnhd_routes[] = {
+	{ "GET", "/mem-*", cnhd_send_mem, NULL },
+	{ "GET", "/chunk-*", cnhd_send_chunks, NULL },
+	{ "POST", "/echo", cnhd_send_echo, NULL },
+	{ "GET", "*", cnhd_send_doc, NULL },
+	{ NULL, NULL, NULL, NULL }
+};
 
 
 
@@ -76,112 +155,136 @@ static int cnhd_set_cork(int fd, int v) {
 	return setsockopt(fd, SOL_TCP, TCP_CORK, &v, sizeof(v));
 }
 
-static int cnhd_send_mem(struct sk_conn *conn, long size, char const *ver,
-			 char const *cclose) {
-	size_t csize, n;
-	long msent;
-	static char mbuf[1024 * 8];
+static int cnhd_send_mem(struct sk_conn *conn, struct conet_http_req *req,
+			 void *data) {
+	int n, csize, bsize = zbuf != NULL ? zcsize: (int) sizeof(mbuf);
+	long size, msent;
 
+	reqs++;
+	size = atol(req->path + 5);
 	cnhd_set_cork(conn->sfd, 1);
-	conet_printf(conn,
-		     "%s 200 OK\r\n"
-		     "Connection: %s\r\n"
-		     "Content-Length: %ld\r\n"
-		     "\r\n", ver, cclose, size);
+	if (conet_http_send_head(conn, req, 200, NULL, size) < 0)
+		return -1;
+	if (req->flags & CONET_HTTP_HEAD)
+		size = 0;
 	for (msent = 0; msent < size;) {
-		csize = (size - msent) > sizeof(mbuf) ?
-			sizeof(mbuf): (size_t) (size - msent);
-		if ((n = conet_write(conn, mbuf, csize)) > 0)
+		csize = (size - msent) > (long) bsize ? bsize: (int) (size - msent);
+		if ((n = zbuf != NULL ? conet_write_zc(conn, zbuf, csize):
+		     conet_write(conn, mbuf, csize)) > 0)
 			msent += n;
 		if (n != csize)
 			break;
 	}
 	cnhd_set_cork(conn->sfd, 0);
+	if (zbuf != NULL && conet_zc_flush(conn) < 0)
+		return -1;
 
 	tbytes += msent;
 
 	return msent == size ? 0: -1;
 }
 
-static int cnhd_send_doc(struct sk_conn *conn, char const *doc, char const *ver,
-			 char const *cclose) {
+/*
+ * Same as cnhd_send_mem(), but with a chunked response.
+ */
+static int cnhd_send_chunks(struct sk_conn *conn, struct conet_http_req *req,
+			    void *data) {
+	int csize, error;
+	long size, msent;
+
+	reqs++;
+	size = atol(req->path + 7);
+	cnhd_set_cork(conn->sfd, 1);
+	if (conet_http_send_head(conn, req, 200, NULL, -1) < 0)
+		return -1;
+	for (msent = 0; msent < size; msent += csize) {
+		csize = (size - msent) > (long) sizeof(mbuf) ?
+			(int) sizeof(mbuf): (int) (size - msent);
+		if (conet_http_send_body(conn, req, mbuf, csize) < 0)
+			break;
+	}
+	error = msent == size ? conet_http_send_end(conn, req): -1;
+	cnhd_set_cork(conn->sfd, 0);
 
-	conet_printf(conn,
-		     "%s 404 OK\r\n"
-		     "Connection: %s\r\n"
-		     "Content-Length: 0\r\n"
-		     "\r\n", ver, cclose);
+	tbytes += msent;
 
-	return 0;
+	return error;
+}
+
+/*
+ * Streams the request body back as a chunked response, writing it out
+ * straight from the connection buffer.
+ */
+static int cnhd_send_echo(struct sk_conn *conn, struct conet_http_req *req,
+			  void *data) {
+	int n;
+	char *ptr;
+
+	reqs++;
+	if (conet_http_send_head(conn, req, 200, NULL, -1) < 0)
+		return -1;
+	while ((n = conet_http_read_zc(req, &ptr, CONET_BUFSIZE)) > 0) {
+		if (conet_http_send_body(conn, req, ptr, n) < 0)
+			return -1;
+		tbytes += n;
+	}
+	if (n < 0)
+		return -1;
+
+	return conet_http_send_end(conn, req);
 }
 
-static int cnhd_send_url(struct sk_conn *conn, char const *doc, char const *ver,
-			 char const *cclose) {
-	int error;
+static int cnhd_send_doc(struct sk_conn *conn, struct conet_http_req *req,
+			 void *data) {
 
-	if (strncmp(doc, "/mem-", 5) == 0)
-		error = cnhd_send_mem(conn, atol(doc + 5), ver, cclose);
-	else
-		error = cnhd_send_doc(conn, doc, ver, cclose);
+	reqs++;
 
-	return error;
+	return conet_http_respond(conn, req, 404, NULL, NULL, 0);
+}
+
+/*
+ * Serves requests over conn. With hibernation enabled, the connection is
+ * parked between requests, and this gets called again on a pooled coroutine
+ * once the next request arrives.
+ */
+static void cnhd_handle(struct sk_conn *conn, void *data) {
+
+	if (conn->error < 0) {
+		live_conns--;
+		conet_close_conn(conn);
+		return;
+	}
+	while (!stopsvr) {
+		if (draining && cnhd_pass_conn(conn) == 0)
+			break;
+		if (conet_http_serve(conn, cnhd_routes,
+				     stopsvr ? CONET_HTTP_CLOSE: 0) <= 0)
+			break;
+		if (hibernate && !draining &&
+		    conet_hibernate(conn, cnhd_handle, data) > 0)
+			return;
+	}
+	live_conns--;
+	conet_close_conn(conn);
 }
 
 static void *cnhd_service(void *data) {
 	int cfd = (int) (long) data;
-	int cclose = 0, chunked, lsize, clen;
-	char *req, *meth, *doc, *ver, *ln, *auxptr;
 	struct sk_conn *conn;
 
 	if ((conn = conet_new_conn(cfd, co_current())) == NULL)
 		return NULL;
-	while (!stopsvr && !cclose) {
-		if ((req = conet_readln(conn, &lsize)) == NULL)
-			break;
-		if ((meth = strtok_r(req, " ", &auxptr)) == NULL ||
-		    (doc = strtok_r(NULL, " ", &auxptr)) == NULL ||
-		    (ver = strtok_r(NULL, " \r\n", &auxptr)) == NULL ||
-		    strcasecmp(meth, "GET") != 0) {
-			bad_request:
-			free(req);
-			conet_printf(conn,
-				     "HTTP/1.1 400 Bad request\r\n"
-				     "Connection: close\r\n"
-				     "Content-Length: 0\r\n"
-				     "\r\n");
-			break;
-		}
-		reqs++;
-		cclose = strcasecmp(ver, "HTTP/1.1") != 0;
-		for (clen = 0, chunked = 0;;) {
-			if ((ln = conet_readln(conn, &lsize)) == NULL)
-				break;
-			if (strcmp(ln, "\r\n") == 0) {
-				free(ln);
-				break;
-			}
-			if (strncasecmp(ln, "Content-Length:", 15) == 0) {
-				for (auxptr = ln + 15; *auxptr == ' '; auxptr++);
-				clen = atoi(auxptr);
-			} else if (strncasecmp(ln, "Connection:", 11) == 0) {
-				for (auxptr = ln + 11; *auxptr == ' '; auxptr++);
-				cclose = strncasecmp(auxptr, "close", 5) == 0;
-			} else if (strncasecmp(ln, "Transfer-Encoding:", 18) == 0) {
-				for (auxptr = ln + 18; *auxptr == ' '; auxptr++);
-				chunked = strncasecmp(auxptr, "chunked", 7) == 0;
-			}
-			free(ln);
-		}
-		/*
-		 * Sorry, really stupid HTTP server here. Neither GET payload nor
-		 * chunked encoding allowed.
-		 */
-		if (clen || chunked)
-			goto bad_request;
-		cnhd_send_url(conn, doc, ver, cclose ? "close": "keep-alive");
-		free(req);
+	live_conns++;
+	if (num_loops > 1 && num_cpus > 0 && conet_conn_cpu(conn) != cloop->cpu)
+		misses++;
+	if (conn_bps)
+		conet_set_rate(conn, CONET_RATE_TX, conn_bps, 0);
+	if (tls != NULL && conet_tls_attach(conn, tls, NULL) < 0) {
+		live_conns--;
+		conet_close_conn(conn);
+		return NULL;
 	}
-	conet_close_conn(conn);
+	cnhd_handle(conn, NULL);
 
 	return data;
 }
@@ -192,41 +295,509 @@ static void *cnhd_acceptor(void *data) {
 	coroutine_t co;
 	struct sk_conn *conn;
 	struct sockaddr_in addr;
+	struct conet_sockopts eopts;
 
 	if ((conn = conet_new_conn(sfd, co_current())) == NULL)
 		return NULL;
+	if (sockopts.mask) {
+		if (conet_set_sockopts(conn, &sockopts) < 0)
+			perror("socket options");
+		if (cloop->id == 0) {
+			eopts.mask = sockopts.mask;
+			conet_get_sockopts(sfd, &eopts);
+			cnhd_print_sockopts(stderr, &eopts);
+		}
+	}
+	conet_ctx_init(&accctx, NULL, -1);
+	conet_ctx_attach(&accctx, co_current());
 	while (!stopsvr &&
 	       (cfd = conet_accept(conn, (struct sockaddr *) &addr,
 				   &addrlen)) != -1) {
 		conns++;
-		if ((co = co_create((void *) cnhd_service, (void *) (long) cfd, NULL,
-				    stksize)) == NULL) {
+		if ((co = cnhd_service_co(cfd)) == NULL) {
 			fprintf(stderr, "Unable to create coroutine\n");
 			close(cfd);
 		} else
 			co_call(co);
 	}
+	conet_ctx_detach(&accctx);
+	/*
+	 * A listener handed off is still open in the new instance.
+	 */
+	if (draining)
+		conet_detach_conn(conn);
 	conet_close_conn(conn);
 
 	return data;
 }
 
-static void cnhd_sigint(int sig) {
+/*
+ * Hands an idle keep-alive connection over to the process which took our
+ * listener. Connections with buffered input, or with TLS state, cannot be
+ * moved and are served until they close. Returns 0 if conn has been queued
+ * for the handoff, in which case the caller must close it.
+ */
+static int cnhd_pass_conn(struct sk_conn *conn) {
+	int fd;
 
-	stopsvr++;
+	if (hochan.items == NULL || hochan.closed ||
+	    conn->ridx < conn->bcnt || conn->xp != NULL)
+		return -1;
+	if ((fd = dup(conn->sfd)) == -1)
+		return -1;
+	if (conet_chan_send(&hochan, (void *) (long) fd, -1) < 0) {
+		close(fd);
+		return -1;
+	}
+	conet_detach_conn(conn);
+
+	return 0;
+}
+
+static int cnhd_rst_listen(void) {
+	int ufd;
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, rst_path, sizeof(addr.sun_path) - 1);
+	unlink(rst_path);
+	if ((ufd = conet_socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (bind(ufd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(ufd, 1) == -1) {
+		perror(rst_path);
+		close(ufd);
+		return -1;
+	}
+
+	return ufd;
+}
+
+static int cnhd_rst_connect(void) {
+	int ufd;
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, rst_path, sizeof(addr.sun_path) - 1);
+	if ((ufd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (connect(ufd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(ufd);
+		return -1;
+	}
+	fcntl(ufd, F_SETFL, fcntl(ufd, F_GETFL, 0) | O_NONBLOCK);
+
+	return ufd;
+}
+
+/*
+ * Waits for a new server instance to connect over the restart socket, and
+ * hands it our listener. From then on we stop accepting, and drain, passing
+ * over idle keep-alive connections as they show up in hochan.
+ */
+static void *cnhd_handoff(void *data) {
+	int lfd = (int) (long) data, ufd, fd, addrlen;
+	struct sockaddr_un addr;
+	struct sk_conn *uconn, *hoconn;
+	struct conet_ctx ctx;
+	void *item;
+
+	if ((uconn = conet_new_conn(lfd, co_current())) == NULL) {
+		close(lfd);
+		return NULL;
+	}
+	conet_ctx_init(&ctx, &auxctx, -1);
+	conet_ctx_attach(&ctx, co_current());
+	addrlen = sizeof(addr);
+	ufd = conet_accept(uconn, (struct sockaddr *) &addr, &addrlen);
+	conet_close_conn(uconn);
+	if (ufd == -1)
+		goto dexit;
+	if ((hoconn = conet_new_conn(ufd, co_current())) == NULL) {
+		close(ufd);
+		goto dexit;
+	}
+	if (conet_sendfd(hoconn, svr_sfd, "L", 1) != 1) {
+		perror("listener handoff");
+		conet_close_conn(hoconn);
+		goto dexit;
+	}
+	fprintf(stderr, "Listener handed off, draining\n");
+	draining = 1;
+	conet_cancel(&accctx);
+	if (conet_chan_init(&hochan, CNHD_HOCHAN_SIZE) < 0) {
+		conet_close_conn(hoconn);
+		goto dexit;
+	}
+	while (conet_chan_recv(&hochan, &item, -1) == 0) {
+		fd = (int) (long) item;
+		if (conet_sendfd(hoconn, fd, "C", 1) != 1)
+			conet_chan_close(&hochan);
+		close(fd);
+	}
+	conet_close_conn(hoconn);
+	dexit:
+	conet_ctx_detach(&ctx);
+
+	return data;
+}
+
+/*
+ * Runs in a new server instance, receiving the listener of the old one,
+ * followed by its idle connections.
+ */
+static void *cnhd_takeover(void *data) {
+	int ufd = (int) (long) data, fd, lfd;
+	char msg;
+	coroutine_t co;
+	struct sk_conn *uconn;
+	struct conet_ctx ctx;
+
+	if ((uconn = conet_new_conn(ufd, co_current())) == NULL) {
+		close(ufd);
+		stopsvr++;
+		return NULL;
+	}
+	conet_ctx_init(&ctx, &auxctx, -1);
+	conet_ctx_attach(&ctx, co_current());
+	while (conet_recvfd(uconn, &fd, &msg, 1) == 1) {
+		if (fd == -1)
+			continue;
+		if (msg == 'L') {
+			if (cnhd_start(fd) < 0) {
+				close(fd);
+				stopsvr++;
+				break;
+			}
+			if ((lfd = cnhd_rst_listen()) != -1 &&
+			    (co = co_create((void *) cnhd_handoff, (void *) (long) lfd, NULL,
+					    stksize)) != NULL)
+				co_call(co);
+		} else if (msg == 'C') {
+			conns++;
+			if ((co = cnhd_service_co(fd)) == NULL)
+				close(fd);
+			else
+				co_call(co);
+		} else
+			close(fd);
+	}
+	conet_ctx_detach(&ctx);
+	conet_close_conn(uconn);
+	if (svr_sfd == -1) {
+		fprintf(stderr, "Listener takeover failed\n");
+		stopsvr++;
+	}
+
+	return data;
+}
+
+static int cnhd_start(int sfd) {
+	coroutine_t co;
+
+	if ((co = co_create((void *) cnhd_acceptor, (void *) (long) sfd, NULL,
+			    stksize)) == NULL) {
+		fprintf(stderr, "Unable to create coroutine\n");
+		return -1;
+	}
+	svr_sfd = sfd;
+	co_call(co);
+
+	return 0;
+}
+
+static unsigned long long cnhd_mstime(void) {
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) != 0)
+		return 0;
+
+	return 1000ULL * tv.tv_sec + tv.tv_usec / 1000;
+}
+
+/*
+ * Waits for SIGINT/SIGTERM over a signalfd, and stops the server. The
+ * signals are unblocked afterwards, so that a second one kills us even
+ * if the drain gets stuck.
+ */
+static void *cnhd_sigwaiter(void *data) {
+	int sfd = (int) (long) data;
+	struct sk_conn *conn;
+	sigset_t mask;
+
+	if ((conn = conet_new_conn(sfd, co_current())) == NULL) {
+		close(sfd);
+		return NULL;
+	}
+	if (conet_sigwait(conn) > 0) {
+		stopsvr++;
+		conet_cancel(&auxctx);
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	conet_close_conn(conn);
+
+	return data;
+}
+
+static unsigned int cnhd_parse_policy(char const *str) {
+	unsigned int policy = 0;
+
+	if (strstr(str, "reject") != NULL)
+		policy |= CONET_SHED_REJECT;
+	if (strstr(str, "idle") != NULL)
+		policy |= CONET_SHED_IDLE;
+	if (strstr(str, "shrink") != NULL)
+		policy |= CONET_SHED_SHRINK;
+
+	return policy;
+}
+
+/*
+ * Parses a comma separated list of NAME=VALUE socket options, where the
+ * keepalive value is IDLE[:INTVL[:CNT]].
+ */
+static int cnhd_parse_sockopts(char *str, struct conet_sockopts *so) {
+	char *opt, *val, *aux;
+
+	for (opt = strtok_r(str, ",", &aux); opt != NULL;
+	     opt = strtok_r(NULL, ",", &aux)) {
+		if ((val = strchr(opt, '=')) == NULL)
+			return -1;
+		*val++ = '\0';
+		if (strcmp(opt, "nodelay") == 0) {
+			so->mask |= CONET_SO_NODELAY;
+			so->nodelay = atoi(val);
+		} else if (strcmp(opt, "sndbuf") == 0) {
+			so->mask |= CONET_SO_SNDBUF;
+			so->sndbuf = atoi(val);
+		} else if (strcmp(opt, "rcvbuf") == 0) {
+			so->mask |= CONET_SO_RCVBUF;
+			so->rcvbuf = atoi(val);
+		} else if (strcmp(opt, "lowat") == 0) {
+			so->mask |= CONET_SO_NOTSENT_LOWAT;
+			so->notsent_lowat = atoi(val);
+		} else if (strcmp(opt, "quickack") == 0) {
+			so->mask |= CONET_SO_QUICKACK;
+			so->quickack = atoi(val);
+		} else if (strcmp(opt, "busypoll") == 0) {
+			so->mask |= CONET_SO_BUSY_POLL;
+			so->busy_poll = atoi(val);
+		} else if (strcmp(opt, "keepalive") == 0) {
+			so->mask |= CONET_SO_KEEPALIVE;
+			so->keepalive = 1;
+			sscanf(val, "%d:%d:%d", &so->kaidle, &so->kaintvl, &so->kacnt);
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
+static void cnhd_print_sockopts(FILE *file, struct conet_sockopts const *so) {
+
+	fprintf(file, "Socket options:");
+	if (so->mask & CONET_SO_NODELAY)
+		fprintf(file, " nodelay=%d", so->nodelay);
+	if (so->mask & CONET_SO_SNDBUF)
+		fprintf(file, " sndbuf=%d", so->sndbuf);
+	if (so->mask & CONET_SO_RCVBUF)
+		fprintf(file, " rcvbuf=%d", so->rcvbuf);
+	if (so->mask & CONET_SO_NOTSENT_LOWAT)
+		fprintf(file, " lowat=%d", so->notsent_lowat);
+	if (so->mask & CONET_SO_QUICKACK)
+		fprintf(file, " quickack=%d", so->quickack);
+	if (so->mask & CONET_SO_BUSY_POLL)
+		fprintf(file, " busypoll=%d", so->busy_poll);
+	if (so->mask & CONET_SO_KEEPALIVE)
+		fprintf(file, " keepalive=%d:%d:%d", so->kaidle, so->kaintvl,
+			so->kacnt);
+	fprintf(file, "\n");
+}
+
+/*
+ * Connection coroutines run on growable stacks when a maximum stack size
+ * is given with -g, and on fixed STKSIZE ones otherwise.
+ */
+static coroutine_t cnhd_service_co(int fd) {
+
+	if (stkvsize > 0)
+		return conet_co_create((void *) cnhd_service, (void *) (long) fd);
+
+	return co_create((void *) cnhd_service, (void *) (long) fd, NULL, stksize);
 }
 
 static void cnhd_usage(char const *prg) {
 
 	fprintf(stderr, "Use: %s [-p PORT (%d)] [-r ROOTFS ('%s')] [-L LSNBKLOG (%d)]\n"
-		"\t[-S STKSIZE (%d)] [-h]\n", prg, svr_port, rootfs, lsnbklog, stksize);
+		"\t[-S STKSIZE (%d)] [-g MAXSTKSIZE] [-B CONNBPS] [-G GLOBBPS]\n"
+		"\t[-m MEMBUDGET] [-l MAXLINE] [-P reject,idle,shrink] [-H] [-C CERT -K KEY [-E]]\n"
+		"\t[-R RSTSOCK] [-W SHUTTMO (%d)] [-j LOOPS] [-c CPULIST [-N]] [-z ZCSIZE]\n"
+		"\t[-o nodelay=B,sndbuf=N,rcvbuf=N,lowat=N,quickack=B,busypoll=US,\n"
+		"\t    keepalive=IDLE:INTVL:CNT] [-T TRACEFILE] [-h]\n",
+		prg, svr_port,
+		rootfs, lsnbklog, stksize, shut_tmo);
+}
+
+/*
+ * Parses a comma separated list of CPUs, which loops get pinned to.
+ */
+static int cnhd_parse_cpus(char *str) {
+	char *cpu, *aux;
+
+	for (num_cpus = 0, cpu = strtok_r(str, ",", &aux); cpu != NULL;
+	     cpu = strtok_r(NULL, ",", &aux)) {
+		if (num_cpus == CNHD_MAXLOOPS || !isdigit(*cpu))
+			return -1;
+		loop_cpus[num_cpus++] = atoi(cpu);
+	}
+
+	return num_cpus > 0 ? 0: -1;
+}
+
+/*
+ * Dumps the loop trace ring, in TRACEFILE for the first loop, and in
+ * TRACEFILE.ID for the others.
+ */
+static void cnhd_trace_dump(void) {
+	char path[PATH_MAX];
+
+	if (cloop->id == 0)
+		snprintf(path, sizeof(path), "%s", trace_path);
+	else
+		snprintf(path, sizeof(path), "%s.%d", trace_path, cloop->id);
+	if (conet_trace_dump(path) < 0)
+		perror(path);
+}
+
+static void *cnhd_run(void *data) {
+	unsigned long long tdrain = 0;
+	coroutine_t co;
+	struct conet_loopcfg lcfg;
+
+	cloop = (struct cnhd_loop *) data;
+	lcfg.cpu = cloop->cpu;
+	lcfg.flags = numa_local ? CONET_LOOP_NUMA: 0;
+	if (num_loops > 1 && co_thread_init() < 0) {
+		cloop->status = 1;
+		return NULL;
+	}
+	if (conet_init_loop(&lcfg) < 0) {
+		cloop->status = 1;
+		goto thexit;
+	}
+	if (trace_path != NULL && conet_trace_start(CNHD_TRACE_EVENTS) < 0)
+		perror("trace");
+	conet_ctx_init(&auxctx, NULL, -1);
+	if (cloop->id == 0) {
+		if ((co = co_create((void *) cnhd_sigwaiter, (void *) (long) sig_fd,
+				    NULL, stksize)) == NULL) {
+			perror("signalfd");
+			cloop->status = 1;
+			goto cleanup;
+		}
+		co_call(co);
+	}
+	if (tls_cert != NULL &&
+	    (tls = conet_tls_create(tls_flags, tls_cert,
+				    tls_key != NULL ? tls_key: tls_cert, NULL)) == NULL) {
+		fprintf(stderr, "Unable to setup TLS: %s\n", tls_cert);
+		cloop->status = 1;
+		goto cleanup;
+	}
+	if (glob_bps)
+		conet_set_rate(NULL, CONET_RATE_TX, glob_bps, 0);
+	conet_set_memcfg(&memcfg);
+	conet_set_workers(stksize, lsnbklog);
+	if (stkvsize > 0 && conet_set_stacks(stkvsize, stksize, lsnbklog) < 0) {
+		fprintf(stderr, "Invalid stack size: %ld\n", stkvsize);
+		cloop->status = 1;
+		goto cleanup;
+	}
+
+	/*
+	 * With a restart socket, try to take over the listener of a running
+	 * instance first, and bind our own only if there is none.
+	 */
+	if (cloop->ufd != -1) {
+		if ((co = co_create((void *) cnhd_takeover, (void *) (long) cloop->ufd,
+				    NULL, stksize)) == NULL) {
+			fprintf(stderr, "Unable to create coroutine\n");
+			close(cloop->ufd);
+			cloop->status = 4;
+			goto cleanup;
+		}
+		co_call(co);
+		goto loop;
+	}
+	if (cnhd_start(cloop->sfd) < 0) {
+		close(cloop->sfd);
+		cloop->status = 4;
+		goto cleanup;
+	}
+	if (rst_path != NULL && (cloop->ufd = cnhd_rst_listen()) != -1) {
+		if ((co = co_create((void *) cnhd_handoff, (void *) (long) cloop->ufd,
+				    NULL, stksize)) == NULL)
+			close(cloop->ufd);
+		else
+			co_call(co);
+	}
+
+	loop:
+	while (!stopsvr) {
+		conet_events_wait(CNHD_EVWAIT_TIMEO);
+		conet_events_dispatch(0);
+
+		/*
+		 * Once our listener has been handed off, we stay around until all
+		 * the connections we still serve are gone (or the drain timeout
+		 * expires), and the queued handoffs have been sent.
+		 */
+		if (draining) {
+			if (!tdrain)
+				tdrain = cnhd_mstime() + CNHD_DRAIN_TIMEO;
+			if ((live_conns == 0 || cnhd_mstime() > tdrain) && hochan.cnt == 0) {
+				if (!hochan.closed) {
+					conet_chan_close(&hochan);
+					continue;
+				}
+				break;
+			}
+		}
+	}
+
+	conet_drain(shut_tmo, &cloop->drst);
+	conet_get_memstats(&cloop->memst);
+	conet_get_stackstats(&cloop->stkst);
+	conet_get_zcstats(&cloop->zcst);
+	conet_get_iostats(&cloop->iost);
+	if (trace_path != NULL)
+		cnhd_trace_dump();
+	cleanup:
+	conet_cleanup();
+	if (tls != NULL)
+		conet_tls_free(tls);
+	thexit:
+	cloop->conns = conns;
+	cloop->reqs = reqs;
+	cloop->tbytes = tbytes;
+	cloop->misses = misses;
+	if (num_loops > 1)
+		co_thread_cleanup();
+
+	return NULL;
 }
 
 int main(int ac, char **av) {
 	int i, sfd, one = 1;
-	coroutine_t co;
 	struct linger ling = { 0, 0 };
 	struct sockaddr_in addr;
+	struct cnhd_loop *loops, tot;
+	sigset_t mask;
 
 	for (i = 1; i < ac; i++) {
 		if (strcmp(av[i], "-r") == 0) {
@@ -241,55 +812,222 @@ int main(int ac, char **av) {
 		} else if (strcmp(av[i], "-S") == 0) {
 			if (++i < ac)
 				stksize = atoi(av[i]);
+		} else if (strcmp(av[i], "-g") == 0) {
+			if (++i < ac)
+				stkvsize = atol(av[i]);
+		} else if (strcmp(av[i], "-B") == 0) {
+			if (++i < ac)
+				conn_bps = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-G") == 0) {
+			if (++i < ac)
+				glob_bps = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-m") == 0) {
+			if (++i < ac)
+				memcfg.budget = atol(av[i]);
+		} else if (strcmp(av[i], "-l") == 0) {
+			if (++i < ac)
+				memcfg.maxline = atoi(av[i]);
+		} else if (strcmp(av[i], "-P") == 0) {
+			if (++i < ac)
+				memcfg.policy = cnhd_parse_policy(av[i]);
+		} else if (strcmp(av[i], "-H") == 0) {
+			hibernate = 1;
+		} else if (strcmp(av[i], "-C") == 0) {
+			if (++i < ac)
+				tls_cert = av[i];
+		} else if (strcmp(av[i], "-K") == 0) {
+			if (++i < ac)
+				tls_key = av[i];
+		} else if (strcmp(av[i], "-E") == 0) {
+			tls_flags |= CONET_TLS_KTLS;
+		} else if (strcmp(av[i], "-R") == 0) {
+			if (++i < ac)
+				rst_path = av[i];
+		} else if (strcmp(av[i], "-W") == 0) {
+			if (++i < ac)
+				shut_tmo = atoi(av[i]);
+		} else if (strcmp(av[i], "-j") == 0) {
+			if (++i < ac)
+				num_loops = atoi(av[i]);
+		} else if (strcmp(av[i], "-c") == 0) {
+			if (++i < ac && cnhd_parse_cpus(av[i]) < 0) {
+				cnhd_usage(av[0]);
+				return 1;
+			}
+		} else if (strcmp(av[i], "-o") == 0) {
+			if (++i < ac && cnhd_parse_sockopts(av[i], &sockopts) < 0) {
+				cnhd_usage(av[0]);
+				return 1;
+			}
+		} else if (strcmp(av[i], "-z") == 0) {
+			if (++i < ac)
+				zcsize = atoi(av[i]);
+		} else if (strcmp(av[i], "-T") == 0) {
+			if (++i < ac)
+				trace_path = av[i];
+		} else if (strcmp(av[i], "-N") == 0) {
+			numa_local = 1;
 		} else {
 			cnhd_usage(av[0]);
 			return 1;
 		}
 	}
-	signal(SIGINT, cnhd_sigint);
+	if (num_cpus > 0 && num_loops == 1)
+		num_loops = num_cpus;
+	if (num_loops < 1 || num_loops > CNHD_MAXLOOPS ||
+	    (num_cpus > 0 && num_cpus != num_loops) ||
+	    (num_loops > 1 && rst_path != NULL)) {
+		cnhd_usage(av[0]);
+		return 1;
+	}
 	signal(SIGPIPE, SIG_IGN);
-	siginterrupt(SIGINT, 1);
-	if (conet_init() < 0)
+	memcfg.conn_extra = stksize;
+
+	/*
+	 * With zero copy, /mem-* responses are sent in ZCSIZE chunks out of a
+	 * buffer which is never written, so in flight data cannot change.
+	 */
+	if (zcsize > 0 && (zbuf = (char *) calloc(1, zcsize)) == NULL) {
+		perror("zero copy buffer");
 		return 1;
-	if ((sfd = conet_socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		conet_cleanup();
-		return 2;
-	}
-	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-	setsockopt(sfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
-
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(svr_port);
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	if (bind(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
-		perror("bind");
-		close(sfd);
-		conet_cleanup();
-		return 3;
 	}
-	listen(sfd, lsnbklog);
-	if ((co = co_create((void *) cnhd_acceptor, (void *) (long) sfd, NULL,
-			    stksize)) == NULL) {
-		fprintf(stderr, "Unable to create coroutine\n");
-		close(sfd);
-		conet_cleanup();
-		return 4;
+
+	/*
+	 * Signals are blocked before any loop thread is created, so that they
+	 * only get delivered to the signalfd served by the first loop.
+	 */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if ((sig_fd = conet_signalfd(&mask)) == -1) {
+		perror("signalfd");
+		return 1;
 	}
-	co_call(co);
+	if ((loops = (struct cnhd_loop *)
+	     calloc(num_loops, sizeof(struct cnhd_loop))) == NULL) {
+		perror("loops");
+		return 1;
+	}
+	for (i = 0; i < num_loops; i++) {
+		loops[i].id = i;
+		loops[i].cpu = num_cpus > 0 ? loop_cpus[i]: -1;
+		loops[i].sfd = loops[i].ufd = -1;
+	}
+	if (rst_path != NULL)
+		loops[0].ufd = cnhd_rst_connect();
 
-	while (!stopsvr) {
-		conet_events_wait(CNHD_EVWAIT_TIMEO);
-		conet_events_dispatch(0);
+	/*
+	 * Listeners join their SO_REUSEPORT group in loop order, which is what
+	 * the CPU steering program indexes.
+	 */
+	for (i = 0; loops[0].ufd == -1 && i < num_loops; i++) {
+		if ((sfd = conet_socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			return 2;
+		setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(sfd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+		if (num_loops > 1)
+			setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(svr_port);
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (bind(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+			perror("bind");
+			close(sfd);
+			return 3;
+		}
+		listen(sfd, lsnbklog);
+		loops[i].sfd = sfd;
 	}
+	if (loops[0].sfd != -1 && num_loops > 1 && num_cpus > 0 &&
+	    conet_reuseport_steer(loops[0].sfd, loop_cpus, num_loops) < 0)
+		perror("reuseport steering");
 
-	close(sfd);
-	conet_cleanup();
+	for (i = 1; i < num_loops; i++) {
+		if (pthread_create(&loops[i].thr, NULL, cnhd_run, &loops[i]) != 0) {
+			fprintf(stderr, "Unable to create thread\n");
+			close(loops[i].sfd);
+			loops[i].status = 1;
+			stopsvr++;
+		} else
+			loops[i].started = 1;
+	}
+	cnhd_run(&loops[0]);
+	for (i = 1; i < num_loops; i++)
+		if (loops[i].started)
+			pthread_join(loops[i].thr, NULL);
+
+	memset(&tot, 0, sizeof(tot));
+	for (i = 0; i < num_loops; i++) {
+		tot.conns += loops[i].conns;
+		tot.reqs += loops[i].reqs;
+		tot.tbytes += loops[i].tbytes;
+		tot.misses += loops[i].misses;
+		tot.memst.peak += loops[i].memst.peak;
+		tot.memst.rejected += loops[i].memst.rejected;
+		tot.memst.aborted += loops[i].memst.aborted;
+		tot.memst.shrunk += loops[i].memst.shrunk;
+		tot.drst.idle += loops[i].drst.idle;
+		tot.drst.active += loops[i].drst.active;
+		tot.drst.cancelled += loops[i].drst.cancelled;
+		if (loops[i].stkst.hwm > tot.stkst.hwm)
+			tot.stkst.hwm = loops[i].stkst.hwm;
+		tot.stkst.used_sum += loops[i].stkst.used_sum;
+		tot.stkst.exited += loops[i].stkst.exited;
+		tot.stkst.mapped += loops[i].stkst.mapped;
+		tot.zcst.sends += loops[i].zcst.sends;
+		tot.zcst.bytes += loops[i].zcst.bytes;
+		tot.zcst.copied += loops[i].zcst.copied;
+		tot.zcst.fallbacks += loops[i].zcst.fallbacks;
+		tot.iost.rdcalls += loops[i].iost.rdcalls;
+		tot.iost.rdagain += loops[i].iost.rdagain;
+		tot.iost.rdskips += loops[i].iost.rdskips;
+		tot.iost.rabytes += loops[i].iost.rabytes;
+		tot.iost.resizes += loops[i].iost.resizes;
+	}
+	i = loops[0].status;
+	free(loops);
+	if (i != 0)
+		return i;
 
 	fprintf(stdout,
 		"Connections .....: %llu\n"
 		"Requests ........: %llu\n"
-		"Total Bytes .....: %llu\n", conns, reqs, tbytes);
+		"Total Bytes .....: %llu\n"
+		"Peak Memory .....: %ld\n"
+		"Rejected ........: %ld\n"
+		"Aborted .........: %ld\n"
+		"Shrunk ..........: %ld\n"
+		"Drained Idle ....: %ld\n"
+		"Drained Active ..: %ld\n"
+		"Cancelled .......: %ld\n"
+		"Read Syscalls ...: %lld (%.2f/req)\n"
+		"EAGAIN Reads ....: %lld\n"
+		"Skipped Reads ...: %lld\n"
+		"Readahead Bytes .: %lld\n"
+		"Buffer Resizes ..: %lld\n", tot.conns, tot.reqs, tot.tbytes,
+		tot.memst.peak, tot.memst.rejected, tot.memst.aborted,
+		tot.memst.shrunk, tot.drst.idle, tot.drst.active,
+		tot.drst.cancelled, tot.iost.rdcalls,
+		tot.reqs ? (double) tot.iost.rdcalls / tot.reqs: 0.0,
+		tot.iost.rdagain, tot.iost.rdskips, tot.iost.rabytes,
+		tot.iost.resizes);
+	if (stkvsize > 0)
+		fprintf(stdout,
+			"Stack Peak ......: %ld\n"
+			"Stack Average ...: %lld\n"
+			"Stacks Mapped ...: %ld\n", tot.stkst.hwm,
+			tot.stkst.exited ? tot.stkst.used_sum / tot.stkst.exited: 0LL,
+			tot.stkst.mapped);
+	if (zbuf != NULL)
+		fprintf(stdout,
+			"Zero Copy Sends .: %ld\n"
+			"Zero Copy Bytes .: %lld\n"
+			"Copied Sends ....: %ld\n"
+			"Copy Fallbacks ..: %ld\n", tot.zcst.sends, tot.zcst.bytes,
+			tot.zcst.copied, tot.zcst.fallbacks);
+	if (num_loops > 1 && num_cpus > 0)
+		fprintf(stdout, "Steer Misses ....: %llu\n", tot.misses);
 
 	return 0;
 }
-
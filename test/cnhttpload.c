@@ -28,8 +28,10 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <math.h>
 #include <signal.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -37,18 +39,44 @@
 #include <arpa/nameser.h>
 #include <netdb.h>
 #include "coronet.h"
-#include "coronet_lists.h"
+#include "coronet_tls.h"
+#include "coronet_http.h"
 
 
 
 #define CNHL_STKSIZE (1024 * 8)
 #define CNHL_EVWAIT_TIMEO 500
+#define CNHL_THINK_EVWAIT 10
+#define CNHL_MAXURLS 256
+#define CNHL_MAXPHASES 32
+#define CNHL_MAXTHREADS 256
+#define CNHL_MAXTARGETS 64
+#define CNHL_MAXSOURCES 64
 #define CNHL_STATUPDATE_TMSTEP 1000
 #define CNHL_TMSAMPLE 200
 
 #define CNHL_KAVG 3
 #define CNHL_AVG(c, a) (((c) + CNHL_KAVG * (a)) / (CNHL_KAVG + 1))
 
+/*
+ * Latency histogram buckets are powers of two microseconds, each split in
+ * 1 << CNHL_HSUBBITS linear sub-buckets.
+ */
+#define CNHL_HSUBBITS 3
+#define CNHL_HBUCKETS (40 << CNHL_HSUBBITS)
+
+/*
+ * Thread counters have a single writer (their own thread), so plain
+ * relaxed stores are enough for the reporter to read them untorn.
+ */
+#define CNHL_ADD(v, n) __atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#define CNHL_SET(v, n) __atomic_store_n(&(v), (n), __ATOMIC_RELAXED)
+#define CNHL_GET(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+#if !defined(IP_BIND_ADDRESS_NO_PORT)
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
 
 
 enum cnhl_errors {
@@ -58,6 +86,8 @@ enum cnhl_errors {
 		CNHL_EREAD,
 		CNHL_EWRITE,
 		CNHL_EPROTO,
+		CNHL_ETIMEO,
+		CNHL_ECSUM,
 		CNHL_E200,
 		CNHL_E300,
 		CNHL_E400,
@@ -66,43 +96,170 @@ enum cnhl_errors {
 		CNHL_EMAX
 };
 
-struct cnhl_waiter {
-	struct ll_head lnk;
-	coroutine_t co;
+enum cnhl_dists {
+	CNHL_DFIXED = 0,
+		CNHL_DUNIFORM,
+		CNHL_DEXP
+};
+
+enum cnhl_spreads {
+	CNHL_SRR = 0,
+		CNHL_SLC
+};
+
+struct cnhl_dist {
+	int type;
+	double a, b;
 };
 
+struct cnhl_url {
+	char *meth, *path;
+	char *hdrs;
+	long cumw;
+	int bsize;
+};
 
+struct cnhl_endpoint {
+	char const *host;
+	struct sockaddr_storage addr;
+	socklen_t alen;
+};
+
+struct cnhl_tgstat {
+	long live, total;
+};
 
+/*
+ * Workload phases ramp the number of sessions linearly from cstart to
+ * cend, over dur milliseconds.
+ */
+struct cnhl_phase {
+	char name[32];
+	unsigned long long dur;
+	long cstart, cend;
+};
+
+/*
+ * Every load thread runs its own loop, over its own share of the session
+ * quotas, and publishes its counters here. Aligned so that two threads
+ * never write the same cache line.
+ */
+struct cnhl_thread {
+	pthread_t thr;
+	int tid;
+	long num_conns;
+	long max_conns;
+	long max_active;
+	long live_coros;
+	long open_conns;
+	long total_conns;
+	long tls_resumed;
+	long htresps;
+	unsigned long long rxbytes;
+	long errors[CNHL_EMAX];
+	unsigned long long latsum[CNHL_MAXPHASES], latmax[CNHL_MAXPHASES];
+	long lathist[CNHL_HBUCKETS];
+	struct cnhl_tgstat *tgs;
+	int plo, phi;
+	int status;
+	int done;
+} __attribute__((aligned(64)));
 
+
+
+
+static unsigned long long cnhl_ustime(void);
 static unsigned long long cnhl_mstime(void);
 static void cnhl_usage(char const *prg);
-static int cnhl_chunkread(struct sk_conn *conn, void *gbuf, int size);
+static void cnhl_crc_init(void);
+static unsigned int cnhl_crc32(unsigned int crc, char const *buf, int n);
+static long long cnhl_read_body(struct sk_conn *conn, long long clen,
+				unsigned int *crc);
+static int cnhl_parse_dist(char *args, struct cnhl_dist *d);
+static int cnhl_load_workload(char const *path);
+static double cnhl_dist_draw(struct cnhl_dist const *d);
+static struct cnhl_url const *cnhl_pick_url(void);
+static int cnhl_send_req(struct sk_conn *conn, struct cnhl_url const *u,
+			 char const *host, int last);
+static int cnhl_add_hosts(char *hosts);
+static int cnhl_add_source(char const *src);
+static int cnhl_pick_endpoint(void);
+static int cnhl_bind_source(struct sk_conn *conn,
+			    struct cnhl_endpoint const *ep);
+static char const *cnhl_addr_str(struct sockaddr_storage const *addr,
+				 socklen_t alen, char *buf, int size);
+static void cnhl_err(int err);
+static int cnhl_lat_bucket(unsigned long long us);
+static unsigned long long cnhl_bucket_lat(int idx);
+static void cnhl_collect(struct cnhl_thread *agg);
+static long cnhl_errsum(struct cnhl_thread const *agg);
+static int cnhl_phase_at(unsigned long long tc, long *target);
+static void cnhl_phase_report(int phn, unsigned long long tc);
+static void cnhl_phase_check(unsigned long long tc);
+static long cnhl_target(unsigned long long tc);
+static int cnhl_ioerr(struct conet_ctx *ctx, int err);
 static void *cnhl_session(void *data);
 static int cnhl_new_conn(void);
 static void cnhl_update_stats(void);
+static void cnhl_sample_stats(unsigned long long tc);
+static void cnhl_stats_timer(struct conet_timer *tmr, void *data);
+static void cnhl_lat_report(struct cnhl_thread const *agg);
+static void *cnhl_run(void *data);
 
 
 
 
-static int stopldr;
-static char const *svr_host;
+static volatile int stopldr;
+static char *svr_hosts[CNHL_MAXTARGETS];
+static int num_hosts;
 static int svr_port = 80;
-static struct sockaddr_in saddr;
+static struct cnhl_endpoint targets[CNHL_MAXTARGETS];
+static int num_targets;
+static int tg_spread = CNHL_SRR;
+static __thread int tg_next;
+static struct cnhl_endpoint sources[CNHL_MAXSOURCES];
+static int num_sources;
+static int src_plo, src_phi;
+static __thread int src_next, src_port;
 static long num_conns;
 static long max_conns;
 static long max_active;
 static int num_reqs = 1;
+static int req_tmo = -1;
+static unsigned long glob_rps, glob_bps;
 static int num_urls;
 static char **doc_urls;
-static int url_next;
+static __thread int url_next;
 static int stksize = CNHL_STKSIZE;
-static long live_coros;
-static long open_conns;
-static long total_conns;
-static struct ll_head wlist;
-static long errors[CNHL_EMAX];
-static long htresps, last_htresps;
-static unsigned long long rxbytes, last_rxbytes;
+static long stkvsize;
+static int num_threads = 1;
+static struct cnhl_thread *thrs;
+static __thread struct cnhl_thread *tst;
+static __thread unsigned short rndst[3];
+static int use_tls;
+static unsigned int tls_flags;
+static __thread struct conet_tls *tls;
+static int verify_crc;
+static unsigned int body_crc;
+static unsigned int crctab[256];
+static char const *wl_path;
+static struct cnhl_url wl_urls[CNHL_MAXURLS];
+static int wl_nurls;
+static long wl_totw;
+static struct cnhl_dist wl_reqs = { CNHL_DFIXED, 1, 1 };
+static struct cnhl_dist wl_think;
+static int wl_thinking;
+static struct cnhl_phase wl_phases[CNHL_MAXPHASES];
+static int wl_nphases, wl_curph = -1;
+static unsigned long long tstart, wl_tphase;
+static long wl_phresps, wl_pherrs;
+static unsigned long long wl_phbytes;
+static __thread struct conet_event thinkev;
+static char zbuf[1024 * 8];
+static __thread struct conet_sem actsem;
+static __thread struct conet_timer sttmr;
+static long last_htresps;
+static unsigned long long last_rxbytes;
 static double acrate, max_acrate, abrate, max_abrate;
 static unsigned long long tlu, tl, tu = CNHL_STATUPDATE_TMSTEP, ts = CNHL_TMSAMPLE;
 static char const * const errstrs[] = {
@@ -112,6 +269,8 @@ static char const * const errstrs[] = {
 		"Read",
 		"Write",
 		"Protocol",
+		"Timeout",
+		"Checksum",
 		"HTTP 2xx",
 		"HTTP 3xx",
 		"HTTP 4xx",
@@ -120,6 +279,15 @@ static char const * const errstrs[] = {
 
 
 
+static unsigned long long cnhl_ustime(void) {
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) != 0)
+		return 0;
+
+	return 1000000ULL * tv.tv_sec + tv.tv_usec;
+}
+
 static unsigned long long cnhl_mstime(void) {
 	struct timeval tv;
 
@@ -131,66 +299,656 @@ static unsigned long long cnhl_mstime(void) {
 
 static void cnhl_usage(char const *prg) {
 
-	fprintf(stderr, "Use: %s -s HOST -n NCON [-p PORT (%d)] [-r NREQS (%d)]\n"
-		"\t[-S STKSIZE (%d)] [-M MAXCONNS] [-t TMUPD (%d)] [-a NACTIVE]\n"
-		"\t[-T TMSAMP (%llu)] [-h] URL ...\n",
+	fprintf(stderr, "Use: %s -s HOST[,HOST...] -n NCON [-p PORT (%d)] [-r NREQS (%d)]\n"
+		"\t[-S STKSIZE (%d)] [-g MAXSTKSIZE] [-M MAXCONNS] [-t TMUPD (%d)]\n"
+		"\t[-a NACTIVE] [-T TMSAMP (%llu)] [-D REQTMO] [-Q GLOBRPS] [-G GLOBBPS]\n"
+		"\t[-L [-E]] [-V CRC32] [-w WORKLOAD] [-j THREADS] [-d rr|lc]\n"
+		"\t[-B SRCADDR ...] [-P SPORTLO-SPORTHI] [-h] [URL ...]\n",
 		prg, svr_port, num_reqs, stksize, CNHL_STATUPDATE_TMSTEP, ts);
 }
 
-static int cnhl_chunkread(struct sk_conn *conn, void *gbuf, int size) {
+static void cnhl_crc_init(void) {
+	int i, k;
+	unsigned int c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1): c >> 1;
+		crctab[i] = c;
+	}
+}
+
+static unsigned int cnhl_crc32(unsigned int crc, char const *buf, int n) {
+
+	for (crc = ~crc; n > 0; n--, buf++)
+		crc = crctab[(crc ^ (unsigned char) *buf) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/*
+ * Reads a response body of clen bytes, a chunked one if clen is -1, or one
+ * delimited by the connection close if clen is -2. The payload is consumed
+ * straight from the connection buffer, and never copied. Returns the body
+ * size, or -1 in case of error (EBADMSG for broken chunked framing).
+ */
+static long long cnhl_read_body(struct sk_conn *conn, long long clen,
+				unsigned int *crc) {
+	int n;
+	long long tot = 0;
+	char *ptr;
+	struct conet_http_req req;
+
+	*crc = 0;
+	if (clen == -2) {
+		for (;;) {
+			if (conn->ridx == conn->bcnt && (n = conet_fill(conn, 0)) <= 0)
+				return n < 0 ? -1: tot;
+			n = conn->bcnt - conn->ridx;
+			if (verify_crc)
+				*crc = cnhl_crc32(*crc, conn->buf + conn->ridx, n);
+			conn->ridx += n;
+			tot += n;
+		}
+	}
+	conet_http_init_body(&req, conn, clen);
+	while ((n = conet_http_read_zc(&req, &ptr, CONET_BUFSIZE)) > 0) {
+		if (verify_crc)
+			*crc = cnhl_crc32(*crc, ptr, n);
+		tot += n;
+	}
+
+	return n < 0 ? -1: tot;
+}
+
+static int cnhl_parse_dist(char *args, struct cnhl_dist *d) {
+	char *type, *aux;
 
-	fprintf(stderr, "Chunked read not implemented yet\n");
+	if ((type = strtok_r(args, " \t\r\n", &aux)) == NULL)
+		return -1;
+	if (strcmp(type, "fixed") == 0)
+		d->type = CNHL_DFIXED;
+	else if (strcmp(type, "uniform") == 0)
+		d->type = CNHL_DUNIFORM;
+	else if (strcmp(type, "exp") == 0)
+		d->type = CNHL_DEXP;
+	else
+		return -1;
+	if ((args = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+		return -1;
+	d->a = d->b = atof(args);
+	if (d->type == CNHL_DUNIFORM) {
+		if ((args = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+			return -1;
+		d->b = atof(args);
+	}
 
+	return d->a < 0 || d->b < d->a ? -1: 0;
+}
+
+/*
+ * Loads a workload file, made of lines like:
+ *
+ *   url WEIGHT METHOD PATH [BODYSIZE]
+ *   header NAME: VALUE          (added to the previous url)
+ *   reqs fixed N | uniform MIN MAX | exp MEAN
+ *   think fixed MS | uniform MIN MAX | exp MEAN
+ *   phase NAME DURATION_MS SESSIONS_START SESSIONS_END
+ *
+ * Empty lines, and the ones starting with '#', are ignored.
+ */
+static int cnhl_load_workload(char const *path) {
+	int lineno = 0;
+	long weight;
+	size_t hsize;
+	char *cmd, *arg, *aux, *hdrs;
+	FILE *file;
+	struct cnhl_url *u = NULL;
+	struct cnhl_phase *ph;
+	char ln[1024];
+
+	if ((file = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(ln, sizeof(ln), file) != NULL) {
+		lineno++;
+		if ((cmd = strtok_r(ln, " \t\r\n", &aux)) == NULL || *cmd == '#')
+			continue;
+		if (strcmp(cmd, "url") == 0) {
+			if (wl_nurls == CNHL_MAXURLS ||
+			    (arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL ||
+			    (weight = atol(arg)) <= 0)
+				goto bad_line;
+			u = &wl_urls[wl_nurls];
+			if ((arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+				goto bad_line;
+			u->meth = strdup(arg);
+			if ((arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+				goto bad_line;
+			u->path = strdup(arg);
+			u->bsize = (arg = strtok_r(NULL, " \t\r\n", &aux)) != NULL ?
+				atoi(arg): 0;
+			u->hdrs = NULL;
+			wl_totw += weight;
+			u->cumw = wl_totw;
+			wl_nurls++;
+		} else if (strcmp(cmd, "header") == 0) {
+			for (arg = aux; *arg == ' ' || *arg == '\t'; arg++);
+			arg[strcspn(arg, "\r\n")] = '\0';
+			if (u == NULL || *arg == '\0')
+				goto bad_line;
+			hsize = u->hdrs != NULL ? strlen(u->hdrs): 0;
+			if ((hdrs = (char *) realloc(u->hdrs,
+						     hsize + strlen(arg) + 3)) == NULL)
+				goto bad_line;
+			sprintf(hdrs + hsize, "%s\r\n", arg);
+			u->hdrs = hdrs;
+		} else if (strcmp(cmd, "reqs") == 0) {
+			if (cnhl_parse_dist(aux, &wl_reqs) < 0)
+				goto bad_line;
+		} else if (strcmp(cmd, "think") == 0) {
+			if (cnhl_parse_dist(aux, &wl_think) < 0)
+				goto bad_line;
+			wl_thinking = wl_think.b > 0;
+		} else if (strcmp(cmd, "phase") == 0) {
+			if (wl_nphases == CNHL_MAXPHASES ||
+			    (arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+				goto bad_line;
+			ph = &wl_phases[wl_nphases];
+			snprintf(ph->name, sizeof(ph->name), "%s", arg);
+			if ((arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+				goto bad_line;
+			ph->dur = strtoull(arg, NULL, 0);
+			if ((arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+				goto bad_line;
+			ph->cstart = atol(arg);
+			if ((arg = strtok_r(NULL, " \t\r\n", &aux)) == NULL)
+				goto bad_line;
+			ph->cend = atol(arg);
+			if (ph->dur == 0 || ph->cstart < 0 || ph->cend < 0)
+				goto bad_line;
+			wl_nphases++;
+		} else
+			goto bad_line;
+	}
+	fclose(file);
+	if (wl_nurls == 0) {
+		fprintf(stderr, "%s: no url defined\n", path);
+		return -1;
+	}
+
+	return 0;
+
+	bad_line:
+	fprintf(stderr, "%s:%d: invalid workload line\n", path, lineno);
+	fclose(file);
 	return -1;
 }
 
+static double cnhl_dist_draw(struct cnhl_dist const *d) {
+
+	switch (d->type) {
+	case CNHL_DUNIFORM:
+		return d->a + erand48(rndst) * (d->b - d->a);
+	case CNHL_DEXP:
+		return -d->a * log(1.0 - erand48(rndst));
+	}
+
+	return d->a;
+}
+
+static struct cnhl_url const *cnhl_pick_url(void) {
+	int i;
+	long w = (long) (erand48(rndst) * wl_totw);
+
+	for (i = 0; i < wl_nurls - 1 && w >= wl_urls[i].cumw; i++);
+
+	return &wl_urls[i];
+}
+
+/*
+ * Sends a request for u, with a body of zeros, if any.
+ */
+static int cnhl_send_req(struct sk_conn *conn, struct cnhl_url const *u,
+			 char const *host, int last) {
+	int n, csize, v6 = strchr(host, ':') != NULL;
+
+	if (conet_printf(conn,
+			 "%s %s HTTP/1.1\r\n"
+			 "Host: %s%s%s\r\n"
+			 "Connection: %s\r\n"
+			 "Content-Length: %d\r\n"
+			 "%s"
+			 "\r\n",
+			 u->meth, u->path, v6 ? "[": "", host, v6 ? "]": "",
+			 last ? "close": "keep-alive",
+			 u->bsize, u->hdrs != NULL ? u->hdrs: "") < 0)
+		return -1;
+	for (n = 0; n < u->bsize; n += csize) {
+		csize = u->bsize - n > (int) sizeof(zbuf) ?
+			(int) sizeof(zbuf): u->bsize - n;
+		if (conet_write(conn, zbuf, csize) != csize)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Adds all the addresses (IPv4 and IPv6) of a comma separated host list
+ * to the connection targets.
+ */
+static int cnhl_add_hosts(char *hosts) {
+	int i, error;
+	char *host, *aux;
+	struct addrinfo hints, *res, *ai;
+	char port[16];
+
+	snprintf(port, sizeof(port), "%d", svr_port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for (host = strtok_r(hosts, ",", &aux); host != NULL;
+	     host = strtok_r(NULL, ",", &aux)) {
+		if ((error = getaddrinfo(host, port, &hints, &res)) != 0) {
+			fprintf(stderr, "Unable to resolve: %s (%s)\n", host,
+				gai_strerror(error));
+			return -1;
+		}
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			for (i = 0; i < num_targets; i++)
+				if (targets[i].alen == ai->ai_addrlen &&
+				    memcmp(&targets[i].addr, ai->ai_addr,
+					   ai->ai_addrlen) == 0)
+					break;
+			if (i < num_targets)
+				continue;
+			if (num_targets == CNHL_MAXTARGETS) {
+				fprintf(stderr, "Too many targets\n");
+				freeaddrinfo(res);
+				return -1;
+			}
+			targets[num_targets].host = host;
+			memcpy(&targets[num_targets].addr, ai->ai_addr, ai->ai_addrlen);
+			targets[num_targets].alen = ai->ai_addrlen;
+			num_targets++;
+		}
+		freeaddrinfo(res);
+	}
+
+	return 0;
+}
+
+static int cnhl_add_source(char const *src) {
+	int error;
+	struct addrinfo hints, *res;
+
+	if (num_sources == CNHL_MAXSOURCES) {
+		fprintf(stderr, "Too many source addresses\n");
+		return -1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+	if ((error = getaddrinfo(src, NULL, &hints, &res)) != 0) {
+		fprintf(stderr, "Invalid source address: %s (%s)\n", src,
+			gai_strerror(error));
+		return -1;
+	}
+	sources[num_sources].host = src;
+	memcpy(&sources[num_sources].addr, res->ai_addr, res->ai_addrlen);
+	sources[num_sources].alen = res->ai_addrlen;
+	num_sources++;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+/*
+ * Picks the target for a new session, either round-robin, or the one with
+ * the fewest live sessions of the calling thread.
+ */
+static int cnhl_pick_endpoint(void) {
+	int i, k;
+
+	if (tg_spread == CNHL_SRR) {
+		k = tg_next;
+		tg_next = (tg_next + 1) % num_targets;
+	} else {
+		for (i = 1, k = 0; i < num_targets; i++)
+			if (tst->tgs[i].live < tst->tgs[k].live)
+				k = i;
+	}
+
+	return k;
+}
+
+/*
+ * Binds the session socket to the next source address of the target
+ * family. Without a source port range, the port is picked by the kernel
+ * at connect time (IP_BIND_ADDRESS_NO_PORT), so that ephemeral ports are
+ * only required to be unique per 4-tuple. With a range, the calling thread
+ * cycles over its own slice of it.
+ */
+static int cnhl_bind_source(struct sk_conn *conn,
+			    struct cnhl_endpoint const *ep) {
+	int i, port, one = 1;
+	struct cnhl_endpoint const *src = NULL;
+	struct sockaddr_storage addr;
+
+	for (i = 0; i < num_sources && src == NULL; i++) {
+		if (sources[src_next].addr.ss_family == ep->addr.ss_family)
+			src = &sources[src_next];
+		src_next = (src_next + 1) % num_sources;
+	}
+	if (src == NULL && tst->plo == 0)
+		return 0;
+	if (src != NULL)
+		memcpy(&addr, &src->addr, src->alen);
+	else {
+		memset(&addr, 0, sizeof(addr));
+		addr.ss_family = ep->addr.ss_family;
+	}
+	if (tst->plo == 0) {
+		setsockopt(conn->sfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+			   &one, sizeof(one));
+
+		return bind(conn->sfd, (struct sockaddr *) &addr, ep->alen);
+	}
+	setsockopt(conn->sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	for (i = tst->plo; i <= tst->phi; i++) {
+		if (src_port < tst->plo || src_port > tst->phi)
+			src_port = tst->plo;
+		port = src_port++;
+		if (addr.ss_family == AF_INET6)
+			((struct sockaddr_in6 *) &addr)->sin6_port = htons(port);
+		else
+			((struct sockaddr_in *) &addr)->sin_port = htons(port);
+		if (bind(conn->sfd, (struct sockaddr *) &addr, ep->alen) == 0)
+			return 0;
+		if (errno != EADDRINUSE)
+			break;
+	}
+
+	return -1;
+}
+
+static char const *cnhl_addr_str(struct sockaddr_storage const *addr,
+				 socklen_t alen, char *buf, int size) {
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+
+	if (getnameinfo((struct sockaddr const *) addr, alen, host, sizeof(host),
+			port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return "?";
+	snprintf(buf, size, addr->ss_family == AF_INET6 ? "[%s]:%s": "%s:%s",
+		 host, port);
+
+	return buf;
+}
+
+static void cnhl_err(int err) {
+
+	CNHL_ADD(tst->errors[err], 1);
+}
+
+static int cnhl_lat_bucket(unsigned long long us) {
+	int e;
+
+	if (us < (1 << CNHL_HSUBBITS))
+		return (int) us;
+	e = 63 - __builtin_clzll(us);
+	if (e >= (CNHL_HBUCKETS >> CNHL_HSUBBITS) + CNHL_HSUBBITS - 1)
+		return CNHL_HBUCKETS - 1;
+
+	return ((e - CNHL_HSUBBITS + 1) << CNHL_HSUBBITS) |
+		(int) ((us >> (e - CNHL_HSUBBITS)) & ((1 << CNHL_HSUBBITS) - 1));
+}
+
+/*
+ * Returns the upper bound (in microseconds) of the latency bucket idx.
+ */
+static unsigned long long cnhl_bucket_lat(int idx) {
+	int e = (idx >> CNHL_HSUBBITS) + CNHL_HSUBBITS - 1;
+	unsigned long long sub = idx & ((1 << CNHL_HSUBBITS) - 1);
+
+	if (idx < (1 << CNHL_HSUBBITS))
+		return (unsigned long long) idx;
+
+	return (1ULL << e) + ((sub + 1) << (e - CNHL_HSUBBITS)) - 1;
+}
+
+/*
+ * Sums up the counters of all the load threads. Readers never lock, so the
+ * snapshot is only consistent per counter.
+ */
+static void cnhl_collect(struct cnhl_thread *agg) {
+	int i, j;
+	unsigned long long lmax;
+	struct cnhl_thread *t;
+
+	memset(agg, 0, sizeof(*agg));
+	for (i = 0; i < num_threads; i++) {
+		t = &thrs[i];
+		agg->live_coros += CNHL_GET(t->live_coros);
+		agg->open_conns += CNHL_GET(t->open_conns);
+		agg->total_conns += CNHL_GET(t->total_conns);
+		agg->tls_resumed += CNHL_GET(t->tls_resumed);
+		agg->htresps += CNHL_GET(t->htresps);
+		agg->rxbytes += CNHL_GET(t->rxbytes);
+		for (j = 0; j < CNHL_EMAX; j++)
+			agg->errors[j] += CNHL_GET(t->errors[j]);
+		for (j = 0; j < wl_nphases; j++) {
+			agg->latsum[j] += CNHL_GET(t->latsum[j]);
+			if ((lmax = CNHL_GET(t->latmax[j])) > agg->latmax[j])
+				agg->latmax[j] = lmax;
+		}
+		for (j = 0; j < CNHL_HBUCKETS; j++)
+			agg->lathist[j] += CNHL_GET(t->lathist[j]);
+	}
+}
+
+static long cnhl_errsum(struct cnhl_thread const *agg) {
+	int i;
+	long n;
+
+	for (i = 0, n = 0; i < CNHL_E200; i++)
+		n += agg->errors[i];
+
+	return n;
+}
+
+/*
+ * Returns the workload phase active at time tc, storing in *target the
+ * number of sessions it wants alive. Phases are a pure function of the
+ * time since the load start, so that all the threads agree on them
+ * without talking. Returns wl_nphases once all the phases are done.
+ */
+static int cnhl_phase_at(unsigned long long tc, long *target) {
+	int i;
+	unsigned long long tp = tstart;
+	struct cnhl_phase *ph;
+
+	for (i = 0; i < wl_nphases; i++) {
+		ph = &wl_phases[i];
+		if (tc < tp + ph->dur) {
+			*target = ph->cstart + (long) ((ph->cend - ph->cstart) *
+						       (double) (tc - tp) / ph->dur);
+			break;
+		}
+		tp += ph->dur;
+	}
+
+	return i;
+}
+
+static void cnhl_phase_report(int phn, unsigned long long tc) {
+	long resps, errs;
+	unsigned long long rxbytes;
+	double secs = (tc - wl_tphase) / 1000.0;
+	struct cnhl_thread agg;
+
+	cnhl_collect(&agg);
+	resps = agg.htresps - wl_phresps;
+	errs = cnhl_errsum(&agg) - wl_pherrs;
+	rxbytes = agg.rxbytes - wl_phbytes;
+	fprintf(stdout,
+		"Phase %-12s %8.1f sec  %9ld resp  %9.1f resp/sec  %12.1f bytes/sec"
+		"  %7ld errors  %7.1f/%llu lat-ms\n",
+		wl_phases[phn].name, secs, resps, secs > 0 ? resps / secs: 0.0,
+		secs > 0 ? rxbytes / secs: 0.0, errs,
+		resps ? agg.latsum[phn] / 1000.0 / resps: 0.0,
+		agg.latmax[phn] / 1000);
+	wl_phresps = agg.htresps;
+	wl_pherrs = cnhl_errsum(&agg);
+	wl_phbytes = agg.rxbytes;
+}
+
+/*
+ * Reports the workload phases completed by time tc. Only the thread
+ * printing the statistics calls it.
+ */
+static void cnhl_phase_check(unsigned long long tc) {
+	int phn;
+	long target;
+
+	if (wl_nphases == 0)
+		return;
+	if (wl_curph < 0) {
+		wl_curph = 0;
+		wl_tphase = tstart;
+	}
+	for (phn = cnhl_phase_at(tc, &target); wl_curph < phn; wl_curph++) {
+		cnhl_phase_report(wl_curph, wl_tphase + wl_phases[wl_curph].dur);
+		wl_tphase += wl_phases[wl_curph].dur;
+	}
+}
+
+/*
+ * Returns the number of sessions the calling thread wants alive at time
+ * tc, which is its share of the current workload phase target. Returns -1
+ * once all the phases are done.
+ */
+static long cnhl_target(unsigned long long tc) {
+	long n;
+
+	if (wl_nphases == 0)
+		return tst->num_conns;
+	if (cnhl_phase_at(tc, &n) == wl_nphases)
+		return -1;
+
+	return n * (tst->tid + 1) / num_threads - n * tst->tid / num_threads;
+}
+
+/*
+ * A request which fails because its deadline expired is reported as a
+ * timeout, instead of the read/write error it surfaced as.
+ */
+static int cnhl_ioerr(struct conet_ctx *ctx, int err) {
+
+	return ctx->deadline && ctx->deadline <= cnhl_mstime() ? CNHL_ETIMEO: err;
+}
+
 static void *cnhl_session(void *data) {
-	int i, n, hcode, size, clen, chunked, cclose;
+	int i, hcode, size, chunked, cclose, nreqs, phn, tgn;
+	long target;
+	unsigned int crc;
+	long long clen, n;
+	unsigned long long treq, lat;
 	struct sk_conn *conn;
-	char const *curl, *ptr, *ver, *code, *msg;
+	char const *ptr, *ver, *code, *msg;
 	char *ln, *aux;
-	struct cnhl_waiter wnode;
-	static char gbuf[8192];
+	struct conet_ctx ctx;
+	struct cnhl_url const *u;
+	struct cnhl_url curl;
+	struct cnhl_endpoint const *ep;
 
-	live_coros++;
-	total_conns++;
-	if ((conn = conet_create_conn(AF_INET, SOCK_STREAM, 0,
+	CNHL_ADD(tst->live_coros, 1);
+	CNHL_ADD(tst->total_conns, 1);
+	tgn = cnhl_pick_endpoint();
+	ep = &targets[tgn];
+	if ((conn = conet_create_conn(ep->addr.ss_family, SOCK_STREAM, 0,
 				      co_current())) == NULL) {
-		errors[CNHL_ENETWORK]++;
+		cnhl_err(CNHL_ENETWORK);
 		goto dexit;
 	}
-	if (conet_connect(conn, (struct sockaddr *) &saddr, sizeof(saddr)) < 0) {
-		errors[CNHL_ECONNECT]++;
+	CNHL_ADD(tst->tgs[tgn].live, 1);
+	CNHL_ADD(tst->tgs[tgn].total, 1);
+	if (cnhl_bind_source(conn, ep) < 0) {
+		cnhl_err(CNHL_ENETWORK);
 		goto erxit;
 	}
+	if (conet_connect(conn, (struct sockaddr *) &ep->addr, ep->alen) < 0) {
+		cnhl_err(CNHL_ECONNECT);
+		goto erxit;
+	}
+	if (tls != NULL) {
+		if (conet_tls_attach(conn, tls, ep->host) < 0 ||
+		    conet_handshake(conn) < 0) {
+			cnhl_err(CNHL_ECONNECT);
+			goto erxit;
+		}
+		if (conet_tls_reused(conn))
+			CNHL_ADD(tst->tls_resumed, 1);
+	}
 
 	/*
-	 * Wait after the connection for a signal from the main dispatcher. We may
-	 * receive spurious co_calls, so we need to be sure we are called by the main
-	 * dispatcher.
+	 * Wait after the connection for one of the max_active slots to become
+	 * available.
 	 */
-	wnode.co = co_current();
-	conet_lladdt(&wnode.lnk, &wlist);
-	do {
-		co_resume();
-	} while (!conet_llempty(&wnode.lnk));
-
-	open_conns++;
-	curl = doc_urls[url_next];
-	url_next = (url_next + 1) % num_urls;
-	for (i = 0; !stopldr && i < num_reqs; i++) {
-		if (conet_printf(conn,
-				 "GET %s HTTP/1.1\r\n"
-				 "Host: %s\r\n"
-				 "Connection: %s\r\n"
-				 "Content-Length: 0\r\n"
-				 "\r\n",
-				 curl, svr_host, i + 1 < num_reqs ? "keep-alive": "close") < 0) {
-			errors[CNHL_EWRITE]++;
+	if (conet_sem_wait(&actsem, -1) < 0) {
+		cnhl_err(CNHL_ECOROUTINE);
+		goto erxit;
+	}
+
+	CNHL_ADD(tst->open_conns, 1);
+	conet_ctx_init(&ctx, NULL, -1);
+	if (req_tmo > 0)
+		conet_ctx_attach(&ctx, co_current());
+	if (wl_nurls == 0) {
+		memset(&curl, 0, sizeof(curl));
+		curl.meth = (char *) "GET";
+		curl.path = doc_urls[url_next];
+		url_next = (url_next + 1) % num_urls;
+		u = &curl;
+		nreqs = num_reqs;
+	} else if ((nreqs = (int) (cnhl_dist_draw(&wl_reqs) + 0.5)) < 1)
+		nreqs = 1;
+	for (i = 0; !stopldr && i < nreqs; i++) {
+		/*
+		 * Sessions leave between requests, while ramping down.
+		 */
+		if (i > 0 && wl_nphases > 0 &&
+		    tst->live_coros > cnhl_target(cnhl_mstime()))
+			break;
+		/*
+		 * The request timeout does not cover the think time, so the
+		 * previous request deadline must not cut it short.
+		 */
+		if (i > 0 && wl_thinking) {
+			if (req_tmo > 0)
+				conet_ctx_set_deadline(&ctx, -1);
+			if (conet_event_wait(&thinkev,
+					     (int) cnhl_dist_draw(&wl_think)) < 0 &&
+			    errno != ETIMEDOUT)
+				break;
+		}
+		if (wl_nurls > 0)
+			u = cnhl_pick_url();
+		if (req_tmo > 0)
+			conet_ctx_set_deadline(&ctx, req_tmo);
+		if (conet_rate_request(conn) < 0) {
+			cnhl_err(cnhl_ioerr(&ctx, CNHL_EWRITE));
+			break;
+		}
+		treq = cnhl_ustime();
+		if (cnhl_send_req(conn, u, ep->host, i + 1 == nreqs) < 0) {
+			cnhl_err(cnhl_ioerr(&ctx, CNHL_EWRITE));
 			break;
 		}
 		if ((ln = conet_readln(conn, &size)) == NULL) {
-			errors[CNHL_EREAD]++;
+			cnhl_err(cnhl_ioerr(&ctx, CNHL_EREAD));
 			break;
 		}
 		ver = strtok_r(ln, " ", &aux);
@@ -199,14 +957,14 @@ static void *cnhl_session(void *data) {
 		hcode = code != NULL && isdigit(*code) ? atoi(code): -1;
 		free(ln);
 		if (hcode < 200 || hcode >= 600) {
-			errors[CNHL_EPROTO]++;
+			cnhl_err(CNHL_EPROTO);
 			break;
 		}
-		htresps++;
+		CNHL_ADD(tst->htresps, 1);
 		for (clen = cclose = -1, chunked = 0;;) {
 			if ((ln = conet_readln(conn, &size)) == NULL) {
-				errors[CNHL_EREAD]++;
-				goto erxit;
+				cnhl_err(cnhl_ioerr(&ctx, CNHL_EREAD));
+				goto axit;
 			}
 			if (strcmp(ln, "\r\n") == 0) {
 				free(ln);
@@ -214,7 +972,7 @@ static void *cnhl_session(void *data) {
 			}
 			if (strncasecmp(ln, "Content-Length:", 15) == 0) {
 				for (ptr = ln + 15; *ptr == ' ' || *ptr == '\t'; ptr++);
-				clen = atoi(ptr);
+				clen = atoll(ptr);
 			} else if (strncasecmp(ln, "Transfer-Encoding:", 18) == 0) {
 				for (ptr = ln + 18; *ptr == ' ' || *ptr == '\t'; ptr++);
 				chunked = strncasecmp(ptr, "chunked", 7) == 0;
@@ -224,39 +982,41 @@ static void *cnhl_session(void *data) {
 			}
 			free(ln);
 		}
-		if (clen >= 0) {
-			for (n = 0; n < clen;) {
-				size = (clen - n) > sizeof(gbuf) ? sizeof(gbuf): clen - n;
-				if (conet_read(conn, gbuf, size) != size) {
-					errors[CNHL_EREAD]++;
-					goto erxit;
-				}
-				n += size;
-			}
-		} else if (chunked) {
-			if ((n = cnhl_chunkread(conn, gbuf, sizeof(gbuf))) < 0) {
-				errors[CNHL_EPROTO]++;
-				goto erxit;
-			}
-		} else {
+		if (chunked)
+			clen = -1;
+		else if (clen < 0) {
 			if (cclose == 0) {
-				errors[CNHL_EPROTO]++;
-				goto erxit;
+				cnhl_err(CNHL_EPROTO);
+				goto axit;
 			}
-			n = 0;
-			do {
-				if ((size = conet_read(conn, gbuf, sizeof(gbuf))) > 0)
-					n += size;
-			} while (size == sizeof(gbuf));
+			clen = -2;
+		}
+		if ((n = cnhl_read_body(conn, clen, &crc)) < 0) {
+			cnhl_err(errno == EBADMSG ? CNHL_EPROTO:
+				 cnhl_ioerr(&ctx, CNHL_EREAD));
+			goto axit;
+		}
+		if (verify_crc && crc != body_crc)
+			cnhl_err(CNHL_ECSUM);
+		CNHL_ADD(tst->rxbytes, n);
+		cnhl_err(CNHL_E200 + hcode / 100 - 2);
+		lat = cnhl_ustime() - treq;
+		CNHL_ADD(tst->lathist[cnhl_lat_bucket(lat)], 1);
+		if ((phn = cnhl_phase_at(treq / 1000, &target)) < wl_nphases) {
+			CNHL_ADD(tst->latsum[phn], lat);
+			if (lat > tst->latmax[phn])
+				CNHL_SET(tst->latmax[phn], lat);
 		}
-		rxbytes += n;
-		errors[CNHL_E200 + hcode / 100 - 2]++;
 	}
-	open_conns--;
+	axit:
+	conet_ctx_detach(&ctx);
+	CNHL_ADD(tst->open_conns, -1);
+	conet_sem_post(&actsem);
 	erxit:
 	conet_close_conn(conn);
+	CNHL_ADD(tst->tgs[tgn].live, -1);
 	dexit:
-	live_coros--;
+	CNHL_ADD(tst->live_coros, -1);
 
 	return data;
 }
@@ -264,10 +1024,10 @@ static void *cnhl_session(void *data) {
 static int cnhl_new_conn(void) {
 	coroutine_t co;
 
-	if ((co = co_create((void *) cnhl_session, NULL, NULL,
-			    stksize)) == NULL) {
+	if ((co = stkvsize > 0 ? conet_co_create((void *) cnhl_session, NULL):
+	     co_create((void *) cnhl_session, NULL, NULL, stksize)) == NULL) {
 		fprintf(stderr, "Unable to create coroutine\n");
-		errors[CNHL_ECOROUTINE]++;
+		cnhl_err(CNHL_ECOROUTINE);
 		return -1;
 	}
 	co_call(co);
@@ -275,28 +1035,159 @@ static int cnhl_new_conn(void) {
 	return 0;
 }
 
+/*
+ * Prints the combined statistics of all the load threads. With more than
+ * one thread, it runs in the main thread, which does not generate load.
+ */
 static void cnhl_update_stats(void) {
 	unsigned long long tc;
+
+	if ((tc = cnhl_mstime()) > tl + ts)
+		cnhl_sample_stats(tc);
+}
+
+static void cnhl_sample_stats(unsigned long long tc) {
 	double crate, brate;
+	struct cnhl_thread agg;
+
+	if (tc == tl)
+		return;
+	cnhl_phase_check(tc);
+	cnhl_collect(&agg);
+	crate = 1000.0 * (agg.htresps - last_htresps) / (double) (tc - tl);
+	brate = 1000.0 * (agg.rxbytes - last_rxbytes) / (double) (tc - tl);
+	acrate = CNHL_AVG(crate, acrate);
+	abrate = CNHL_AVG(brate, abrate);
+	if (acrate > max_acrate)
+		max_acrate = acrate;
+	if (abrate > max_abrate)
+		max_abrate = abrate;
+	if (tc > tlu + tu) {
+		fprintf(stdout, "%9ld  %9ld  %9ld  %12llu  %9.1f  %12.1f\n",
+			agg.live_coros, agg.open_conns, agg.htresps,
+			agg.rxbytes, acrate, abrate);
+		tlu = tc;
+	}
+	last_htresps = agg.htresps;
+	last_rxbytes = agg.rxbytes;
+	tl = tc;
+}
+
+/*
+ * With a single thread, the stats are sampled by a periodic timer of its
+ * loop, instead of being checked at every loop iteration.
+ */
+static void cnhl_stats_timer(struct conet_timer *tmr, void *data) {
+
+	cnhl_sample_stats(cnhl_mstime());
+}
+
+static void cnhl_lat_report(struct cnhl_thread const *agg) {
+	int i, j;
+	long n, cnt;
+	static double const pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+
+	for (i = 0, n = 0; i < CNHL_HBUCKETS; i++)
+		n += agg->lathist[i];
+	if (n == 0)
+		return;
+	fprintf(stdout, "Latency .................:");
+	for (i = 0, j = 0, cnt = 0; i < CNHL_HBUCKETS &&
+		     j < (int) (sizeof(pcts) / sizeof(pcts[0])); i++) {
+		for (cnt += agg->lathist[i]; j < (int) (sizeof(pcts) / sizeof(pcts[0])) &&
+			     cnt >= (long) ceil(n * pcts[j] / 100.0); j++)
+			fprintf(stdout, " p%g %.3f", pcts[j],
+				cnhl_bucket_lat(i) / 1000.0);
+	}
+	for (i = CNHL_HBUCKETS - 1; agg->lathist[i] == 0; i--);
+	fprintf(stdout, " max %.3f ms\n", cnhl_bucket_lat(i) / 1000.0);
+}
+
+/*
+ * Load thread body. Runs a coronet loop over the thread quotas, until
+ * the quotas (or the workload phases) are exhausted.
+ */
+static void *cnhl_run(void *data) {
+	int evwait;
+	long target;
 
-	if ((tc = cnhl_mstime()) > tl + ts) {
-		crate = 1000.0 * (htresps - last_htresps) / (double) (tc - tl);
-		brate = 1000.0 * (rxbytes - last_rxbytes) / (double) (tc - tl);
-		acrate = CNHL_AVG(crate, acrate);
-		abrate = CNHL_AVG(brate, abrate);
-		if (acrate > max_acrate)
-			max_acrate = acrate;
-		if (abrate > max_abrate)
-			max_abrate = abrate;
-		if (tc > tlu + tu) {
-			fprintf(stdout, "%9ld  %9ld  %9ld  %12llu  %9.1f  %12.1f\n",
-				live_coros, open_conns, htresps, rxbytes, acrate, abrate);
-			tlu = tc;
+	tst = (struct cnhl_thread *) data;
+	rndst[0] = (unsigned short) getpid();
+	rndst[1] = (unsigned short) time(NULL);
+	rndst[2] = (unsigned short) tst->tid;
+	url_next = tst->tid % (num_urls > 0 ? num_urls: 1);
+	tg_next = tst->tid % num_targets;
+	if (num_threads > 1 && co_thread_init() < 0) {
+		tst->status = -1;
+		goto exit;
+	}
+	if (conet_init() < 0) {
+		tst->status = -1;
+		goto thexit;
+	}
+	if (use_tls && (tls = conet_tls_create(tls_flags, NULL, NULL, NULL)) == NULL) {
+		fprintf(stderr, "Unable to setup TLS\n");
+		tst->status = -1;
+		goto cleanup;
+	}
+	if (glob_rps)
+		conet_set_rate(NULL, CONET_RATE_REQ,
+			       (glob_rps + num_threads - 1) / num_threads, 0);
+	if (glob_bps)
+		conet_set_rate(NULL, CONET_RATE_RX,
+			       (glob_bps + num_threads - 1) / num_threads, 0);
+	if (stkvsize > 0 &&
+	    conet_set_stacks(stkvsize, stksize, tst->max_active) < 0) {
+		fprintf(stderr, "Invalid stack size: %ld\n", stkvsize);
+		tst->status = -1;
+		goto cleanup;
+	}
+	conet_sem_init(&actsem, tst->max_active);
+	conet_event_init(&thinkev);
+	if (num_threads == 1) {
+		conet_timer_init(&sttmr, cnhl_stats_timer, NULL);
+		conet_timer_add(&sttmr, (int) ts, (int) ts);
+	}
+
+	/*
+	 * Think times expire on the timer wheel, which is only as precise as
+	 * the loop wakeups are frequent.
+	 */
+	evwait = wl_thinking || wl_nphases > 0 ? CNHL_THINK_EVWAIT:
+		CNHL_EVWAIT_TIMEO;
+	while (!stopldr && (tst->max_conns == 0 ||
+			    tst->total_conns < tst->max_conns)) {
+		if ((target = cnhl_target(cnhl_mstime())) < 0)
+			break;
+		while (tst->live_coros < target &&
+		       (tst->max_conns == 0 || tst->total_conns < tst->max_conns)) {
+			if (cnhl_new_conn() < 0)
+				goto erxit;
 		}
-		last_htresps = htresps;
-		last_rxbytes = rxbytes;
-		tl = tc;
+		conet_events_wait(evwait);
+		conet_events_dispatch(0);
+	}
+
+	erxit:
+
+	while (stopldr < 2 && tst->live_coros > 0) {
+		conet_events_wait(evwait);
+		conet_events_dispatch(0);
 	}
+	if (num_threads == 1)
+		conet_timer_del(&sttmr);
+
+	cleanup:
+	conet_cleanup();
+	if (tls != NULL)
+		conet_tls_free(tls);
+	thexit:
+	if (num_threads > 1)
+		co_thread_cleanup();
+	exit:
+	__atomic_store_n(&tst->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
 }
 
 static void cnhl_sigint(int sig) {
@@ -305,17 +1196,17 @@ static void cnhl_sigint(int sig) {
 }
 
 int main(int ac, char **av) {
-	int i;
-	unsigned long long ti;
-	struct ll_head *pos;
-	struct cnhl_waiter *wnode;
-	struct hostent *he;
-	struct in_addr inadr;
+	int i, j, error;
+	long tgtotal;
+	unsigned long long tc;
+	sigset_t sset, oset;
+	struct cnhl_thread agg;
+	char abuf[NI_MAXHOST + NI_MAXSERV + 4];
 
 	for (i = 1; i < ac; i++) {
 		if (strcmp(av[i], "-s") == 0) {
-			if (++i < ac)
-				svr_host = av[i];
+			if (++i < ac && num_hosts < CNHL_MAXTARGETS)
+				svr_hosts[num_hosts++] = av[i];
 		} else if (strcmp(av[i], "-p") == 0) {
 			if (++i < ac)
 				svr_port = atoi(av[i]);
@@ -328,9 +1219,21 @@ int main(int ac, char **av) {
 		} else if (strcmp(av[i], "-r") == 0) {
 			if (++i < ac)
 				num_reqs = atoi(av[i]);
+		} else if (strcmp(av[i], "-Q") == 0) {
+			if (++i < ac)
+				glob_rps = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-G") == 0) {
+			if (++i < ac)
+				glob_bps = strtoul(av[i], NULL, 0);
+		} else if (strcmp(av[i], "-D") == 0) {
+			if (++i < ac)
+				req_tmo = atoi(av[i]);
 		} else if (strcmp(av[i], "-S") == 0) {
 			if (++i < ac)
 				stksize = atoi(av[i]);
+		} else if (strcmp(av[i], "-g") == 0) {
+			if (++i < ac)
+				stkvsize = atol(av[i]);
 		} else if (strcmp(av[i], "-M") == 0) {
 			if (++i < ac)
 				max_conns = atol(av[i]);
@@ -340,89 +1243,171 @@ int main(int ac, char **av) {
 		} else if (strcmp(av[i], "-T") == 0) {
 			if (++i < ac)
 				ts = atol(av[i]);
+		} else if (strcmp(av[i], "-j") == 0) {
+			if (++i < ac)
+				num_threads = atoi(av[i]);
+		} else if (strcmp(av[i], "-d") == 0) {
+			if (++i < ac)
+				tg_spread = strcmp(av[i], "lc") == 0 ? CNHL_SLC: CNHL_SRR;
+		} else if (strcmp(av[i], "-B") == 0) {
+			if (++i < ac && cnhl_add_source(av[i]) < 0)
+				return 1;
+		} else if (strcmp(av[i], "-P") == 0) {
+			if (++i < ac &&
+			    (sscanf(av[i], "%d-%d", &src_plo, &src_phi) != 2 ||
+			     src_plo <= 0 || src_phi > 65535 || src_phi < src_plo)) {
+				cnhl_usage(av[0]);
+				return 1;
+			}
+		} else if (strcmp(av[i], "-L") == 0) {
+			use_tls = 1;
+		} else if (strcmp(av[i], "-E") == 0) {
+			tls_flags |= CONET_TLS_KTLS;
+		} else if (strcmp(av[i], "-w") == 0) {
+			if (++i < ac)
+				wl_path = av[i];
+		} else if (strcmp(av[i], "-V") == 0) {
+			if (++i < ac) {
+				verify_crc = 1;
+				body_crc = (unsigned int) strtoul(av[i], NULL, 16);
+			}
 		} else if (strcmp(av[i], "-h") == 0) {
 			cnhl_usage(av[0]);
 			return 1;
 		} else
 			break;
 	}
-	if (i == ac || svr_host == NULL || num_conns == 0) {
+	if (wl_path != NULL && cnhl_load_workload(wl_path) < 0)
+		return 1;
+	if ((i == ac && wl_nurls == 0) || num_hosts == 0 ||
+	    (num_conns == 0 && wl_nphases == 0) ||
+	    num_threads < 1 || num_threads > CNHL_MAXTHREADS) {
 		cnhl_usage(av[0]);
 		return 1;
 	}
 	signal(SIGINT, cnhl_sigint);
 	signal(SIGPIPE, SIG_IGN);
 	siginterrupt(SIGINT, 1);
-	if (max_active == 0)
-		max_active = num_conns;
 	num_urls = ac - i;
 	doc_urls = &av[i];
-	conet_llinit(&wlist);
-	if (inet_aton(svr_host, &inadr) == 0) {
-		if ((he = gethostbyname(svr_host)) == NULL) {
-			fprintf(stderr, "Unable to resolve: %s\n", svr_host);
+	for (i = 0; i < wl_nphases; i++) {
+		if (wl_phases[i].cstart > num_conns)
+			num_conns = wl_phases[i].cstart;
+		if (wl_phases[i].cend > num_conns)
+			num_conns = wl_phases[i].cend;
+	}
+	if (max_active == 0)
+		max_active = num_conns;
+	cnhl_crc_init();
+	for (j = 0; j < num_hosts; j++)
+		if (cnhl_add_hosts(svr_hosts[j]) < 0)
 			return 2;
-		}
-		memcpy(&inadr.s_addr, he->h_addr_list[0], he->h_length);
+	if (src_plo > 0 && src_phi - src_plo + 1 < num_threads) {
+		fprintf(stderr, "Source port range smaller than threads count\n");
+		return 1;
 	}
-	memset(&saddr, 0, sizeof(saddr));
-	saddr.sin_family = AF_INET;
-	saddr.sin_port = htons(svr_port);
-	memcpy(&saddr.sin_addr, &inadr.s_addr, 4);
-	if (conet_init() < 0)
-		return 2;
 
-	fprintf(stdout, "%9s  %9s  %9s  %12s  %9s  %12s\n",
-		"CONNS", "ACTIVE", "TRESP", "TBYTES", "RESPSEC", "BYTESEC");
-
-	ti = tlu = tl = cnhl_mstime();
-	while (!stopldr && (max_conns == 0 || total_conns < max_conns)) {
-		while (live_coros < num_conns &&
-		       (max_conns == 0 || total_conns < max_conns)) {
-			if (cnhl_new_conn() < 0)
-				goto erxit;
+	/*
+	 * Threads get an even share of the session quotas, and their own
+	 * copy of the active session semaphore.
+	 */
+	if ((thrs = (struct cnhl_thread *)
+	     aligned_alloc(64, num_threads * sizeof(struct cnhl_thread))) == NULL) {
+		perror("threads");
+		return 2;
+	}
+	memset(thrs, 0, num_threads * sizeof(struct cnhl_thread));
+	for (i = 0; i < num_threads; i++) {
+		thrs[i].tid = i;
+		thrs[i].num_conns = num_conns * (i + 1) / num_threads -
+			num_conns * i / num_threads;
+		thrs[i].max_conns = max_conns * (i + 1) / num_threads -
+			max_conns * i / num_threads;
+		if (max_conns > 0 && thrs[i].max_conns == 0)
+			thrs[i].max_conns = -1;
+		if ((thrs[i].max_active = max_active * (i + 1) / num_threads -
+		     max_active * i / num_threads) < 1)
+			thrs[i].max_active = 1;
+		if (src_plo > 0) {
+			thrs[i].plo = src_plo + (src_phi - src_plo + 1) * i / num_threads;
+			thrs[i].phi = src_plo + (src_phi - src_plo + 1) * (i + 1) /
+				num_threads - 1;
 		}
-		while (open_conns < max_active &&
-		       (pos = conet_llfirst(&wlist)) != NULL) {
-			wnode = CONET_LLENT(pos, struct cnhl_waiter, lnk);
-			conet_lldel_init(pos);
-			co_call(wnode->co);
+		if ((thrs[i].tgs = (struct cnhl_tgstat *)
+		     calloc(num_targets, sizeof(struct cnhl_tgstat))) == NULL) {
+			perror("targets");
+			return 2;
 		}
-
-		conet_events_wait(CNHL_EVWAIT_TIMEO);
-		conet_events_dispatch(0);
-
-		cnhl_update_stats();
 	}
 
-	erxit:
+	fprintf(stdout, "%9s  %9s  %9s  %12s  %9s  %12s\n",
+		"CONNS", "ACTIVE", "TRESP", "TBYTES", "RESPSEC", "BYTESEC");
 
-	while (stopldr < 2 && live_coros > 0) {
-		while (open_conns < max_active &&
-		       (pos = conet_llfirst(&wlist)) != NULL) {
-			wnode = CONET_LLENT(pos, struct cnhl_waiter, lnk);
-			conet_lldel_init(pos);
-			co_call(wnode->co);
+	tstart = tlu = tl = cnhl_mstime();
+	if (num_threads == 1)
+		cnhl_run(&thrs[0]);
+	else {
+		/*
+		 * SIGINT is only taken by the main thread, which leaves the
+		 * load threads running their loops undisturbed.
+		 */
+		sigemptyset(&sset);
+		sigaddset(&sset, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &sset, &oset);
+		for (i = 0; i < num_threads; i++) {
+			if (pthread_create(&thrs[i].thr, NULL, cnhl_run,
+					   &thrs[i]) != 0) {
+				fprintf(stderr, "Unable to create thread\n");
+				thrs[i].status = -1;
+				thrs[i].done = 1;
+				stopldr = 2;
+			}
 		}
-
-		conet_events_wait(CNHL_EVWAIT_TIMEO);
-		conet_events_dispatch(0);
-
-		cnhl_update_stats();
+		pthread_sigmask(SIG_SETMASK, &oset, NULL);
+		for (;;) {
+			for (i = 0; i < num_threads &&
+				     __atomic_load_n(&thrs[i].done, __ATOMIC_ACQUIRE); i++);
+			if (i == num_threads)
+				break;
+			usleep(CNHL_THINK_EVWAIT * 1000);
+			cnhl_update_stats();
+		}
+		for (i = 0; i < num_threads; i++)
+			if (thrs[i].status == 0)
+				pthread_join(thrs[i].thr, NULL);
 	}
 	cnhl_update_stats();
+	cnhl_phase_check(cnhl_mstime());
+	if (wl_curph >= 0 && wl_curph < wl_nphases &&
+	    (tc = cnhl_mstime()) > wl_tphase)
+		cnhl_phase_report(wl_curph, tc);
 
+	cnhl_collect(&agg);
 	fprintf(stdout,
 		"\n"
 		"Peak Connection Rate ....: %11.1f conn/sec\n"
 		"Peak Transfer Rate ......: %11.1f bytes/sec\n",
 		max_acrate, max_abrate);
+	if (use_tls)
+		fprintf(stdout, "TLS Resumed .............: %11ld\n", agg.tls_resumed);
+	cnhl_lat_report(&agg);
+	for (j = 0; num_targets > 1 && j < num_targets; j++) {
+		for (i = 0, tgtotal = 0; i < num_threads; i++)
+			tgtotal += thrs[i].tgs[j].total;
+		fprintf(stdout, "Target %-18s: %11ld conns\n",
+			cnhl_addr_str(&targets[j].addr, targets[j].alen, abuf,
+				      sizeof(abuf)), tgtotal);
+	}
 
 	fprintf(stderr, "\nError list:\n");
 	for (i = 0 ; i < CNHL_EMAX; i++)
-		fprintf(stderr, "\t%-12s  %ld\n", errstrs[i], errors[i]);
-	conet_cleanup();
+		fprintf(stderr, "\t%-12s  %ld\n", errstrs[i], agg.errors[i]);
+	for (i = 0, error = 0; i < num_threads; i++) {
+		if (thrs[i].status < 0)
+			error = 1;
+		free(thrs[i].tgs);
+	}
+	free(thrs);
 
-	return 0;
+	return error ? 2: 0;
 }
-
@@ -0,0 +1,330 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "coronet.h"
+
+
+
+#define CNSB_SWITCHES 10000000
+#define CNSB_CREATES 1000000
+#define CNSB_STKSIZE (1024 * 8)
+#define CNSB_CHKROUNDS 4
+#define CNSB_CHKRATE 1500
+#define CNSB_CHKREQS 3000
+#define CNSB_CHKRTOL 0.05
+
+
+
+/*
+ * Check mode waiter, recording the result of its semaphore wait.
+ */
+struct cnsb_waiter {
+	struct conet_sem *sem;
+	int done, error;
+};
+
+/*
+ * Check mode rate limited requester, timing its requests past the
+ * initial burst.
+ */
+struct cnsb_requester {
+	struct sk_conn *conn;
+	int done, error;
+	unsigned long long tstart, tend;
+};
+
+
+
+
+static unsigned long long cnsb_nstime(void);
+static void cnsb_usage(char const *prg);
+static void cnsb_pingpong(void *data);
+static void cnsb_noop(void *data);
+static void cnsb_semwait(void *data);
+static coroutine_t cnsb_start_waiter(struct cnsb_waiter *w,
+				     struct conet_sem *sem,
+				     struct conet_ctx *ctx);
+static void cnsb_run_loop(void);
+static void cnsb_request(void *data);
+static int cnsb_check_rate(void);
+static int cnsb_check(void);
+
+
+
+
+static long num_switches = CNSB_SWITCHES;
+static long num_creates = CNSB_CREATES;
+static int stksize = CNSB_STKSIZE;
+static volatile int stopco;
+
+
+
+
+static unsigned long long cnsb_nstime(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+static void cnsb_usage(char const *prg) {
+
+	fprintf(stderr, "Use: %s [-n NSWITCH (%ld)] [-c NCREATE (%ld)] [-S STKSIZE (%d)]\n"
+		"\t[-C] [-h]\n", prg, num_switches, num_creates, stksize);
+}
+
+static void cnsb_pingpong(void *data) {
+
+	while (!stopco)
+		co_resume();
+}
+
+static void cnsb_noop(void *data) {
+
+}
+
+static void cnsb_semwait(void *data) {
+	struct cnsb_waiter *w = (struct cnsb_waiter *) data;
+
+	w->error = conet_sem_wait(w->sem, -1) == 0 ? 0: errno;
+	w->done = 1;
+}
+
+static coroutine_t cnsb_start_waiter(struct cnsb_waiter *w,
+				     struct conet_sem *sem,
+				     struct conet_ctx *ctx) {
+	coroutine_t co;
+
+	w->sem = sem;
+	w->done = 0;
+	w->error = 0;
+	if ((co = conet_co_create(cnsb_semwait, w)) == NULL)
+		return NULL;
+	if (ctx != NULL)
+		conet_ctx_attach(ctx, co);
+	co_call(co);
+
+	return co;
+}
+
+static void cnsb_run_loop(void) {
+	int i;
+
+	for (i = 0; i < CNSB_CHKROUNDS; i++) {
+		conet_events_wait(0);
+		conet_events_dispatch(0);
+	}
+}
+
+static void cnsb_request(void *data) {
+	struct cnsb_requester *rq = (struct cnsb_requester *) data;
+	int i;
+
+	for (i = 0; i < CNSB_CHKRATE + CNSB_CHKREQS; i++) {
+		if (i == CNSB_CHKRATE)
+			rq->tstart = cnsb_nstime();
+		if (conet_rate_request(rq->conn) < 0) {
+			rq->error = errno;
+			break;
+		}
+	}
+	rq->tend = cnsb_nstime();
+	rq->done = 1;
+}
+
+/*
+ * Checks that the long run request rate matches the configured one, once
+ * the initial burst (which is the rate itself) has been used up.
+ */
+static int cnsb_check_rate(void) {
+	int sv[2];
+	double rate;
+	struct cnsb_requester rq;
+	coroutine_t co;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+		return -1;
+	memset(&rq, 0, sizeof(rq));
+	if ((co = conet_co_create(cnsb_request, &rq)) == NULL ||
+	    (rq.conn = conet_new_conn(sv[0], co)) == NULL ||
+	    conet_set_rate(rq.conn, CONET_RATE_REQ, CNSB_CHKRATE, 0) < 0)
+		return -1;
+	co_call(co);
+	while (!rq.done) {
+		conet_events_wait(-1);
+		conet_events_dispatch(0);
+	}
+	conet_close_conn(rq.conn);
+	close(sv[1]);
+	rate = 1e9 * CNSB_CHKREQS / (double) (rq.tend - rq.tstart);
+	if (rq.error != 0 || rate > CNSB_CHKRATE * (1 + CNSB_CHKRTOL) ||
+	    rate < CNSB_CHKRATE * (1 - CNSB_CHKRTOL)) {
+		fprintf(stderr, "Request rate: %.1f/s (configured %d/s) error=%d\n",
+			rate, CNSB_CHKRATE, rq.error);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Checks the wakeup ordering of the synchronization primitives, and the
+ * rate limits. A cancel landing after a post (but before the woken
+ * coroutine runs) must leave the post wakeup in place, and a cancel
+ * landing before a post must not make it get lost.
+ */
+static int cnsb_check(void) {
+	int n, fails = 0;
+	struct conet_sem sem;
+	struct conet_ctx ctx;
+	struct cnsb_waiter wa, wb;
+
+	conet_sem_init(&sem, 0);
+	conet_ctx_init(&ctx, NULL, -1);
+	if (cnsb_start_waiter(&wa, &sem, &ctx) == NULL)
+		return -1;
+	conet_sem_post(&sem);
+	conet_cancel(&ctx);
+	cnsb_run_loop();
+	conet_ctx_detach(&ctx);
+	if (!wa.done || wa.error != 0 || sem.count != 0) {
+		fprintf(stderr, "Post then cancel: done=%d error=%d count=%ld\n",
+			wa.done, wa.error, sem.count);
+		fails++;
+	}
+
+	conet_sem_init(&sem, 0);
+	conet_ctx_init(&ctx, NULL, -1);
+	if (cnsb_start_waiter(&wa, &sem, &ctx) == NULL ||
+	    cnsb_start_waiter(&wb, &sem, NULL) == NULL)
+		return -1;
+	conet_cancel(&ctx);
+	conet_sem_post(&sem);
+	cnsb_run_loop();
+	conet_ctx_detach(&ctx);
+	if (!wa.done || wa.error != ECANCELED || !wb.done || wb.error != 0 ||
+	    sem.count != 0) {
+		fprintf(stderr, "Cancel then post: done=%d,%d error=%d,%d count=%ld\n",
+			wa.done, wb.done, wa.error, wb.error, sem.count);
+		fails++;
+	}
+
+	if ((n = cnsb_check_rate()) < 0)
+		return -1;
+	fails += n;
+
+	return fails;
+}
+
+/*
+ * Measures the cost of the coroutine primitives the event loop relies on.
+ * Every wakeup is a co_call(), and every block a co_resume(), so the pair
+ * is the per-event switching overhead.
+ */
+int main(int ac, char **av) {
+	int i, check = 0, fails;
+	long n;
+	unsigned long long ts, tpair, tcreate, tgrow;
+	coroutine_t co;
+
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "-n") == 0) {
+			if (++i < ac)
+				num_switches = atol(av[i]);
+		} else if (strcmp(av[i], "-c") == 0) {
+			if (++i < ac)
+				num_creates = atol(av[i]);
+		} else if (strcmp(av[i], "-S") == 0) {
+			if (++i < ac)
+				stksize = atoi(av[i]);
+		} else if (strcmp(av[i], "-C") == 0) {
+			check = 1;
+		} else {
+			cnsb_usage(av[0]);
+			return 1;
+		}
+	}
+	if (num_switches <= 0 || num_creates <= 0) {
+		cnsb_usage(av[0]);
+		return 1;
+	}
+	if (conet_init() < 0)
+		return 2;
+	if (check) {
+		if ((fails = cnsb_check()) < 0) {
+			fprintf(stderr, "Unable to set up the checks\n");
+			return 2;
+		}
+		conet_cleanup();
+		fprintf(stdout, "Check ...............: %s\n",
+			fails == 0 ? "passed": "FAILED");
+
+		return fails == 0 ? 0: 3;
+	}
+
+	if ((co = co_create(cnsb_pingpong, NULL, NULL, stksize)) == NULL) {
+		fprintf(stderr, "Unable to create coroutine\n");
+		return 2;
+	}
+	ts = cnsb_nstime();
+	for (n = 0; n < num_switches; n++)
+		co_call(co);
+	tpair = cnsb_nstime() - ts;
+	stopco = 1;
+	co_call(co);
+
+	ts = cnsb_nstime();
+	for (n = 0; n < num_creates; n++) {
+		if ((co = co_create(cnsb_noop, NULL, NULL, stksize)) == NULL) {
+			fprintf(stderr, "Unable to create coroutine\n");
+			return 2;
+		}
+		co_call(co);
+	}
+	tcreate = cnsb_nstime() - ts;
+
+	ts = cnsb_nstime();
+	for (n = 0; n < num_creates; n++) {
+		if ((co = conet_co_create(cnsb_noop, NULL)) == NULL) {
+			fprintf(stderr, "Unable to create coroutine\n");
+			return 2;
+		}
+		co_call(co);
+	}
+	tgrow = cnsb_nstime() - ts;
+	conet_cleanup();
+
+	fprintf(stdout,
+		"Call/Resume Pair ....: %9.1f ns\n"
+		"Create/Exit .........: %9.1f ns\n"
+		"Create/Exit (Grow) ..: %9.1f ns\n",
+		(double) tpair / num_switches, (double) tcreate / num_creates,
+		(double) tgrow / num_creates);
+
+	return 0;
+}
@@ -0,0 +1,430 @@
+/*    Copyright 2023 Davide Libenzi
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "coronet.h"
+#include "coronet_lists.h"
+#include "coronet_timer.h"
+
+
+
+#define CNTB_TIMERS 1000000
+#define CNTB_HORIZON 60000
+#define CNTB_STEP 10
+#define CNTB_BUDGET 4096
+#define CNTB_CHKTIMERS 2000
+
+
+
+/*
+ * Check mode timer, with the reference heap entries pointing at it by
+ * index, and staying valid only while their generation matches.
+ */
+struct cntb_tmr {
+	struct conet_tmo tmo;
+	int armed, fired;
+	unsigned int gen;
+};
+
+struct cntb_hent {
+	mstime_t exptmo;
+	int id;
+	unsigned int gen;
+};
+
+
+
+
+static unsigned long long cntb_nstime(void);
+static void cntb_usage(char const *prg);
+static unsigned long long cntb_rand(void);
+static void cntb_hpush(mstime_t exptmo, int id, unsigned int gen);
+static void cntb_hpop(void);
+static void cntb_arm(int id, mstime_t exptmo);
+static void cntb_chk_fire(struct conet_tmo *tmo, void *data);
+static int cntb_chk_run(mstime_t tcurr, int budget);
+static int cntb_check(void);
+static void cntb_fire(struct conet_tmo *tmo, void *data);
+static int cntb_cmpull(void const *a, void const *b);
+static int cntb_bench(void);
+
+
+
+
+static long num_timers = CNTB_TIMERS;
+static int horizon = CNTB_HORIZON;
+static int tstep = CNTB_STEP;
+static int budget = CNTB_BUDGET;
+static long num_ops;
+static unsigned long long rndst = 88172645463325252ULL;
+static struct conet_tmrwheel tw;
+static struct cntb_tmr *ctmrs;
+static int num_ctmrs = CNTB_CHKTIMERS;
+static struct cntb_hent *heap;
+static long hcnt, hsize;
+static mstime_t tchk, tbound;
+static long chk_fired, chk_errors;
+static long bench_fired;
+
+
+
+
+static unsigned long long cntb_nstime(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+static void cntb_usage(char const *prg) {
+
+	fprintf(stderr, "Use: %s [-n NTIMERS (%ld)] [-H HORIZON (%d)] [-t STEP (%d)]\n"
+		"\t[-b BUDGET (%d)] [-c NOPS] [-s SEED] [-h]\n", prg, num_timers,
+		horizon, tstep, budget);
+}
+
+static unsigned long long cntb_rand(void) {
+
+	rndst ^= rndst << 13;
+	rndst ^= rndst >> 7;
+	rndst ^= rndst << 17;
+
+	return rndst;
+}
+
+static void cntb_hpush(mstime_t exptmo, int id, unsigned int gen) {
+	long i, p;
+	struct cntb_hent ent;
+
+	if (hcnt == hsize) {
+		hsize = hsize ? 2 * hsize: 1024;
+		if ((heap = (struct cntb_hent *)
+		     realloc(heap, hsize * sizeof(struct cntb_hent))) == NULL) {
+			perror("heap");
+			exit(2);
+		}
+	}
+	ent.exptmo = exptmo;
+	ent.id = id;
+	ent.gen = gen;
+	for (i = hcnt++; i > 0 && heap[p = (i - 1) / 2].exptmo > exptmo; i = p)
+		heap[i] = heap[p];
+	heap[i] = ent;
+}
+
+static void cntb_hpop(void) {
+	long i, c;
+	struct cntb_hent ent = heap[--hcnt];
+
+	for (i = 0; (c = 2 * i + 1) < hcnt; i = c) {
+		if (c + 1 < hcnt && heap[c + 1].exptmo < heap[c].exptmo)
+			c++;
+		if (heap[c].exptmo >= ent.exptmo)
+			break;
+		heap[i] = heap[c];
+	}
+	heap[i] = ent;
+}
+
+/*
+ * Arms (or re-arms) a check timer, invalidating its previous heap entry.
+ */
+static void cntb_arm(int id, mstime_t exptmo) {
+	struct cntb_tmr *t = &ctmrs[id];
+
+	t->tmo.exptmo = exptmo;
+	conet_tmr_add(&tw, &t->tmo);
+	t->armed = 1;
+	t->fired = 0;
+	cntb_hpush(exptmo, id, ++t->gen);
+}
+
+/*
+ * Fired timers must be armed, and expired within the bound of the run.
+ * Some of them also poke at other timers, which is what the loop does
+ * when a coroutine runs out of a timeout.
+ */
+static void cntb_chk_fire(struct conet_tmo *tmo, void *data) {
+	int id;
+	struct cntb_tmr *t = CONET_LLENT(tmo, struct cntb_tmr, tmo);
+
+	if (!t->armed || tmo->exptmo > tbound) {
+		fprintf(stderr, "Bad fire: id=%d armed=%d exptmo=%llu bound=%llu\n",
+			(int) (t - ctmrs), t->armed, tmo->exptmo, tbound);
+		chk_errors++;
+	}
+	t->armed = 0;
+	t->fired = 1;
+	chk_fired++;
+	switch (cntb_rand() % 8) {
+	case 0:
+		id = (int) (cntb_rand() % num_ctmrs);
+		cntb_arm(id, tchk + 1 + cntb_rand() % (64 * tstep));
+		break;
+	case 1:
+		id = (int) (cntb_rand() % num_ctmrs);
+		conet_tmr_cancel(&ctmrs[id].tmo);
+		ctmrs[id].armed = 0;
+		ctmrs[id].gen++;
+		break;
+	}
+}
+
+/*
+ * Runs the wheel to tcurr, until it catches up with it if the budget is
+ * limited, and then checks that all the reference heap entries within the
+ * bound fired.
+ */
+static int cntb_chk_run(mstime_t tcurr, int budget) {
+	long count;
+	struct cntb_tmr *t;
+
+	tchk = tcurr;
+	tbound = tw.origin + ((tcurr - tw.origin) / tw.step) * tw.step;
+	do
+		conet_tmr_run(&tw, tcurr, budget, cntb_chk_fire, NULL);
+	while (conet_tmr_next(&tw, tcurr) == 0);
+	for (; hcnt > 0 && heap[0].exptmo <= tbound; cntb_hpop()) {
+		t = &ctmrs[heap[0].id];
+		if (heap[0].gen != t->gen)
+			continue;
+		if (!t->fired) {
+			fprintf(stderr, "Missed fire: id=%d exptmo=%llu bound=%llu\n",
+				heap[0].id, heap[0].exptmo, tbound);
+			chk_errors++;
+		}
+	}
+	for (count = 0, t = ctmrs; t < ctmrs + num_ctmrs; t++)
+		if (t->tmo.tick != 0)
+			count++;
+	if (count != tw.count) {
+		fprintf(stderr, "Bad count: %ld linked, %ld counted\n", count,
+			tw.count);
+		chk_errors++;
+	}
+
+	return chk_errors ? -1: 0;
+}
+
+/*
+ * Randomized check against a reference heap. Expire times are always in
+ * the future of the clock, span all the wheel levels (and past the top
+ * one), and the clock moves by steps, partial steps, and large jumps.
+ */
+static int cntb_check(void) {
+	int id;
+	long n;
+	mstime_t tcurr, tmax;
+	struct cntb_tmr *t;
+
+	if ((ctmrs = (struct cntb_tmr *)
+	     calloc(num_ctmrs, sizeof(struct cntb_tmr))) == NULL) {
+		perror("timers");
+		return 2;
+	}
+	tcurr = 1000000;
+	conet_tmr_init(&tw, tcurr, tstep);
+	for (id = 0; id < num_ctmrs; id++)
+		conet_llinit(&ctmrs[id].tmo.lnk);
+	tmax = (mstime_t) tstep << (CONET_TMR_LVLBITS * CONET_TMR_LEVELS + 1);
+	for (n = 0; n < num_ops; n++) {
+		id = (int) (cntb_rand() % num_ctmrs);
+		t = &ctmrs[id];
+		switch (cntb_rand() % 16) {
+		case 0: case 1: case 2: case 3: case 4:
+			cntb_arm(id, tcurr + 1 + cntb_rand() % (64 * tstep));
+			break;
+		case 5: case 6:
+			cntb_arm(id, tcurr + 1 + cntb_rand() % (4096 * tstep));
+			break;
+		case 7:
+			cntb_arm(id, tcurr + 1 + cntb_rand() % tmax);
+			break;
+		case 8: case 9:
+			conet_tmr_cancel(&t->tmo);
+			t->armed = 0;
+			t->gen++;
+			break;
+		case 10:
+			conet_tmr_del(&tw, &t->tmo);
+			t->armed = 0;
+			t->gen++;
+			break;
+		case 11: case 12: case 13:
+			tcurr += cntb_rand() % (2 * tstep);
+			if (cntb_chk_run(tcurr, 0) < 0)
+				return 1;
+			break;
+		case 14:
+			tcurr += cntb_rand() % (300 * tstep);
+			if (cntb_chk_run(tcurr, 1 + cntb_rand() % 64) < 0)
+				return 1;
+			break;
+		case 15:
+			if (cntb_rand() % 64 == 0) {
+				tcurr += cntb_rand() % tmax;
+				if (cntb_chk_run(tcurr, 0) < 0)
+					return 1;
+			}
+			break;
+		}
+	}
+	tcurr += tmax;
+	if (cntb_chk_run(tcurr, 0) < 0)
+		return 1;
+	fprintf(stdout,
+		"Operations ..........: %9ld\n"
+		"Fired ...............: %9ld\n"
+		"Errors ..............: %9ld\n",
+		num_ops, chk_fired, chk_errors);
+	free(ctmrs);
+	free(heap);
+
+	return 0;
+}
+
+static void cntb_fire(struct conet_tmo *tmo, void *data) {
+
+	bench_fired++;
+}
+
+static int cntb_cmpull(void const *a, void const *b) {
+	unsigned long long x = *(unsigned long long const *) a,
+		y = *(unsigned long long const *) b;
+
+	return x < y ? -1: (x > y ? 1: 0);
+}
+
+/*
+ * Arms num_timers timers over the horizon, re-arms them all later (which
+ * the wheel does in place), lazily cancels a fourth of them, and then
+ * runs the wheel tick by tick until they all expired. The run time of
+ * every tick is what the loop would see as added latency.
+ */
+static int cntb_bench(void) {
+	long i, nticks, ntk;
+	unsigned long long ts, tarm, trearm, trun, *tks;
+	mstime_t tcurr;
+	struct conet_tmo *tmrs;
+
+	if ((tmrs = (struct conet_tmo *)
+	     calloc(num_timers, sizeof(struct conet_tmo))) == NULL) {
+		perror("timers");
+		return 2;
+	}
+	nticks = 2 * horizon / tstep + 2;
+	if ((tks = (unsigned long long *)
+	     calloc(nticks, sizeof(unsigned long long))) == NULL) {
+		perror("ticks");
+		free(tmrs);
+		return 2;
+	}
+	tcurr = 1000000;
+	conet_tmr_init(&tw, tcurr, tstep);
+	for (i = 0; i < num_timers; i++)
+		conet_llinit(&tmrs[i].lnk);
+
+	ts = cntb_nstime();
+	for (i = 0; i < num_timers; i++) {
+		tmrs[i].exptmo = tcurr + 1 + cntb_rand() % horizon;
+		conet_tmr_add(&tw, &tmrs[i]);
+	}
+	tarm = cntb_nstime() - ts;
+
+	ts = cntb_nstime();
+	for (i = 0; i < num_timers; i++) {
+		tmrs[i].exptmo += horizon / 2;
+		conet_tmr_add(&tw, &tmrs[i]);
+	}
+	trearm = cntb_nstime() - ts;
+	for (i = 0; i < num_timers; i += 4)
+		conet_tmr_cancel(&tmrs[i]);
+
+	for (ntk = 0, trun = 0; tw.count > 0 && ntk < nticks; ntk++) {
+		tcurr += tstep;
+		ts = cntb_nstime();
+		conet_tmr_run(&tw, tcurr, budget, cntb_fire, NULL);
+		tks[ntk] = cntb_nstime() - ts;
+		trun += tks[ntk];
+	}
+	qsort(tks, ntk, sizeof(unsigned long long), cntb_cmpull);
+
+	fprintf(stdout,
+		"Timers ..............: %9ld\n"
+		"Arm .................: %9.1f ns\n"
+		"Re-arm (Later) ......: %9.1f ns\n"
+		"Fired ...............: %9ld (%.1f Mfires/sec)\n"
+		"Ticks ...............: %9ld (%ld left armed)\n"
+		"Tick Time ...........: p50 %.1f p99 %.1f p99.9 %.1f max %.1f us\n",
+		num_timers, (double) tarm / num_timers,
+		(double) trearm / num_timers, bench_fired,
+		trun ? 1000.0 * bench_fired / trun: 0.0, ntk, tw.count,
+		tks[ntk / 2] / 1000.0, tks[ntk * 99 / 100] / 1000.0,
+		tks[ntk * 999 / 1000] / 1000.0, tks[ntk - 1] / 1000.0);
+	free(tks);
+	free(tmrs);
+
+	return 0;
+}
+
+/*
+ * Without -c, benchmarks the loop timer wheel. With -c, runs NOPS random
+ * operations on it, checking every run against a reference heap.
+ */
+int main(int ac, char **av) {
+	int i;
+
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "-n") == 0) {
+			if (++i < ac)
+				num_timers = atol(av[i]);
+		} else if (strcmp(av[i], "-H") == 0) {
+			if (++i < ac)
+				horizon = atoi(av[i]);
+		} else if (strcmp(av[i], "-t") == 0) {
+			if (++i < ac)
+				tstep = atoi(av[i]);
+		} else if (strcmp(av[i], "-b") == 0) {
+			if (++i < ac)
+				budget = atoi(av[i]);
+		} else if (strcmp(av[i], "-c") == 0) {
+			if (++i < ac)
+				num_ops = atol(av[i]);
+		} else if (strcmp(av[i], "-s") == 0) {
+			if (++i < ac)
+				rndst = strtoull(av[i], NULL, 0) | 1;
+		} else {
+			cntb_usage(av[0]);
+			return 1;
+		}
+	}
+	if (num_timers <= 0 || horizon <= 0 || tstep <= 0 || num_ops < 0) {
+		cntb_usage(av[0]);
+		return 1;
+	}
+
+	return num_ops > 0 ? cntb_check(): cntb_bench();
+}